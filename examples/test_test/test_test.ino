@@ -14,10 +14,6 @@
 
 #include "misc.hpp"
 
-void lil_run(lil_t lil, char* source) {
-    lil_free_value(lil_parse(lil, source, 0, 1));
-}
-
 lil_t lil;
 
 SFE_MAX1704X battery(SFE_MAX17048);
@@ -91,13 +87,18 @@ void setup() {
     lilduino_ir_init(lil);
     lilduino_battery_init(lil, &battery);
 
-    // Run main file
+    // Run main file, a piece at a time from loop()
     Serial.println("LIL initialized...");
-    lil_run(lil, (char*)kernel);
-
-    // Clean up
-    Serial.println("lil_run() returned, cleaning up");
-    lil_free(lil);
+    lil_start(lil, kernel, 0, 1);
 }
 
-void loop() {}
+void loop() {
+    if (lil == NULL) return;
+    if (lil_resume(lil) == LIL_RUN_DONE) {
+        // Clean up
+        Serial.println("kernel returned, cleaning up");
+        lil_free_value(lil_run_result(lil));
+        lil_free(lil);
+        lil = NULL;
+    }
+}
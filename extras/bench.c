@@ -0,0 +1,164 @@
+/*
+ * Times LIL commands on large inputs, to check the figures given for them.
+ * Build it on the host with
+ *
+ *     cc -O2 -Isrc -o bench extras/bench.c src/lil.c -lm
+ *
+ * and run it as
+ *
+ *     ./bench [name ...]
+ *
+ * which runs every benchmark whose name starts with one of the names (all
+ * of them without any).  Each one sets up its input once in a fresh
+ * interpreter and then runs its code until at least a quarter of a second
+ * has passed, printing the time per run and, if the setup put the number of
+ * bytes the code goes through in the variable "bytes", the throughput.
+ *
+ * Building a second copy with -DLIL_DISABLE_SSE2 gives the plain loops to
+ * compare "./bench scan" against.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lil.h"
+
+typedef struct bench_t
+{
+    const char* name;
+    const char* setup; /* run once before the code is timed */
+    const char* code;
+} bench_t;
+
+/* 100 KB of sensor readings as CSV, one line per reading */
+#define CSV_SETUP \
+    "strbuf create csv\n" \
+    "for {set i 0} {$i < 4500} {inc i} {strbuf append csv \"${i},23.5,1013.2,ok\\n\"}\n" \
+    "set csv [strbuf take csv]\n" \
+    "set bytes [length $csv]\n"
+
+/* 100 KB of text that needs no quoting, as one word and as a list of 1000
+ * words, for the scans that SSE2 speeds up */
+#define TEXT_SETUP \
+    "strbuf create text\n" \
+    "for {set i 0} {$i < 1000} {inc i} {strbuf append text abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUV}\n" \
+    "set text [strbuf take text]\n" \
+    "set words [split $text W]\n" \
+    "set bytes [length $text]\n"
+
+/* a dictionary d and the flat key value list l it used to be emulated
+ * with, both with n entries, and the key in the middle */
+#define DICT_SETUP(n) \
+    "for {set i 0} {$i < " n "} {inc i} {dict set d k$i $i; append l k$i $i}\n" \
+    "set key k[expr " n " / 2]\n"
+#define DICT_GET "dict get $d $key"
+#define LIST_GET "index $l [expr [indexof $l $key] + 1]"
+
+/* about 7 KB of telemetry as JSON, the value it decodes to and the schema
+ * that turns it back into the same JSON */
+#define JSON_SETUP \
+    "strbuf create json\n" \
+    "strbuf append json {[}\n" \
+    "for {set i 0} {$i < 100} {inc i} {\n" \
+    "    if $i {strbuf append json ,}\n" \
+    "    strbuf appendf json {{\"id\":%d,\"name\":\"sensor %d\",\"temp\":23.5,\"ok\":true,\"tags\":[\"a\",\"b\"]}} $i $i\n" \
+    "}\n" \
+    "strbuf append json {]}\n" \
+    "set json [strbuf take json]\n" \
+    "set value [json decode $json]\n" \
+    "set schema {list {obj ok bool tags {list str} * auto}}\n" \
+    "set bytes [length $json]\n"
+
+/* 1000 samples as a list and as a float64 array */
+#define SAMPLES_SETUP \
+    "for {set i 0} {$i < 1000} {inc i} {append samples [expr ($i * 37) % 1024]}\n" \
+    "set a [array from float64 $samples]\n"
+
+static const bench_t benches[] = {
+    {"repstr csv", CSV_SETUP, "repstr $csv , {; }"},
+    {"split csv lines", CSV_SETUP, "split $csv \"\\n\""},
+    {"split csv fields", CSV_SETUP, "split $csv ,"},
+    {"scan quote", TEXT_SETUP, "list $text"},
+    {"scan words", TEXT_SETUP, "count $words"},
+    {"scan script", TEXT_SETUP "set cmd \"set x $text\"\n", "eval $cmd"},
+    {"json decode", JSON_SETUP, "json decode $json"},
+    {"json encode", JSON_SETUP, "json encode $value $schema"},
+    {"array sum count", SAMPLES_SETUP, "array sum float64 $a; array count float64 $a > 512"},
+    {"array list sum count", SAMPLES_SETUP,
+        "set sum 0; set n 0; foreach x $samples {set sum [expr $sum + $x]; if {$x > 512} {inc n}}"},
+    {"dict get 10", DICT_SETUP("10"), DICT_GET},
+    {"dict get 1k", DICT_SETUP("1000"), DICT_GET},
+    {"dict get 100k", DICT_SETUP("100000"), DICT_GET},
+    {"dict list get 10", DICT_SETUP("10"), LIST_GET},
+    {"dict list get 1k", DICT_SETUP("1000"), LIST_GET},
+    {"dict list get 100k", DICT_SETUP("100000"), LIST_GET},
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* runs code once, returning 0 and printing the error if it failed */
+static int run(lil_t lil, const bench_t* bench, const char* code)
+{
+    const char* msg;
+    size_t pos;
+    lil_free_value(lil_parse(lil, code, 0, 1));
+    if (lil_error(lil, &msg, &pos)) {
+        fprintf(stderr, "%s: error at %u: %s\n", bench->name, (unsigned)pos, msg);
+        return 0;
+    }
+    return 1;
+}
+
+static int time_bench(const bench_t* bench)
+{
+    lil_t lil = lil_new();
+    double start, secs;
+    long runs = 0, i, batch = 1;
+    lil_value_t bytes;
+    if (!run(lil, bench, bench->setup)) {
+        lil_free(lil);
+        return 0;
+    }
+    start = now();
+    do {
+        for (i=0; i<batch; i++)
+            if (!run(lil, bench, bench->code)) {
+                lil_free(lil);
+                return 0;
+            }
+        runs += batch;
+        batch *= 2;
+        secs = now() - start;
+    } while (secs < 0.25);
+    bytes = lil_get_var(lil, "bytes");
+    printf("%-24s %10.3f ms", bench->name, secs*1000/runs);
+    if (lil_to_integer(bytes) > 0)
+        printf(" %10.1f MB/s", lil_to_integer(bytes)*runs/secs/1e6);
+    printf("\n");
+    lil_free(lil);
+    return 1;
+}
+
+static int wanted(const char* name, int argc, char** argv)
+{
+    int i;
+    if (argc < 2) return 1;
+    for (i=1; i<argc; i++)
+        if (!strncmp(name, argv[i], strlen(argv[i]))) return 1;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    size_t i;
+    int ok = 1;
+    for (i=0; i<sizeof(benches)/sizeof(benches[0]); i++)
+        if (wanted(benches[i].name, argc, argv)) ok &= time_bench(&benches[i]);
+    return ok ? 0 : 1;
+}
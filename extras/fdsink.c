@@ -0,0 +1,107 @@
+/*
+ * Checks lil_embedded_stream with a sink that writes each chunk to a file
+ * descriptor, the way a host sends a page to a socket.  Build it on the host
+ * with
+ *
+ *     cc -Isrc -o fdsink extras/fdsink.c src/lil.c -lm
+ *
+ * and run it as
+ *
+ *     ./fdsink
+ *
+ * It prints "ok" and exits with 0 if the page arrived whole through a pipe
+ * and a sink that refuses output stopped the template.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lil.h"
+
+static const char page[] =
+    "<ul>\n"
+    "<?lil for {set i 0} {$i < 300} {inc i} { write \"<li>$i</li>\\n\" } ?>"
+    "</ul>\n";
+
+/* writes the chunk to the descriptor userdata points to, returning 0 when
+ * the other end went away so the template stops */
+static int fd_sink(lil_t lil, const char* data, size_t len, void* userdata)
+{
+    int fd = *(int*)userdata;
+    (void)lil;
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return 0;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int closed_sink(lil_t lil, const char* data, size_t len, void* userdata)
+{
+    (void)lil;
+    (void)data;
+    (void)len;
+    (*(int*)userdata)++;
+    return 0;
+}
+
+/* reads everything from fd until the writer closes it */
+static char* read_all(int fd, size_t* size)
+{
+    size_t cap = 4096;
+    char* buffer = malloc(cap + 1);
+    ssize_t n;
+    *size = 0;
+    while (buffer && (n = read(fd, buffer + *size, cap - *size)) > 0) {
+        *size += (size_t)n;
+        if (*size == cap) {
+            char* more = realloc(buffer, cap*2 + 1);
+            if (!more) {
+                free(buffer);
+                return NULL;
+            }
+            buffer = more;
+            cap *= 2;
+        }
+    }
+    if (buffer) buffer[*size] = 0;
+    return buffer;
+}
+
+static int fail(const char* what)
+{
+    fprintf(stderr, "fdsink: %s\n", what);
+    return 1;
+}
+
+int main(void)
+{
+    lil_t lil;
+    int fds[2], ok, calls = 0;
+    char* expected;
+    char* streamed;
+    size_t size;
+    /* the page is smaller than a pipe's buffer, so it can all be written
+     * before it is read back */
+    if (pipe(fds)) return fail("can't make a pipe");
+    lil = lil_new();
+    expected = lil_embedded(lil, page, 0);
+    ok = lil_embedded_stream(lil, page, 0, fd_sink, &fds[1]);
+    close(fds[1]);
+    streamed = read_all(fds[0], &size);
+    close(fds[0]);
+    if (!ok) return fail("the stream wasn't sent whole");
+    if (!expected || !streamed) return fail("out of memory");
+    if (size != strlen(expected) || memcmp(streamed, expected, size))
+        return fail("the streamed page differs from lil_embedded's");
+    if (lil_embedded_stream(lil, page, 0, closed_sink, &calls) || calls != 1)
+        return fail("a closed sink didn't stop the template");
+    lil_freemem(expected);
+    free(streamed);
+    lil_free(lil);
+    printf("ok\n");
+    return 0;
+}
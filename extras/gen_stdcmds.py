@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# Regenerates the perfect hash for the built-in command table in src/lil.c.
+# Run it after adding or removing an entry of stdcmds[]:
+#
+#     python3 extras/gen_stdcmds.py [path/to/lil.c]
+#
+# It reads the names from stdcmds[], looks for a seed that gives every name its
+# own slot and rewrites the part between the "generated" markers of the given
+# file (src/lil.c next to this script by default).
+
+import argparse
+import os
+import re
+import sys
+
+LIL_C = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "lil.c")
+BEGIN = "/* generated by extras/gen_stdcmds.py, do not edit */\n"
+END = "/* end of generated part */\n"
+
+
+def std_hash(seed, name):
+    # must match find_stdcmd() in lil.c
+    h = seed
+    for ch in name.encode():
+        h = (h * 31 + ch) & 0xFFFFFFFF
+    return h ^ (h >> 15)
+
+
+def find_seed(names, slots):
+    for seed in range(1, 1000000):
+        used = set()
+        for name in names:
+            slot = std_hash(seed, name) & (slots - 1)
+            if slot in used:
+                break
+            used.add(slot)
+        else:
+            return seed
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Regenerate the perfect hash of the built-in command table.")
+    parser.add_argument("file", nargs="?", default=LIL_C, help="the lil.c to rewrite (default: %(default)s)")
+    args = parser.parse_args()
+    with open(args.file) as f:
+        src = f.read()
+    table = re.search(r"static const struct _lil_func_t stdcmds\[\] = \{\n(.*?)\n\};", src, re.S)
+    if not table:
+        sys.exit("stdcmds[] not found")
+    names = re.findall(r'\{"([^"]+)",', table.group(1))
+    if len(names) > 255:
+        sys.exit("too many built-in commands for an unsigned char slot table")
+    slots = 256
+    while True:
+        seed = find_seed(names, slots)
+        if seed is not None:
+            break
+        slots *= 2
+    slot = [0] * slots
+    for i, name in enumerate(names):
+        slot[std_hash(seed, name) & (slots - 1)] = i + 1
+    out = [BEGIN,
+           "#define STDCMD_SEED %dUL\n" % seed,
+           "#define STDCMD_SLOTMASK 0x%X\n" % (slots - 1),
+           "static const unsigned char stdcmd_slot[%d] = {\n" % slots]
+    for i in range(0, slots, 16):
+        out.append("    " + ", ".join("%d" % v for v in slot[i:i + 16]) + ",\n")
+    out.append("};\n")
+    out.append(END)
+    if BEGIN not in src or END not in src:
+        sys.exit("generated part not found")
+    start = src.index(BEGIN)
+    end = src.index(END) + len(END)
+    src = src[:start] + "".join(out) + src[end:]
+    with open(args.file, "w") as f:
+        f.write(src)
+    print("%d commands, %d slots, seed %d" % (len(names), slots, seed))
+
+
+if __name__ == "__main__":
+    main()
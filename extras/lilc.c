@@ -0,0 +1,70 @@
+/*
+ * Compiles LIL scripts into images that source runs without scanning them
+ * again (see lil_compile in src/lil.c).  Build it on the host with
+ *
+ *     cc -Isrc -o lilc extras/lilc.c src/lil.c -lm
+ *
+ * and run it as
+ *
+ *     ./lilc script.lil script.lilc
+ *
+ * The image can then be put on the SD card in place of the script.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lil.h"
+
+static char* read_file(const char* name, size_t* size)
+{
+    FILE* f = fopen(name, "rb");
+    char* buffer;
+    long len;
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buffer = malloc(len + 1);
+    if (buffer) {
+        *size = fread(buffer, 1, len, f);
+        buffer[*size] = 0;
+    }
+    fclose(f);
+    return buffer;
+}
+
+int main(int argc, char** argv)
+{
+    size_t len, size;
+    char* code;
+    void* image;
+    FILE* f;
+    lil_t lil;
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s script.lil image.lilc\n", argv[0]);
+        return 1;
+    }
+    code = read_file(argv[1], &len);
+    if (!code) {
+        fprintf(stderr, "%s: can't read %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    lil = lil_new();
+    image = lil_compile(lil, code, len, &size);
+    lil_free(lil);
+    free(code);
+    if (!image) {
+        fprintf(stderr, "%s: can't compile %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    f = fopen(argv[2], "wb");
+    if (!f || fwrite(image, 1, size, f) != size) {
+        fprintf(stderr, "%s: can't write %s\n", argv[0], argv[2]);
+        if (f) fclose(f);
+        lil_freemem(image);
+        return 1;
+    }
+    fclose(f);
+    lil_freemem(image);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Measures how the interpreter pool (lil_pool_new, lil_pool_get and
+ * lil_pool_put in src/lil.c) scales with threads.  Build it on the host with
+ *
+ *     cc -O2 -DLIL_ENABLE_THREADS -Isrc -o poolbench extras/poolbench.c src/lil.c -lm -lpthread
+ *
+ * and run it as
+ *
+ *     ./poolbench [jobs per thread] [threads]
+ *
+ * It runs the same job with 1, 2, 4, ... threads up to [threads] (the number
+ * of cores by default), each thread taking an interpreter from a shared pool
+ * for every job, and prints the jobs per second and the speedup over one
+ * thread.  It exits with 1 if a job gave the wrong result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "lil.h"
+
+/* sums a loop through a native and a script function, then changes the
+ * commands so the pool has to undo it when the interpreter is put back */
+static const char job[] =
+    "set s 0\n"
+    "for {set i 0} {$i < 2000} {inc i} {set s [expr $s + [twice $i] + [sq 2]]}\n"
+    "func twice {x} {return 0}\n"
+    "rename sq sq2\n"
+    "set s\n";
+
+#define JOB_RESULT (3998000 + 8000)
+
+static lil_pool_t pool;
+static int jobs = 200;
+
+static LILCALLBACK lil_value_t fnc_twice(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    (void)lil;
+    return lil_alloc_integer(argc ? 2*lil_to_integer(argv[0]) : 0);
+}
+
+static LILCALLBACK void setup(lil_t lil)
+{
+    lil_register(lil, "twice", fnc_twice);
+    lil_free_value(lil_parse(lil, "func sq {x} {return [expr $x * $x]}", 0, 1));
+}
+
+static void* worker(void* arg)
+{
+    long* bad = arg;
+    int i;
+    for (i=0; i<jobs; i++) {
+        lil_t lil = lil_pool_get(pool);
+        lil_value_t r = lil_parse(lil, job, 0, 1);
+        if (lil_to_integer(r) != JOB_RESULT) (*bad)++;
+        lil_free_value(r);
+        lil_pool_put(pool, lil);
+    }
+    return NULL;
+}
+
+/* runs jobs on count threads and returns the time it took in seconds */
+static double run(int count, long* bad)
+{
+    pthread_t* threads = malloc(count*sizeof(pthread_t));
+    long* bads = calloc(count, sizeof(long));
+    struct timespec start, end;
+    int i;
+    if (!threads || !bads) {
+        free(threads);
+        free(bads);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<count; i++) pthread_create(&threads[i], NULL, worker, &bads[i]);
+    for (i=0; i<count; i++) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i=0; i<count; i++) *bad += bads[i];
+    free(threads);
+    free(bads);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+}
+
+int main(int argc, char** argv)
+{
+    long most = sysconf(_SC_NPROCESSORS_ONLN), bad = 0;
+    double base = 0;
+    int count;
+    if (argc > 1) jobs = atoi(argv[1]);
+    if (argc > 2) most = atol(argv[2]);
+    if (argc > 3 || jobs <= 0 || (argc > 2 && most <= 0)) {
+        fprintf(stderr, "usage: %s [jobs per thread] [threads]\n", argv[0]);
+        return 1;
+    }
+    if (most < 1) most = 1;
+    pool = lil_pool_new((size_t)most, setup);
+    if (!pool) {
+        fprintf(stderr, "%s: can't make the pool\n", argv[0]);
+        return 1;
+    }
+    printf("up to %ld threads, %d jobs per thread\n", most, jobs);
+    for (count=1;; count *= 2) {
+        double secs, rate;
+        if (count > most) count = (int)most;
+        secs = run(count, &bad);
+        if (secs < 0) break;
+        rate = count*jobs/secs;
+        if (count == 1) base = rate;
+        printf("%3d threads: %8.0f jobs/s  %5.2fx\n", count, rate, rate/base);
+        if (count == most) break;
+    }
+    lil_pool_free(pool);
+    if (bad) {
+        fprintf(stderr, "%s: %ld jobs gave the wrong result\n", argv[0], bad);
+        return 1;
+    }
+    return 0;
+}
@@ -27,20 +27,76 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
 #include "lil.h"
 
 /* Enable limiting recursive calls to lil_parse - this can be used to avoid call stack
  * overflows and is also useful when running through an automated fuzzer like AFL */
 #define LIL_ENABLE_RECLIMIT 10000
 
+/* Enable locking in the interpreter pool so that lil_pool_get and lil_pool_put can
+ * be called from several threads at once (needs pthreads) */
+/* #define LIL_ENABLE_THREADS */
+
+#ifdef LIL_ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+/* Enable mapping scripts with mmap for source on POSIX hosts instead of
+ * copying them into memory */
+#if defined(__unix__) || defined(__APPLE__)
+#define LIL_ENABLE_MMAP
+#endif
+
+#ifdef LIL_ENABLE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Enable scanning strings 16 bytes at a time with SSE2 on hosts that have it
+ * (define LIL_DISABLE_SSE2 to use the plain loops, e.g. to compare them) */
+#if defined(__SSE2__) && !defined(LIL_DISABLE_SSE2)
+#define LIL_ENABLE_SSE2
+#endif
+
+#ifdef LIL_ENABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* orders the writes to a ring's values before the write of its counters */
+#if defined(__GNUC__)
+#define RING_BARRIER() __sync_synchronize()
+#else
+#define RING_BARRIER()
+#endif
+
+/* adds 1 to a counter that interpreters made in several threads share */
+#if defined(__GNUC__)
+#define COUNT_UP(n) __sync_fetch_and_add(&(n), 1)
+#else
+#define COUNT_UP(n) ((n)++)
+#endif
+
 #define ERROR_NOERROR 0
 #define ERROR_DEFAULT 1
 #define ERROR_FIXHEAD 2
 
-#define CALLBACKS 10
+#define CALLBACKS 11
 #define MAX_CATCHER_DEPTH 16384
 #define HASHMAP_CELLS 256
 #define HASHMAP_CELLMASK 0xFF
+#define STDCMD_HIDDEN(lil, i) ((lil)->stdoff[(i) >> 3] & (1 << ((i) & 7)))
+#define EXEC_SLICE 256 /* steps a coroutine runs before the next one gets a turn */
+#define SOURCE_CHUNK 256 /* bytes source reads at a time */
+#define EMBED_CACHE 4 /* compiled templates lil_embedded keeps */
+#define EMBED_CHUNK 512 /* bytes lil_embedded_stream collects before sending them */
+#define SHARE_MIN 64 /* values at least this long share their data instead of copying it */
+#define FORMAT_CACHE 8 /* parsed format strings format and scan keep */
+#define JSON_CHUNK 512 /* bytes json write collects before writing them */
+#define JSON_DEPTH 64 /* most nested arrays and objects json takes */
+#define RING_MAX 0x1000000 /* most numbers a ring can hold */
 
 /* note: static lil_xxx functions might become public later */
 
@@ -61,15 +117,64 @@ typedef struct _hashmap_t
     struct hashcell_t cell[HASHMAP_CELLS];
 } hashmap_t;
 
+/* data shared by several values, see share_value */
+typedef struct _lil_shared_t
+{
+    size_t refs;
+    size_t l;
+    char* d;
+    size_t c; /* see c in _lil_value_t */
+    char m; /* d is a read-only file mapping */
+} lil_shared_t;
+
+/* an entry of a dict, see lil_dict_t */
+typedef struct _lil_dict_entry_t
+{
+    lil_value_t k;
+    lil_value_t v;
+    unsigned long h;
+    size_t next; /* index + 1 of the next entry in the same slot */
+    size_t at; /* where the entry is in the text of the value */
+    size_t len;
+} lil_dict_entry_t;
+
+/* the hash table of a value used as a dict (see fnc_dict); the entries are
+ * kept in the order they were added, like in the text */
+typedef struct _lil_dict_t
+{
+    size_t refs;
+    size_t c;
+    size_t cap;
+    lil_dict_entry_t* e;
+    size_t* slot; /* index + 1 of the first entry of each slot */
+    size_t mask;
+    int placed; /* at and len of the entries match the text */
+} lil_dict_t;
+
+/* where the items of a value used as a list are in its text, so that they
+ * can be changed in place (see fnc_lset) */
+typedef struct _lil_items_t
+{
+    size_t refs;
+    size_t c;
+    size_t cap;
+    size_t* at; /* where each item starts and its length, braces included */
+} lil_items_t;
+
 struct _lil_value_t
 {
     size_t l;
     char* d; // Always there in case string is needed
+    size_t c; /* bytes allocated for d if it's kept with room to grow (see strbuf), 0 if it has just l + 1 */
     union {
         double fd; // Fast number types
         lilint_t fi;
+        lil_dict_t* dict; /* t is LIL_TYPE_DICT */
+        lil_items_t* items; /* t is LIL_TYPE_LIST */
     };
     char t;
+    char m; /* d is a read-only file mapping */
+    lil_shared_t* s; /* d points into this shared data, which may go on past l */
 };
 
 struct _lil_var_t
@@ -108,6 +213,151 @@ struct _lil_func_t
     lil_func_proc_t proc;
 };
 
+/* a script that source reads in chunks */
+typedef struct _lil_source_t
+{
+    char* name;
+    FILE* f;
+    size_t offset; /* next byte to read */
+    size_t start; /* offset of the last piece returned by next_source */
+    lil_value_t piece; /* the commands being run */
+    char* buf; /* read but not run yet */
+    size_t len;
+    size_t cap;
+    int eof;
+    int whole; /* the rest can't be split into commands, run it at once */
+} lil_source_t;
+
+/* a template compiled by lil_embedded */
+typedef struct _lil_embed_t
+{
+    char* code;
+    size_t len;
+    void* image;
+    int busy; /* being rendered */
+} lil_embed_t;
+
+/* a piece of a format string used by format and scan: literal text or a
+ * conversion */
+typedef struct _lil_fmtitem_t
+{
+    char conv; /* 0 for literal text */
+    char left; /* the - flag */
+    char skip; /* the * flag of scan */
+    int width; /* -1 if not given */
+    int prec;
+    size_t at; /* literal text in the format string */
+    size_t len;
+    char spec[16]; /* the conversion for snprintf */
+} lil_fmtitem_t;
+
+typedef struct _lil_format_t
+{
+    char* fmt;
+    size_t len;
+    lil_fmtitem_t* items;
+    size_t count;
+} lil_format_t;
+
+/* a frame of the resumable executor (see lil_start/lil_resume) */
+struct _lil_frame_t
+{
+    struct _lil_frame_t* up;
+    int kind;
+    int state;
+    int wait;
+    int done;
+    lil_env_t env;
+    lil_env_t downenv;
+    int ownenv;
+    int funclevel;
+    int catcher;
+    /* code being scanned */
+    lil_value_t owncode;
+    const char* code;
+    size_t clen;
+    size_t head;
+    size_t phead;
+    int ignoreeol;
+    char sc;
+    lil_list_t words;
+    lil_value_t w;
+    lil_value_t q;
+    lil_func_proc_t nproc;
+    lil_value_t pstate;
+    /* code is a script image (see lil_parse_image) */
+    int image;
+    size_t ipos; /* next command */
+    size_t icmds; /* commands left */
+    /* control commands */
+    size_t argc;
+    lil_value_t* argv;
+    size_t base;
+    int not;
+    size_t index;
+    lil_list_t list;
+    lil_list_t rlist;
+    lil_source_t* source;
+    /* results */
+    lil_value_t val;
+    lil_value_t ret;
+    lil_list_t retlist;
+};
+
+#ifdef LIL_ENABLE_MMAP
+/* a script file source has mapped; the entry holds one reference to the
+ * mapping so it can tell when the script is done with it */
+typedef struct _lil_mapped_t
+{
+    struct _lil_mapped_t* next;
+    dev_t dev;
+    ino_t ino;
+    lil_shared_t* sh;
+} lil_mapped_t;
+#endif
+
+/* a coroutine: a stack of frames sharing the interpreter's commands and globals */
+typedef struct _lil_exec_t
+{
+    struct _lil_exec_t* next;
+    lilint_t id;
+    struct _lil_frame_t* top;
+    size_t frames;
+    size_t depth;
+    int invoking;
+    int suspend;
+    int killed;
+    int error;
+    size_t err_head;
+    char* err_msg;
+    lil_value_t result;
+} lil_exec_t;
+
+/* a bounded queue of numbers: the values from head up to tail.  Only
+ * lil_ring_put (the writer, which may be an interrupt handler) moves tail
+ * forward and only the interpreter moves head, so the two can use a ring at
+ * the same time without locking.  The counters run freely and are masked to
+ * index v, which has a power of two slots */
+struct _lil_ring_t
+{
+    struct _lil_ring_t* next;
+    char* name;
+    double* v;
+    size_t size; /* most values the ring holds */
+    size_t mask;
+    volatile size_t head;
+    volatile size_t tail;
+    /* the rest is only used by the interpreter */
+    size_t seen; /* values before this are counted in sum, maxq and minq */
+    double sum;
+    size_t drops; /* values removed since sum was added up again */
+    size_t* maxq; /* indices of the values larger than all values after them */
+    size_t maxh, maxt;
+    size_t* minq; /* the same for smaller values */
+    size_t minh, mint;
+    int qdirty; /* maxq and minq must be rebuilt */
+};
+
 struct _lil_t
 {
     const char* code; /* need save on parse */
@@ -117,8 +367,8 @@ struct _lil_t
     int ignoreeol;
     lil_func_t* cmd;
     size_t cmds;
-    size_t syscmds;
     hashmap_t cmdmap;
+    unsigned char stdoff[32]; /* bit set for every built-in command hidden by a user one */
     char* catcher;
     int in_catcher;
     char* dollarprefix;
@@ -128,12 +378,50 @@ struct _lil_t
     lil_value_t empty;
     int error;
     size_t err_head;
+    const char* err_code; /* the code err_head points into */
     char* err_msg;
     lil_callback_proc_t callback[CALLBACKS];
     size_t parse_depth;
     void* data;
     char* embed;
     size_t embedlen;
+    size_t embedcap;
+    lil_embedded_sink_proc_t embsink; /* set by lil_embedded_stream */
+    void* embdata;
+    int embclosed; /* the sink refused more output */
+    lil_embed_t embcache[EMBED_CACHE]; /* recently used templates */
+    size_t embnext; /* next one to replace */
+    lil_format_t fmtcache[FORMAT_CACHE]; /* recently used format strings */
+    size_t fmtnext;
+    lil_exec_t* exec; /* running coroutine */
+    lil_exec_t* mainexec;
+    lil_exec_t* execs;
+    lilint_t lastexec;
+    int cmdsdirty; /* a command was changed or removed */
+    lil_t jail; /* cached starting point for jaileval */
+    lil_t jailbox; /* idle jail, reset after every use */
+    int jailclean;
+    size_t jailgen;
+    unsigned long rndstate;
+    char* outbuf; /* output not given to the write callback yet */
+    size_t outlen;
+    size_t outsize;
+    int outpolicy;
+    lil_ring_t rings;
+#ifdef LIL_ENABLE_MMAP
+    lil_mapped_t* mapped; /* scripts source is running from their mappings */
+#endif
+};
+
+struct _lil_pool_t
+{
+    lil_t proto;
+    lil_t* idle;
+    size_t idles;
+#ifdef LIL_ENABLE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
 };
 
 typedef struct _expreval_t
@@ -147,7 +435,14 @@ typedef struct _expreval_t
 } expreval_t;
 
 static lil_value_t next_word(lil_t lil);
-static void register_stdcmds(lil_t lil);
+static size_t scan_spaces(const char* s, size_t len, size_t i, int ignoreeol);
+static size_t scan_word(const char* s, size_t len, size_t i, int ignoreeol);
+static int find_stdcmd(const char* name);
+static lil_func_t stdcmd(int index);
+static int stdcmd_index(lil_func_t cmd);
+static void free_exec(lil_t lil, lil_exec_t* exec);
+static void free_embeds(lil_t lil);
+static void free_formats(lil_t lil);
 
 static char* strclone(const char* s)
 {
@@ -242,7 +537,9 @@ static lil_value_t alloc_value(const char* str)
     return alloc_value_len(str, str ? strlen(str) : 0);
 }
 
-lil_value_t lil_clone_value(lil_value_t src)
+/* copies src without sharing its data, for values given to another
+ * interpreter that may run in another thread */
+static lil_value_t copy_value(lil_value_t src)
 {
     lil_value_t val;
     if (!src) return NULL;
@@ -256,35 +553,238 @@ lil_value_t lil_clone_value(lil_value_t src)
             free(val);
             return NULL;
         }
-        memcpy(val->d, src->d, val->l + 1);
+        memcpy(val->d, src->d, val->l);
+        val->d[val->l] = 0;
     } else {
         val->d = NULL;
     }
     if (src->t == LIL_TYPE_INTEGER) val->fi = src->fi;
     else if (src->t == LIL_TYPE_DOUBLE) val->fd = src->fd;
+    else val->t = LIL_TYPE_STRING;
+    return val;
+}
+
+/* hands the data of val over to a shared block that other values can point
+ * into; the data is only freed when the last of them lets go of it */
+static lil_shared_t* share_value(lil_value_t val)
+{
+    lil_shared_t* sh;
+    if (val->s) return val->s;
+    sh = malloc(sizeof(lil_shared_t));
+    if (!sh) return NULL;
+    sh->refs = 1;
+    sh->l = val->l;
+    sh->d = val->d;
+    sh->c = val->c;
+    sh->m = val->m;
+    val->c = 0;
+    val->m = 0;
+    val->s = sh;
+    return sh;
+}
+
+static void release_shared(lil_shared_t* sh)
+{
+    if (--sh->refs) return;
+#ifdef LIL_ENABLE_MMAP
+    if (sh->m) munmap(sh->d, sh->l);
+    else
+#endif
+    free(sh->d);
+    free(sh);
+}
+
+/* makes val (which must be empty) point at len bytes of src from start */
+static int view_value(lil_value_t val, lil_value_t src, size_t start, size_t len)
+{
+    lil_shared_t* sh = share_value(src);
+    if (!sh) return 0;
+    sh->refs++;
+    free(val->d);
+    val->c = 0;
+    val->s = sh;
+    val->d = src->d + start;
+    val->l = len;
+    return 1;
+}
+
+/* returns a value for len bytes of src from start, which shares the data
+ * of src if there is enough of it */
+static lil_value_t alloc_slice(lil_value_t src, size_t start, size_t len)
+{
+    lil_value_t val;
+    if (len < SHARE_MIN) return alloc_value_len(src->d + start, len);
+    val = alloc_value_len(NULL, 0);
+    if (val && !view_value(val, src, start, len)) {
+        free(val);
+        return alloc_value_len(src->d + start, len);
+    }
+    return val;
+}
+
+/* gives val, which has the same text as src, the number or dict of src */
+static void copy_type(lil_value_t val, lil_value_t src)
+{
+    val->t = src->t;
+    if (src->t == LIL_TYPE_INTEGER) val->fi = src->fi;
+    else if (src->t == LIL_TYPE_DOUBLE) val->fd = src->fd;
+    else if (src->t == LIL_TYPE_DICT) {
+        val->dict = src->dict;
+        val->dict->refs++;
+    } else if (src->t == LIL_TYPE_LIST) {
+        val->items = src->items;
+        val->items->refs++;
+    }
+}
+
+lil_value_t lil_clone_value(lil_value_t src)
+{
+    lil_value_t val;
+    if (!src) return NULL;
+    if (src->l < SHARE_MIN) {
+        val = copy_value(src);
+    } else {
+        val = calloc(1, sizeof(struct _lil_value_t));
+        if (!val) return NULL;
+        if (!view_value(val, src, 0, src->l)) {
+            free(val);
+            return copy_value(src);
+        }
+    }
+    if (val) copy_type(val, src);
     return val;
 }
 
+/* gives a shared or mapped value its own copy of its data that can be
+ * changed */
+static int own_value(lil_value_t val)
+{
+    char* d;
+    lil_shared_t* sh = val->s;
+    if (sh && sh->refs == 1 && !sh->m && val->d == sh->d) {
+        /* nobody else uses the data, take it back */
+        val->d[val->l] = 0;
+        val->c = sh->c;
+        free(sh);
+        val->s = NULL;
+        return 1;
+    }
+    d = malloc(val->l + 1);
+    if (!d) return 0;
+    memcpy(d, val->d, val->l);
+    d[val->l] = 0;
+    if (sh) release_shared(sh);
+#ifdef LIL_ENABLE_MMAP
+    else munmap(val->d, val->l);
+#endif
+    val->d = d;
+    val->c = 0;
+    val->s = NULL;
+    val->m = 0;
+    return 1;
+}
+
+/* returns the l bytes of val, which unlike lil_to_string may not be
+ * followed by a NUL */
+static const char* value_bytes(lil_value_t val)
+{
+    return (val && val->l) ? val->d : "";
+}
+
+static void free_dict(lil_dict_t* dict)
+{
+    size_t i;
+    if (--dict->refs) return;
+    for (i=0; i<dict->c; i++) {
+        lil_free_value(dict->e[i].k);
+        lil_free_value(dict->e[i].v);
+    }
+    free(dict->e);
+    free(dict->slot);
+    free(dict);
+}
+
+static void free_items(lil_items_t* items)
+{
+    if (--items->refs) return;
+    free(items->at);
+    free(items);
+}
+
+/* forgets the number or dict of val, for when its text changes */
+static void drop_type(lil_value_t val)
+{
+    if (val->t == LIL_TYPE_DICT) free_dict(val->dict);
+    else if (val->t == LIL_TYPE_LIST) free_items(val->items);
+    val->t = LIL_TYPE_STRING;
+}
+
+/* makes room in d for len bytes and a NUL; values with room to grow get
+ * twice as much so that appending to them takes amortized O(1) */
+static char* grow_data(lil_value_t val, size_t len)
+{
+    size_t size = len + 1;
+    char* d;
+    if (val->c) {
+        if (size <= val->c) return val->d;
+        if (size < val->c*2) size = val->c*2;
+    }
+    d = realloc(val->d, size);
+    if (!d) return NULL;
+    val->d = d;
+    if (val->c) val->c = size;
+    return d;
+}
+
+/* gives val (which must not be shared or mapped) room to grow and room for
+ * len more bytes after its text, returning where they go */
+static char* value_room(lil_value_t val, size_t len)
+{
+    char* d;
+    if (!val->c) {
+        if (!val->d) {
+            val->d = malloc(len + 1);
+            if (!val->d) return NULL;
+            val->d[0] = 0;
+            val->c = len + 1;
+            return val->d;
+        }
+        val->c = val->l + 1;
+    }
+    d = grow_data(val, val->l + len);
+    return d ? d + val->l : NULL;
+}
+
+/* gives back the room to grow of val */
+static void fit_value(lil_value_t val)
+{
+    char* d;
+    if (!val->c) return;
+    if (val->c > val->l + 1 && (d = realloc(val->d, val->l + 1))) val->d = d;
+    val->c = 0;
+}
+
 int lil_append_char(lil_value_t val, char ch)
 {
-    val->t = LIL_TYPE_STRING; // Invalidates the number
-    char* new = realloc(val->d, val->l + 2);
+    drop_type(val);
+    if ((val->m || val->s) && !own_value(val)) return 0;
+    char* new = grow_data(val, val->l + 1);
     if (!new) return 0;
     new[val->l++] = ch;
     new[val->l] = 0;
-    val->d = new;
     return 1;
 }
 
 int lil_append_string_len(lil_value_t val, const char* s, size_t len)
 {
-    val->t = LIL_TYPE_STRING; // Invalidates the number
+    drop_type(val);
     char* new;
-    if (!s || !s[0]) return 1;
-    new = realloc(val->d, val->l + len + 1);
+    if (!s || !len) return 1;
+    if ((val->m || val->s) && !own_value(val)) return 0;
+    new = grow_data(val, val->l + len);
     if (!new) return 0;
-    memcpy(new + val->l, s, len + 1);
-    val->d = new;
+    memcpy(new + val->l, s, len);
+    new[val->l + len] = 0;
     val->l += len;
     return 1;
 }
@@ -296,21 +796,46 @@ int lil_append_string(lil_value_t val, const char* s)
 
 int lil_append_val(lil_value_t val, lil_value_t v)
 {
-    val->t = LIL_TYPE_STRING; // Invalidates the number
+    drop_type(val);
     char* new;
+    int whole;
     if (!v || !v->l) return 1;
-    new = realloc(val->d, val->l + v->l + 1);
+    /* a word made of a single $var or [command] is the same value, so it
+     * doesn't copy it and keeps its number or dict */
+    whole = !val->l && !val->s && !val->m;
+    if (whole && v->l >= SHARE_MIN && view_value(val, v, 0, v->l)) {
+        copy_type(val, v);
+        return 1;
+    }
+    if ((val->m || val->s) && !own_value(val)) return 0;
+    new = grow_data(val, val->l + v->l);
     if (!new) return 0;
-    memcpy(new + val->l, v->d, v->l + 1);
-    val->d = new;
+    memcpy(new + val->l, v->d, v->l);
+    new[val->l + v->l] = 0;
     val->l += v->l;
+    if (whole) copy_type(val, v);
     return 1;
 }
 
+/* lets go of the text of val */
+static void free_data(lil_value_t val)
+{
+    if (val->s) release_shared(val->s);
+#ifdef LIL_ENABLE_MMAP
+    else if (val->m) munmap(val->d, val->l);
+#endif
+    else free(val->d);
+    val->c = 0;
+    val->s = NULL;
+    val->m = 0;
+}
+
 void lil_free_value(lil_value_t val)
 {
     if (!val) return;
-    free(val->d);
+    if (val->t == LIL_TYPE_DICT) free_dict(val->dict);
+    else if (val->t == LIL_TYPE_LIST) free_items(val->items);
+    free_data(val);
     free(val);
 }
 
@@ -353,34 +878,151 @@ lil_value_t lil_list_get(lil_list_t list, size_t index)
     return index >= list->c ? NULL : list->v[index];
 }
 
-static int needs_escape(const char* str)
+/* byte classes, see charclass[] */
+#define CC_SPACE 1 /* isspace() in the C locale */
+#define CC_SPECIAL 2 /* one of $ { } [ ] " ' ; */
+#define CC_ESCAPE 4 /* isspace() or ispunct(), needs braces in a list */
+#define CC_WORDEND (CC_SPACE|CC_SPECIAL)
+
+static const unsigned char charclass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 5, 5, 5, 5, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    5, 4, 6, 4, 6, 4, 4, 6, 4, 4, 4, 4, 4, 4, 4, 4,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 6, 4, 4, 4, 4,
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 6, 4, 6, 4, 4,
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 6, 4, 6, 4, 0,
+    /* the rest are 0 */
+};
+
+#ifdef LIL_ENABLE_SSE2
+/* marks the bytes of x that are between lo and hi */
+static __m128i sse2_range(__m128i x, char lo, char hi)
 {
-    size_t i;
-    if (!str || !str[0]) return 1;
-    for (i=0; str[i]; i++)
-        if (ispunct(str[i]) || isspace(str[i])) return 1;
-    return 0;
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8((char)(hi - lo))), _mm_setzero_si128());
+}
+
+static __m128i sse2_byte(__m128i x, char ch)
+{
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(ch));
+}
+
+/* returns a bit for each of the 16 bytes at s that is in the class */
+static int sse2_class(const char* s, unsigned char mask)
+{
+    __m128i x = _mm_loadu_si128((const __m128i*)s);
+    __m128i m;
+    if (mask == CC_WORDEND) {
+        m = _mm_or_si128(sse2_range(x, '\t', '\r'), sse2_byte(x, ' '));
+        m = _mm_or_si128(m, _mm_or_si128(sse2_byte(x, '$'), sse2_byte(x, ';')));
+        m = _mm_or_si128(m, _mm_or_si128(sse2_byte(x, '{'), sse2_byte(x, '}')));
+        m = _mm_or_si128(m, _mm_or_si128(sse2_byte(x, '['), sse2_byte(x, ']')));
+        m = _mm_or_si128(m, _mm_or_si128(sse2_byte(x, '"'), sse2_byte(x, '\'')));
+    } else {
+        m = _mm_or_si128(sse2_range(x, '\t', '\r'), sse2_range(x, ' ', '/'));
+        m = _mm_or_si128(m, _mm_or_si128(sse2_range(x, ':', '@'), sse2_range(x, '[', '`')));
+        m = _mm_or_si128(m, sse2_range(x, '{', '~'));
+    }
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+/* returns the first byte between s and end that is in one of the classes of
+ * mask, or end if there is none */
+static const char* scan_class(const char* s, const char* end, unsigned char mask)
+{
+#ifdef LIL_ENABLE_SSE2
+    if (mask == CC_WORDEND || mask == CC_ESCAPE) {
+        while (end - s >= 16) {
+            int bits = sse2_class(s, mask);
+            if (bits) {
+                while (!(bits & 1)) {
+                    bits >>= 1;
+                    s++;
+                }
+                return s;
+            }
+            s += 16;
+        }
+    }
+#endif
+    while (s < end && !(charclass[(unsigned char)*s] & mask)) s++;
+    return s;
+}
+
+/* returns the first place of needle in hay, or NULL */
+static const char* find_bytes(const char* hay, size_t haylen, const char* needle, size_t len)
+{
+    const char* end = hay + haylen;
+    if (!len) return hay;
+    while ((size_t)(end - hay) >= len) {
+        hay = memchr(hay, needle[0], end - hay - len + 1);
+        if (!hay) return NULL;
+        if (!memcmp(hay, needle, len)) return hay;
+        hay++;
+    }
+    return NULL;
+}
+
+/* sets a bit in set (32 bytes) for each of the len bytes of chars, so that
+ * checking whether a byte is one of them takes one look up */
+static void byte_set(unsigned char* set, const char* chars, size_t len)
+{
+    memset(set, 0, 32);
+    for (; len; chars++, len--) set[(unsigned char)*chars >> 3] |= 1 << ((unsigned char)*chars & 7);
+}
+
+#define IN_BYTE_SET(set, ch) ((set)[(unsigned char)(ch) >> 3] & (1 << ((unsigned char)(ch) & 7)))
+
+/* compares two values byte by byte like strcmp, but NULs don't end them */
+static int compare_values(lil_value_t a, lil_value_t b)
+{
+    size_t len = a->l < b->l ? a->l : b->l;
+    int r = memcmp(value_bytes(a), value_bytes(b), len);
+    if (r || a->l == b->l) return r;
+    return a->l < b->l ? -1 : 1;
+}
+
+static int needs_escape(lil_value_t val)
+{
+    if (!val || !val->l) return 1;
+    return scan_class(val->d, val->d + val->l, CC_ESCAPE) != val->d + val->l;
+}
+
+/* appends item to val as a list item, braced if it needs to be */
+static void append_item(lil_value_t val, lil_value_t item, int do_escape)
+{
+    size_t j;
+    if (do_escape && needs_escape(item)) {
+        lil_append_char(val, '{');
+        for (j=0; j < item->l; j++) {
+            if (item->d[j] == '{')
+                lil_append_string(val, "}\"\\o\"{");
+            else if (item->d[j] == '}')
+                lil_append_string(val, "}\"\\c\"{");
+            else lil_append_char(val, item->d[j]);
+        }
+        lil_append_char(val, '}');
+    } else lil_append_val(val, item);
 }
 
 lil_value_t lil_list_to_value(lil_list_t list, int do_escape)
 {
     lil_value_t val = alloc_value(NULL);
-    size_t i, j;
+    size_t i, len = 0;
+    /* the text is written into one buffer, sized for the items with a space
+     * and braces each, which only grows if many braces must be escaped */
+    if (list->c > 1) {
+        for (i=0; i<list->c; i++) len += list->v[i]->l + 3;
+        value_room(val, len);
+    }
     for (i=0; i<list->c; i++) {
-        int escape = do_escape ? needs_escape(lil_to_string(list->v[i])) : 0;
         if (i) lil_append_char(val, ' ');
-        if (escape) {
-            lil_append_char(val, '{');
-            for (j=0; j < list->v[i]->l; j++) {
-                if (list->v[i]->d[j] == '{')
-                    lil_append_string(val, "}\"\\o\"{");
-                else if (list->v[i]->d[j] == '}')
-                    lil_append_string(val, "}\"\\c\"{");
-                else lil_append_char(val, list->v[i]->d[j]);
-            }
-            lil_append_char(val, '}');
-        } else lil_append_val(val, list->v[i]);
+        append_item(val, list->v[i], do_escape);
     }
+    fit_value(val);
     return val;
 }
 
@@ -421,20 +1063,45 @@ static lil_var_t lil_find_var(lil_t lil, lil_env_t env, const char* name)
 
 static lil_func_t find_cmd(lil_t lil, const char* name)
 {
+    int i = find_stdcmd(name);
+    if (i >= 0 && !STDCMD_HIDDEN(lil, i)) return stdcmd(i);
     return hm_get(&lil->cmdmap, name);
 }
 
+/* built-in commands can't be changed, so they're hidden when redefined */
+static void hide_stdcmd(lil_t lil, const char* name)
+{
+    int i = find_stdcmd(name);
+    if (i < 0 || STDCMD_HIDDEN(lil, i)) return;
+    lil->stdoff[i >> 3] |= 1 << (i & 7);
+    lil->cmdsdirty = 1;
+}
+
+static void drop_jail(lil_t lil)
+{
+    lil_free(lil->jail);
+    lil_free(lil->jailbox);
+    lil->jail = lil->jailbox = NULL;
+    lil->jailgen++;
+}
+
 static lil_func_t add_func(lil_t lil, const char* name)
 {
     lil_func_t cmd;
     lil_func_t* ncmd;
     cmd = find_cmd(lil, name);
+    if (cmd && stdcmd_index(cmd) >= 0) {
+        hide_stdcmd(lil, name);
+        cmd = hm_get(&lil->cmdmap, name);
+    }
     if (cmd) {
+        if (cmd->proc) drop_jail(lil);
         if (cmd->argnames) lil_free_list(cmd->argnames);
         lil_free_value(cmd->code);
         cmd->argnames = NULL;
         cmd->code = NULL;   
         cmd->proc = NULL;
+        lil->cmdsdirty = 1;
         return cmd;
     }
     cmd = calloc(1, sizeof(struct _lil_func_t));
@@ -453,12 +1120,18 @@ static lil_func_t add_func(lil_t lil, const char* name)
 static void del_func(lil_t lil, lil_func_t cmd)
 {
     size_t i, index = lil->cmds;
+    if (stdcmd_index(cmd) >= 0) {
+        hide_stdcmd(lil, cmd->name);
+        return;
+    }
     for (i=0; i < lil->cmds; i++)
         if (lil->cmd[i] == cmd) {
             index = i;
             break;
         }
     if (index == lil->cmds) return;
+    if (cmd->proc) drop_jail(lil);
+    lil->cmdsdirty = 1;
     hm_put(&lil->cmdmap, cmd->name, 0);
     if (cmd->argnames) lil_free_list(cmd->argnames);
     lil_free_value(cmd->code);
@@ -473,6 +1146,7 @@ int lil_register(lil_t lil, const char* name, lil_func_proc_t proc)
     lil_func_t cmd = add_func(lil, name);
     if (!cmd) return 0;
     cmd->proc = proc;
+    drop_jail(lil);
     return 1;
 }
 
@@ -559,21 +1233,32 @@ void lil_pop_env(lil_t lil)
     }
 }
 
+/* a starting state for rand that differs between interpreters, without
+ * calling rand() which isn't thread safe; mixes a count of the
+ * interpreters made so far with the interpreter's address */
+static unsigned long rand_seed(lil_t lil)
+{
+    static unsigned long made;
+    uint32_t x = (uint32_t)COUNT_UP(made)*0x9E3779B9U ^ (uint32_t)(uintptr_t)lil;
+    x ^= x >> 16;
+    x *= 0x85EBCA6BU;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35U;
+    x ^= x >> 16;
+    return (unsigned long)x | 1;
+}
+
 lil_t lil_new(void)
 {
     lil_t lil = calloc(1, sizeof(struct _lil_t));
     lil->rootenv = lil->env = lil_alloc_env(NULL);
     lil->empty = alloc_value(NULL);
     lil->dollarprefix = strclone("set ");
+    lil->rndstate = rand_seed(lil);
     hm_init(&lil->cmdmap);
-    register_stdcmds(lil);
     return lil;
 }
 
-static int islilspecial(char ch)
-{
-    return ch == '$' || ch == '{' || ch == '}' || ch == '[' || ch == ']' || ch == '"' || ch == '\'' || ch == ';';
-}
 
 static int eolchar(char ch)
 {
@@ -613,12 +1298,10 @@ static void skip_spaces(lil_t lil)
     }
 }
 
-static lil_value_t get_bracketpart(lil_t lil)
+static lil_value_t scan_bracketpart(lil_t lil)
 {
     size_t cnt = 1;
-    int save_eol = lil->ignoreeol;
-    lil_value_t val, cmd = alloc_value(NULL);
-    lil->ignoreeol = 0;
+    lil_value_t cmd = alloc_value(NULL);
     lil->head++;
     while (lil->head < lil->clen) {
         if (lil->code[lil->head] == '[') {
@@ -633,6 +1316,53 @@ static lil_value_t get_bracketpart(lil_t lil)
             lil_append_char(cmd, lil->code[lil->head++]);
         }
     }
+    return cmd;
+}
+
+static lil_value_t scan_bracepart(lil_t lil)
+{
+    size_t cnt = 1;
+    lil_value_t val = alloc_value(NULL);
+    lil->head++;
+    while (lil->head < lil->clen) {
+        if (lil->code[lil->head] == '{') {
+            lil->head++;
+            cnt++;
+            lil_append_char(val, '{');
+        } else if (lil->code[lil->head] == '}') {
+            lil->head++;
+            if (--cnt == 0) break;
+            else lil_append_char(val, '}');
+        } else {
+            lil_append_char(val, lil->code[lil->head++]);
+        }
+    }
+    return val;
+}
+
+static char unescape_char(char ch)
+{
+    switch (ch) {
+        case 'b': return '\b';
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'v': return '\v';
+        case 'f': return '\f';
+        case 'r': return '\r';
+        case '0': return 0;
+        case 'a': return '\a';
+        case 'c': return '}';
+        case 'o': return '{';
+        default: return ch;
+    }
+}
+
+static lil_value_t get_bracketpart(lil_t lil)
+{
+    int save_eol = lil->ignoreeol;
+    lil_value_t val, cmd;
+    lil->ignoreeol = 0;
+    cmd = scan_bracketpart(lil);
     val = lil_parse_value(lil, cmd, 0);
     lil_free_value(cmd);
     lil->ignoreeol = save_eol;
@@ -660,22 +1390,7 @@ static lil_value_t next_word(lil_t lil)
     if (lil->code[lil->head] == '$') {
         val = get_dollarpart(lil);
     } else if (lil->code[lil->head] == '{') {
-        size_t cnt = 1;
-        lil->head++;
-        val = alloc_value(NULL);
-        while (lil->head < lil->clen) {
-            if (lil->code[lil->head] == '{') {
-                lil->head++;
-                cnt++;
-                lil_append_char(val, '{');
-            } else if (lil->code[lil->head] == '}') {
-                lil->head++;
-                if (--cnt == 0) break;
-                else lil_append_char(val, '}');
-            } else {
-                lil_append_char(val, lil->code[lil->head++]);
-            }
-        }
+        val = scan_bracepart(lil);
     } else if (lil->code[lil->head] == '[') {
         val = get_bracketpart(lil);
     } else if (lil->code[lil->head] == '"' || lil->code[lil->head] == '\'') {
@@ -689,19 +1404,7 @@ static lil_value_t next_word(lil_t lil)
                 lil->head--; /* avoid skipping the char below */
             } else if (lil->code[lil->head] == '\\') {
                 lil->head++;
-                switch (lil->code[lil->head]) {
-                    case 'b': lil_append_char(val, '\b'); break;
-                    case 't': lil_append_char(val, '\t'); break;
-                    case 'n': lil_append_char(val, '\n'); break;
-                    case 'v': lil_append_char(val, '\v'); break;
-                    case 'f': lil_append_char(val, '\f'); break;
-                    case 'r': lil_append_char(val, '\r'); break;
-                    case '0': lil_append_char(val, 0); break;
-                    case 'a': lil_append_char(val, '\a'); break;
-                    case 'c': lil_append_char(val, '}'); break;
-                    case 'o': lil_append_char(val, '{'); break;
-                    default: lil_append_char(val, lil->code[lil->head]); break;
-                }
+                lil_append_char(val, unescape_char(lil->code[lil->head]));
             } else if (lil->code[lil->head] == sc) {
                 lil->head++;
                 break;
@@ -712,9 +1415,7 @@ static lil_value_t next_word(lil_t lil)
         }
     } else {
         start = lil->head;
-        while (lil->head < lil->clen && !isspace(lil->code[lil->head]) && !islilspecial(lil->code[lil->head])) {
-            lil->head++;
-        }
+        lil->head = scan_class(lil->code + start, lil->code + lil->clen, CC_WORDEND) - lil->code;
         val = alloc_value_len(lil->code + start, lil->head - start);
     }
     return val ? val : alloc_value(NULL);
@@ -776,32 +1477,117 @@ lil_value_t lil_subst_to_value(lil_t lil, lil_value_t code)
     return val;
 }
 
-lil_value_t lil_parse(lil_t lil, const char* code, size_t codelen, int funclevel)
+/* calls the command named by the first word with the others as arguments */
+static lil_value_t call_words(lil_t lil, lil_list_t words)
 {
-    const char* save_code = lil->code;
-    size_t save_clen = lil->clen;
-    size_t save_head = lil->head;
     lil_value_t val = NULL;
-    lil_list_t words = NULL;
-    if (!save_code) lil->rootcode = code;
-    lil->code = code;
-    lil->clen = codelen ? codelen : strlen(code);
-    lil->head = 0;
-    skip_spaces(lil);
-    lil->parse_depth++;
-#ifdef LIL_ENABLE_RECLIMIT
+    lil_func_t cmd = find_cmd(lil, lil_to_string(words->v[0]));
+    if (!cmd) {
+        if (words->v[0]->l) {
+            if (lil->catcher) {
+                if (lil->in_catcher < MAX_CATCHER_DEPTH) {
+                    lil_value_t args;
+                    lil->in_catcher++;
+                    lil_push_env(lil);
+                    lil->env->catcher_for = words->v[0];
+                    args = lil_list_to_value(words, 1);
+                    lil_set_var(lil, "args", args, LIL_SETVAR_LOCAL_NEW);
+                    lil_free_value(args);
+                    val = lil_parse(lil, lil->catcher, 0, 1);
+                    lil_pop_env(lil);
+                    lil->in_catcher--;
+                } else {
+                    char* msg = malloc(words->v[0]->l + 64);
+                    sprintf(msg, "catcher limit reached while trying to call unknown function %s", lil_to_string(words->v[0]));
+                    lil_set_error_at(lil, lil->head, msg);
+                    free(msg);
+                }
+            } else {
+                char* msg = malloc(words->v[0]->l + 32);
+                sprintf(msg, "unknown function %s", lil_to_string(words->v[0]));
+                lil_set_error_at(lil, lil->head, msg);
+                free(msg);
+            }
+        }
+    } else if (cmd->proc) {
+        size_t shead = lil->head;
+        val = cmd->proc(lil, words->c - 1, words->v + 1);
+        if (lil->error == ERROR_FIXHEAD) {
+            lil->error = ERROR_DEFAULT;
+            lil->err_head = shead;
+            lil->err_code = lil->code;
+        }
+    } else {
+        lil_push_env(lil);
+        lil->env->func = cmd;
+        if (cmd->argnames->c == 1 && !strcmp(lil_to_string(cmd->argnames->v[0]), "args")) {
+            lil_value_t args = lil_list_to_value(words, 1);
+            lil_set_var(lil, "args", args, LIL_SETVAR_LOCAL_NEW);
+            lil_free_value(args);
+        } else {
+            size_t i;
+            for (i=0; i<cmd->argnames->c; i++) {
+                lil_set_var(lil, lil_to_string(cmd->argnames->v[i]), i < words->c - 1 ? words->v[i + 1] : lil->empty, LIL_SETVAR_LOCAL_NEW);
+            }
+        }
+        val = lil_parse_value(lil, cmd->code, 1);
+        lil_pop_env(lil);
+    }
+    return val;
+}
+
+/* the common start of lil_parse and lil_parse_image, returns 0 if nothing
+ * should run */
+static int enter_parse(lil_t lil, int funclevel)
+{
+    lil->parse_depth++;
+#ifdef LIL_ENABLE_RECLIMIT
     if (lil->parse_depth > LIL_ENABLE_RECLIMIT) {
         lil_set_error(lil, "Too many recursive calls");
-        goto cleanup;
+        return 0;
     }
 #endif
     if (lil->callback[LIL_CALLBACK_CHECKINTERRUPT]) {
         lil_checkinterrupt_callback_proc_t proc = (lil_checkinterrupt_callback_proc_t)lil->callback[LIL_CALLBACK_CHECKINTERRUPT];
         proc(lil);
-        if (lil->error) goto cleanup;
+        if (lil->error) return 0;
     }
     if (lil->parse_depth == 1) lil->error = 0;
     if (funclevel) lil->env->breakrun = 0;
+    return 1;
+}
+
+static lil_value_t leave_parse(lil_t lil, lil_value_t val, int funclevel)
+{
+    if (lil->parse_depth == 1) lil_flush(lil);
+    if (lil->error && lil->callback[LIL_CALLBACK_ERROR] && lil->parse_depth == 1) {
+        lil_error_callback_proc_t proc = (lil_error_callback_proc_t)lil->callback[LIL_CALLBACK_ERROR];
+        proc(lil, lil->err_head, lil->err_msg);
+    }
+    if (funclevel && lil->env->retval_set) {
+        if (val) lil_free_value(val);
+        val = lil->env->retval;
+        lil->env->retval = NULL;
+        lil->env->retval_set = 0;
+        lil->env->breakrun = 0;
+    }
+    lil->parse_depth--;
+    return val ? val : alloc_value(NULL);
+}
+
+lil_value_t lil_parse(lil_t lil, const char* code, size_t codelen, int funclevel)
+{
+    const char* save_code = lil->code;
+    size_t save_clen = lil->clen;
+    size_t save_head = lil->head;
+    lil_value_t val = NULL;
+    lil_list_t words = NULL;
+    if (!save_code) lil->rootcode = code;
+    lil->code = code;
+    lil->clen = codelen ? codelen : strlen(code);
+    lil->head = 0;
+    skip_spaces(lil);
+    if (!enter_parse(lil, funclevel)) goto cleanup;
     while (lil->head < lil->clen && !lil->error) {
         if (words) lil_free_list(words);
         if (val) lil_free_value(val);
@@ -810,64 +1596,7 @@ lil_value_t lil_parse(lil_t lil, const char* code, size_t codelen, int funclevel
         words = substitute(lil);
         if (!words || lil->error) goto cleanup;
 
-        if (words->c) {
-            lil_func_t cmd = find_cmd(lil, lil_to_string(words->v[0]));
-            if (!cmd) {
-                if (words->v[0]->l) {
-                    if (lil->catcher) {
-                        if (lil->in_catcher < MAX_CATCHER_DEPTH) {
-                            lil_value_t args;
-                            lil->in_catcher++;
-                            lil_push_env(lil);
-                            lil->env->catcher_for = words->v[0];
-                            args = lil_list_to_value(words, 1);
-                            lil_set_var(lil, "args", args, LIL_SETVAR_LOCAL_NEW);
-                            lil_free_value(args);
-                            val = lil_parse(lil, lil->catcher, 0, 1);
-                            lil_pop_env(lil);
-                            lil->in_catcher--;
-                        } else {
-                            char* msg = malloc(words->v[0]->l + 64);
-                            sprintf(msg, "catcher limit reached while trying to call unknown function %s", words->v[0]->d);
-                            lil_set_error_at(lil, lil->head, msg);
-                            free(msg);
-                            goto cleanup;
-                        }
-                    } else {
-                        char* msg = malloc(words->v[0]->l + 32);
-                        sprintf(msg, "unknown function %s", words->v[0]->d);
-                        lil_set_error_at(lil, lil->head, msg);
-                        free(msg);
-                        goto cleanup;
-                    }
-                }
-            }
-            if (cmd) {
-                if (cmd->proc) {
-                    size_t shead = lil->head;
-                    val = cmd->proc(lil, words->c - 1, words->v + 1);
-                    if (lil->error == ERROR_FIXHEAD) {
-                        lil->error = ERROR_DEFAULT;
-                        lil->err_head = shead;
-                    }
-                } else {
-                    lil_push_env(lil);
-                    lil->env->func = cmd;
-                    if (cmd->argnames->c == 1 && !strcmp(lil_to_string(cmd->argnames->v[0]), "args")) {
-                        lil_value_t args = lil_list_to_value(words, 1);
-                        lil_set_var(lil, "args", args, LIL_SETVAR_LOCAL_NEW);
-                        lil_free_value(args);
-                    } else {
-                        size_t i;
-                        for (i=0; i<cmd->argnames->c; i++) {
-                            lil_set_var(lil, lil_to_string(cmd->argnames->v[i]), i < words->c - 1 ? words->v[i + 1] : lil->empty, LIL_SETVAR_LOCAL_NEW);
-                        }
-                    }
-                    val = lil_parse_value(lil, cmd->code, 1);
-                    lil_pop_env(lil);
-                }
-            }
-        }
+        if (words->c) val = call_words(lil, words);
 
         if (lil->env->breakrun) goto cleanup;
 
@@ -876,29 +1605,309 @@ lil_value_t lil_parse(lil_t lil, const char* code, size_t codelen, int funclevel
         skip_spaces(lil);
     }
 cleanup:
-    if (lil->error && lil->callback[LIL_CALLBACK_ERROR] && lil->parse_depth == 1) {
-        lil_error_callback_proc_t proc = (lil_error_callback_proc_t)lil->callback[LIL_CALLBACK_ERROR];
-        proc(lil, lil->err_head, lil->err_msg);
-    }
     if (words) lil_free_list(words);
     lil->code = save_code;
     lil->clen = save_clen;
     lil->head = save_head;
-    if (funclevel && lil->env->retval_set) {
-        if (val) lil_free_value(val);
-        val = lil->env->retval;
-        lil->env->retval = NULL;
-        lil->env->retval_set = 0;
-        lil->env->breakrun = 0;
-    }
-    lil->parse_depth--;
-    return val ? val : alloc_value(NULL);
+    return leave_parse(lil, val, funclevel);
 }
 
 lil_value_t lil_parse_value(lil_t lil, lil_value_t val, int funclevel)
 {
     if (!val || !val->d || !val->l) return alloc_value(NULL);
-    return lil_parse(lil, val->d, val->l, funclevel);
+    return lil_parse(lil, lil_to_string(val), val->l, funclevel);
+}
+
+/* Precompiled scripts (see lil_compile and extras/lilc.c) hold commands that
+ * are already split into words, so running them needs no scanning.  Nothing
+ * in them needs to be aligned, so an image can be run straight from flash:
+ *
+ *     "\177LIL" 1 0 0 0, then as 32 bit little endian numbers the image
+ *         size, where the strings start and the command count
+ *     per command: where it ends in the source, word count and for every
+ *         word 2*string for a literal one or 2*string+1 for source text
+ *         that still has to be substituted, string being the offset of its
+ *         text from the start of the strings
+ *     per string: length, bytes
+ *
+ * Apart from the header, numbers take 7 bits per byte, low bits first, with
+ * the top bit set in all but the last byte.  Words with the same text share
+ * their string. */
+#define IMAGE_MAGIC "\177LIL\1"
+#define IMAGE_HEADER 20
+
+static size_t image_u32(const unsigned char* p)
+{
+    return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+}
+
+static void image_put_u32(unsigned char* p, size_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+/* reads the number at *pos and moves *pos past it, or past end if the number
+ * doesn't end before end */
+static size_t image_num(const unsigned char* img, size_t end, size_t* pos)
+{
+    size_t v = 0;
+    int shift = 0;
+    while (*pos < end && shift < 32) {
+        unsigned char b = img[(*pos)++];
+        v |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+        shift += 7;
+    }
+    *pos = end + 1;
+    return 0;
+}
+
+/* writes v at p if p isn't NULL, returns the bytes it takes */
+static size_t image_put_num(unsigned char* p, size_t v)
+{
+    size_t n = 1;
+    for (; v > 0x7F; v >>= 7, n++)
+        if (p) *p++ = (v & 0x7F) | 0x80;
+    if (p) *p = v;
+    return n;
+}
+
+/* returns the size of the image at p or 0 if it isn't a valid one, size is
+ * how much can be read there or 0 if only the image itself knows */
+static size_t image_size(const char* p, size_t size)
+{
+    const unsigned char* img = (const unsigned char*)p;
+    size_t i, j, total, strs, cmds, pos = IMAGE_HEADER;
+    if (!p || (size && size < IMAGE_HEADER)) return 0;
+    for (i=0; i<5; i++)
+        if (p[i] != IMAGE_MAGIC[i]) return 0;
+    total = image_u32(img + 8);
+    strs = image_u32(img + 12);
+    cmds = image_u32(img + 16);
+    if (total < IMAGE_HEADER || (size && total > size) || strs < IMAGE_HEADER || strs > total) return 0;
+    for (i=0; i<cmds; i++) {
+        size_t n;
+        image_num(img, strs, &pos);
+        n = image_num(img, strs, &pos);
+        for (j=0; j<n && pos <= strs; j++) {
+            size_t str = image_num(img, strs, &pos) / 2, len;
+            if (str >= total - strs) return 0;
+            str += strs;
+            len = image_num(img, total, &str);
+            if (str > total || len > total - str) return 0;
+        }
+        if (pos > strs) return 0;
+    }
+    return total;
+}
+
+/* substitutes a word kept in an image as source text */
+static lil_value_t image_subst(lil_t lil, const char* word, size_t len)
+{
+    const char* save_code = lil->code;
+    size_t save_clen = lil->clen;
+    size_t save_head = lil->head;
+    lil_value_t val = NULL;
+    lil_list_t words;
+    lil->code = word;
+    lil->clen = len;
+    lil->head = 0;
+    words = substitute(lil);
+    if (words && words->c) {
+        val = words->v[0];
+        words->v[0] = NULL;
+    }
+    lil_free_list(words);
+    lil->code = save_code;
+    lil->clen = save_clen;
+    lil->head = save_head;
+    return val ? val : alloc_value(NULL);
+}
+
+/* builds the words of the image command at *pos and moves *pos past it, head
+ * is set to where the command ended in its source */
+static lil_list_t image_words(lil_t lil, const unsigned char* img, size_t* pos)
+{
+    size_t total = image_u32(img + 8), strs = image_u32(img + 12);
+    size_t head = image_num(img, total, pos);
+    size_t n = image_num(img, total, pos), i;
+    lil_list_t words = lil_alloc_list();
+    for (i=0; i<n && !lil->error; i++) {
+        size_t ref = image_num(img, total, pos);
+        size_t str = strs + ref / 2;
+        size_t len = image_num(img, total, &str);
+        if (ref & 1)
+            lil_list_append(words, image_subst(lil, (const char*)img + str, len));
+        else
+            lil_list_append(words, alloc_value_len((const char*)img + str, len));
+    }
+    /* skip what an error left */
+    for (; i<n; i++) image_num(img, total, pos);
+    lil->head = head;
+    return words;
+}
+
+lil_value_t lil_parse_image(lil_t lil, const void* image, size_t size, int funclevel)
+{
+    const unsigned char* img = image;
+    const char* save_code = lil->code;
+    size_t save_clen = lil->clen;
+    size_t save_head = lil->head;
+    lil_value_t val = NULL;
+    lil_list_t words = NULL;
+    size_t pos = IMAGE_HEADER, cmds;
+    if (!image_size(image, size)) {
+        lil_set_error(lil, "invalid script image");
+        return alloc_value(NULL);
+    }
+    /* error positions point into the source the image was made from */
+    lil->code = image;
+    lil->clen = 0;
+    lil->head = 0;
+    if (!enter_parse(lil, funclevel)) goto cleanup;
+    cmds = image_u32(img + 16);
+    while (cmds-- && !lil->error) {
+        if (words) lil_free_list(words);
+        if (val) lil_free_value(val);
+        val = NULL;
+
+        words = image_words(lil, img, &pos);
+        if (lil->error) goto cleanup;
+
+        if (words->c) val = call_words(lil, words);
+
+        if (lil->env->breakrun) goto cleanup;
+    }
+cleanup:
+    if (words) lil_free_list(words);
+    lil->code = save_code;
+    lil->clen = save_clen;
+    lil->head = save_head;
+    return leave_parse(lil, val, funclevel);
+}
+
+/* adds text to the strings of the image being compiled unless it is there
+ * already, returns its offset */
+static size_t compile_string(lil_list_t strs, size_t* area, hashmap_t* map, lil_value_t text)
+{
+    /* the map can't hold text with zeros in it, such strings aren't shared */
+    int shared = !memchr(lil_to_string(text), 0, text->l);
+    size_t off = *area;
+    if (shared) {
+        size_t found = (size_t)hm_get(map, lil_to_string(text));
+        if (found) {
+            lil_free_value(text);
+            return found - 1;
+        }
+        hm_put(map, lil_to_string(text), (void*)(off + 1));
+    }
+    lil_list_append(strs, text);
+    *area += image_put_num(NULL, text->l) + text->l;
+    return off;
+}
+
+/* appends a number to the commands of the image being compiled */
+static int compile_num(size_t** nums, size_t* count, size_t* cap, size_t v)
+{
+    if (*count == *cap) {
+        size_t ncap = *cap ? *cap*2 : 64;
+        size_t* nnums = realloc(*nums, ncap*sizeof(size_t));
+        if (!nnums) return 0;
+        *nums = nnums;
+        *cap = ncap;
+    }
+    (*nums)[(*count)++] = v;
+    return 1;
+}
+
+/* a word part needs substituting if it has a $ or [ outside braces */
+static int compile_needs_subst(const char* s, size_t i, size_t end)
+{
+    if (s[i] == '$' || s[i] == '[') return 1;
+    if (s[i] != '"' && s[i] != '\'') return 0;
+    for (i++; i<end; i++) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '$' || s[i] == '[') return 1;
+    }
+    return 0;
+}
+
+void* lil_compile(lil_t lil, const char* code, size_t codelen, size_t* size)
+{
+    lil_list_t strs = lil_alloc_list();
+    hashmap_t* map = malloc(sizeof(hashmap_t));
+    size_t* nums = NULL;
+    size_t count = 0, cap = 0, cmds = 0, area = 0, total = IMAGE_HEADER, i = 0, j, pos;
+    size_t len = codelen ? codelen : strlen(code);
+    unsigned char* img = NULL;
+    int ok = map != NULL, save_error = lil->error;
+    /* substituting literal words runs nothing but stops at a pending error */
+    lil->error = ERROR_NOERROR;
+    if (map) hm_init(map);
+    while (ok) {
+        size_t first = count, n = 0;
+        i = scan_spaces(code, len, i, 0);
+        if (i >= len) break;
+        if (eolchar(code[i])) {
+            i++;
+            continue;
+        }
+        ok = compile_num(&nums, &count, &cap, 0) && compile_num(&nums, &count, &cap, 0);
+        while (ok && i < len && !eolchar(code[i])) {
+            size_t start = i;
+            int subst = 0;
+            do {
+                size_t next = scan_word(code, len, i, 0);
+                if (next == i) break;
+                subst |= compile_needs_subst(code, i, next);
+                i = next;
+            } while (i < len && !eolchar(code[i]) && !isspace(code[i]));
+            if (i == start) break;
+            if (subst)
+                ok = compile_num(&nums, &count, &cap, compile_string(strs, &area, map, alloc_value_len(code + start, i - start))*2 + 1);
+            else
+                ok = compile_num(&nums, &count, &cap, compile_string(strs, &area, map, image_subst(lil, code + start, i - start))*2);
+            n++;
+            i = scan_spaces(code, len, i, 0);
+        }
+        if (i < len && !eolchar(code[i])) {
+            /* the parser would stop at a word it can't read */
+            count = first;
+            break;
+        }
+        if (ok) {
+            nums[first] = i;
+            nums[first + 1] = n;
+            cmds++;
+        }
+    }
+    for (j=0; j<count; j++) total += image_put_num(NULL, nums[j]);
+    if (ok) img = malloc(total + area);
+    if (img) {
+        memcpy(img, IMAGE_MAGIC "\0\0", 8);
+        image_put_u32(img + 8, total + area);
+        image_put_u32(img + 12, total);
+        image_put_u32(img + 16, cmds);
+        pos = IMAGE_HEADER;
+        for (j=0; j<count; j++) pos += image_put_num(img + pos, nums[j]);
+        for (j=0; j<strs->c; j++) {
+            pos += image_put_num(img + pos, strs->v[j]->l);
+            memcpy(img + pos, lil_to_string(strs->v[j]), strs->v[j]->l);
+            pos += strs->v[j]->l;
+        }
+        if (size) *size = total + area;
+    }
+    if (map) {
+        hm_destroy(map);
+        free(map);
+    }
+    free(nums);
+    lil_free_list(strs);
+    lil->error = save_error;
+    return img;
 }
 
 LILAPI lil_value_t lil_call(lil_t lil, const char* funcname, size_t argc, lil_value_t* argv)
@@ -906,9 +1915,13 @@ LILAPI lil_value_t lil_call(lil_t lil, const char* funcname, size_t argc, lil_va
     lil_func_t cmd = find_cmd(lil, funcname);
     lil_value_t r = NULL;
     if (cmd) {
-        if (cmd->proc)
+        if (cmd->proc) {
+            /* natives called from here are not resumable */
+            int invoking = lil->exec ? lil->exec->invoking : 0;
+            if (invoking) lil->exec->invoking = 0;
             r = cmd->proc(lil, argc, argv);
-        else {
+            if (invoking) lil->exec->invoking = 1;
+        } else {
             size_t i;
             lil_push_env(lil);
             lil->env->func = cmd;
@@ -940,7 +1953,9 @@ int lil_break_run(lil_t lil, int dobreak)
 
 void lil_callback(lil_t lil, int cb, lil_callback_proc_t proc)
 {
-    if (cb < 0 || cb > CALLBACKS) return;
+    if (cb < 0 || cb >= CALLBACKS) return;
+    /* buffered output goes where it was written to */
+    if (cb == LIL_CALLBACK_WRITE) lil_flush(lil);
     lil->callback[cb] = proc;
 }
 
@@ -959,6 +1974,7 @@ void lil_set_error_at(lil_t lil, size_t pos, const char* msg)
     free(lil->err_msg);
     lil->error = ERROR_DEFAULT;
     lil->err_head = pos;
+    lil->err_code = lil->code;
     lil->err_msg = strclone(msg ? msg : "");
 }
 
@@ -2016,18 +3032,13 @@ static void ee_expr(expreval_t* ee)
     }
 }
 
-lil_value_t lil_eval_expr(lil_t lil, lil_value_t code)
+static lil_value_t eval_substituted_expr(lil_t lil, lil_value_t code)
 {
     expreval_t ee;
-    code = lil_subst_to_value(lil, code);
-    if (lil->error) return NULL;
     ee.code = lil_to_string(code);
     /* an empty expression equals to 0 so that it can be used as a false value
      * in conditionals */
-    if (!ee.code[0]) {
-        lil_free_value(code);
-        return lil_alloc_integer(0);
-    }
+    if (!ee.code[0]) return lil_alloc_integer(0);
     ee.head = 0;
     ee.len = code->l;
     ee.ival = 0;
@@ -2035,7 +3046,6 @@ lil_value_t lil_eval_expr(lil_t lil, lil_value_t code)
     ee.type = EE_INT;
     ee.error = 0;
     ee_expr(&ee);
-    lil_free_value(code);
     if (ee.error) {
         switch (ee.error) {
         case EERR_DIVISION_BY_ZERO:
@@ -2056,6 +3066,19 @@ lil_value_t lil_eval_expr(lil_t lil, lil_value_t code)
         return lil_alloc_double(ee.dval);
 }
 
+lil_value_t lil_eval_expr(lil_t lil, lil_value_t code)
+{
+    lil_value_t r;
+    code = lil_subst_to_value(lil, code);
+    if (lil->error) {
+        lil_free_value(code);
+        return NULL;
+    }
+    r = eval_substituted_expr(lil, code);
+    lil_free_value(code);
+    return r;
+}
+
 lil_value_t lil_unused_name(lil_t lil, const char* part)
 {
     char* name = malloc(strlen(part) + 64);
@@ -2079,7 +3102,10 @@ lil_value_t lil_arg(lil_value_t* argv, size_t index)
 
 const char* lil_to_string(lil_value_t val)
 {
-    return (val && val->l) ? val->d : "";
+    if (!val || !val->l) return "";
+    /* a part of shared data isn't followed by a NUL */
+    if (val->s && val->d + val->l != val->s->d + val->s->l && !own_value(val)) return "";
+    return val->d;
 }
 
 // double lil_to_double(lil_value_t val)
@@ -2098,8 +3124,10 @@ lilint_t lil_to_integer(lil_value_t val)
     lilint_t n;
     char trash;
     if (sscanf(lil_to_string(val), "%lli%c", (int64_t*)&n, &trash) == 1) {
-        val->fi = n;
-        val->t = LIL_TYPE_INTEGER;
+        if (val->t != LIL_TYPE_DICT && val->t != LIL_TYPE_LIST) {
+            val->fi = n;
+            val->t = LIL_TYPE_INTEGER;
+        }
         return n;
     }
     return 0;
@@ -2113,8 +3141,10 @@ double lil_to_double(lil_value_t val)
     lilint_t n = lil_to_integer(val);
     if (n) return (double)n;
     if (sscanf(lil_to_string(val), "%lf%c", &d, &trash) == 1) {
-        val->fd = d;
-        val->t = LIL_TYPE_DOUBLE;
+        if (val->t != LIL_TYPE_DICT && val->t != LIL_TYPE_LIST) {
+            val->fd = d;
+            val->t = LIL_TYPE_DOUBLE;
+        }
         return d;
     }
     return 0.;
@@ -2123,7 +3153,7 @@ double lil_to_double(lil_value_t val)
 int lil_to_boolean(lil_value_t val)
 {
     double d = lil_to_double(val);
-    if (val->t != LIL_TYPE_STRING) return d != 0.;
+    if (val->t == LIL_TYPE_INTEGER || val->t == LIL_TYPE_DOUBLE) return d != 0.;
     const char* s = lil_to_string(val);
     size_t i, dots = 0;
     if (!s[0]) {return 0;}
@@ -2167,160 +3197,623 @@ lil_value_t lil_alloc_integer(lilint_t num)
     return r;
 }
 
-void lil_free(lil_t lil)
+/* frees the commands from the given index up */
+static void free_cmds(lil_t lil, size_t from)
 {
     size_t i;
-    if (!lil) return;
-    free(lil->err_msg);
-    lil_free_value(lil->empty);
-    while (lil->env) {
-        lil_env_t next = lil->env->parent;
-        lil_free_env(lil->env);
-        lil->env = next;
-    }
-    for (i=0; i<lil->cmds; i++) {
+    for (i=from; i<lil->cmds; i++) {
+        hm_put(&lil->cmdmap, lil->cmd[i]->name, 0);
         if (lil->cmd[i]->argnames)
             lil_free_list(lil->cmd[i]->argnames);
         lil_free_value(lil->cmd[i]->code);
         free(lil->cmd[i]->name);
         free(lil->cmd[i]);
     }
-    hm_destroy(&lil->cmdmap);
-    free(lil->cmd);
-    free(lil->dollarprefix);
-    free(lil->catcher);
-    free(lil);
+    if (from < lil->cmds) lil->cmds = from;
 }
 
-LILAPI void lil_set_data(lil_t lil, void* data)
+static void free_ring(lil_ring_t ring)
 {
-    lil->data = data;
+    free(ring->name);
+    free(ring->v);
+    free(ring->maxq);
+    free(ring->minq);
+    free(ring);
 }
 
-LILAPI void* lil_get_data(lil_t lil)
+static void free_rings(lil_t lil)
 {
-    return lil->data;
+    while (lil->rings) {
+        lil_ring_t next = lil->rings->next;
+        free_ring(lil->rings);
+        lil->rings = next;
+    }
 }
 
-static LILCALLBACK void fnc_embed_write(lil_t lil, const char* msg)
+/* forgets the mapped scripts, a script still running keeps its own
+ * reference to the mapping */
+static void free_mapped(lil_t lil)
 {
-    size_t len;
-    if (lil->callback[LIL_CALLBACK_EMBEDDEDFILTER]) {
-        lil_embeddedfilter_callback_proc_t proc = (lil_embeddedfilter_callback_proc_t)lil->callback[LIL_CALLBACK_EMBEDDEDFILTER];
-        msg = proc(lil, msg);
-        if (!msg) return;
+#ifdef LIL_ENABLE_MMAP
+    while (lil->mapped) {
+        lil_mapped_t* next = lil->mapped->next;
+        release_shared(lil->mapped->sh);
+        free(lil->mapped);
+        lil->mapped = next;
     }
-    len = strlen(msg) + 1;
-    lil->embed = realloc(lil->embed, lil->embedlen + len);
-    memcpy(lil->embed + lil->embedlen, msg, len);
-    lil->embedlen += len - 1;
+#endif
 }
 
-char* lil_embedded(lil_t lil, const char* code, unsigned int flags)
+LILAPI lil_ring_t lil_find_ring(lil_t lil, const char* name)
 {
-    char* prev_embed = lil->embed;
-    size_t prev_embedlen = lil->embedlen;
-    lil_callback_proc_t prev_write = lil->callback[LIL_CALLBACK_WRITE];
-    char* lilcode = NULL;
-    size_t lilcodelen = 0;
-    char* cont = NULL;
-    size_t contlen = 0;
-    size_t head = 0, codelen = strlen(code);
-    char* result;
+    lil_ring_t ring;
+    for (ring = lil->rings; ring; ring = ring->next)
+        if (!strcmp(ring->name, name)) return ring;
+    return NULL;
+}
 
-    lil->callback[LIL_CALLBACK_WRITE] = (lil_callback_proc_t)fnc_embed_write;
-    lil->embed = NULL;
-    lil->embedlen = 0;
-
-    while (head < codelen) {
-        if (head < codelen - 4 &&
-            code[head] == '<' &&
-            code[head + 1] == '?' &&
-            code[head + 2] == 'l' &&
-            code[head + 3] == 'i' &&
-            code[head + 4] == 'l') {
-            head += 5;
-            if (contlen) {
-                lilcode = realloc(lilcode, lilcodelen + contlen + 10);
-                memcpy(lilcode + lilcodelen, "\nwrite {", 8);
-                memcpy(lilcode + lilcodelen + 8, cont, contlen);
-                lilcode[lilcodelen + contlen + 8] = '}';
-                lilcode[lilcodelen + contlen + 9] = '\n';
-                lilcodelen += contlen + 10;
-                free(cont);
-                cont = NULL;
-                contlen = 0;
-            }
-            while (head < codelen) {
-                if (head < codelen - 1 && code[head] == '?' && code[head + 1] == '>') {
-                    head += 2;
-                    break;
-                }
-                lilcode = realloc(lilcode, lilcodelen + 1);
-                lilcode[lilcodelen++] = code[head++];
-            }
-            lilcode = realloc(lilcode, lilcodelen + 1);
-            lilcode[lilcodelen++] = '\n';
-        } else {
-            if (code[head] == '{' || code[head] == '}') {
-                cont = realloc(cont, contlen + 6);
-                cont[contlen++] = '}';
-                cont[contlen++] = '"';
-                cont[contlen++] = '\\';
-                if (code[head] == '{')
-                    cont[contlen++] = 'o';
-                else
-                    cont[contlen++] = 'c';
-                cont[contlen++] = '"';
-                cont[contlen++] = '{';
-                head++;
-            } else {
-                cont = realloc(cont, contlen + 1);
-                cont[contlen++] = code[head++];
-            }
+LILAPI void lil_free_ring(lil_t lil, const char* name)
+{
+    lil_ring_t* prev;
+    for (prev = &lil->rings; *prev; prev = &(*prev)->next) {
+        if (!strcmp((*prev)->name, name)) {
+            lil_ring_t ring = *prev;
+            *prev = ring->next;
+            free_ring(ring);
+            return;
         }
     }
-    if (contlen) {
-        lilcode = realloc(lilcode, lilcodelen + contlen + 10);
-        memcpy(lilcode + lilcodelen, "\nwrite {", 8);
-        memcpy(lilcode + lilcodelen + 8, cont, contlen);
-        lilcode[lilcodelen + contlen + 8] = '}';
-        lilcode[lilcodelen + contlen + 9] = '\n';
-        lilcodelen += contlen + 10;
-        free(cont);
-    }
-
-    lilcode = realloc(lilcode, lilcodelen + 1);
-    lilcode[lilcodelen] = 0;
-    lil_free_value(lil_parse(lil, lilcode, 0, 1));
-    free(lilcode);
-    result = lil->embed ? lil->embed : strclone("");
-
-    lil->embed = prev_embed;
-    lil->embedlen = prev_embedlen;
-    lil->callback[LIL_CALLBACK_WRITE] = prev_write;
-
-    return result;
 }
 
-void lil_freemem(void* ptr)
+LILAPI lil_ring_t lil_alloc_ring(lil_t lil, const char* name, size_t size)
 {
-    free(ptr);
+    lil_ring_t ring = calloc(1, sizeof(struct _lil_ring_t));
+    size_t slots = 1;
+    if (!ring) return NULL;
+    if (!size) size = 1;
+    if (size > RING_MAX) {
+        free(ring);
+        return NULL;
+    }
+    while (slots < size) slots <<= 1;
+    ring->name = strclone(name);
+    ring->v = malloc(sizeof(double)*slots);
+    ring->maxq = malloc(sizeof(size_t)*slots);
+    ring->minq = malloc(sizeof(size_t)*slots);
+    if (!ring->name || !ring->v || !ring->maxq || !ring->minq) {
+        free_ring(ring);
+        return NULL;
+    }
+    ring->size = size;
+    ring->mask = slots - 1;
+    lil_free_ring(lil, name);
+    ring->next = lil->rings;
+    lil->rings = ring;
+    return ring;
 }
 
-void lil_write(lil_t lil, const char* msg)
+LILAPI int lil_ring_put(lil_ring_t ring, double value)
 {
-    if (lil->callback[LIL_CALLBACK_WRITE]) {
-        lil_write_callback_proc_t proc = (lil_write_callback_proc_t)lil->callback[LIL_CALLBACK_WRITE];
-        proc(lil, msg);
-    } else printf("%s", msg);
+    size_t tail = ring->tail;
+    if (tail - ring->head >= ring->size) return 0;
+    ring->v[tail & ring->mask] = value;
+    RING_BARRIER();
+    ring->tail = tail + 1;
+    return 1;
 }
 
-static LILCALLBACK lil_value_t fnc_reflect(lil_t lil, size_t argc, lil_value_t* argv)
+void lil_free(lil_t lil)
 {
-    lil_func_t func;
-    const char* type;
-    size_t i;
+    if (!lil) return;
+    free_exec(lil, lil->mainexec);
+    while (lil->execs) {
+        lil_exec_t* next = lil->execs->next;
+        free_exec(lil, lil->execs);
+        lil->execs = next;
+    }
+    free(lil->err_msg);
+    lil_free_value(lil->empty);
+    while (lil->env) {
+        lil_env_t next = lil->env->parent;
+        lil_free_env(lil->env);
+        lil->env = next;
+    }
+    drop_jail(lil);
+    lil_flush(lil);
+    free(lil->outbuf);
+    free_embeds(lil);
+    free_formats(lil);
+    free_cmds(lil, 0);
+    hm_destroy(&lil->cmdmap);
+    free(lil->cmd);
+    free(lil->dollarprefix);
+    free(lil->catcher);
+    free_rings(lil);
+    free_mapped(lil);
+    free(lil);
+}
+
+LILAPI void lil_set_data(lil_t lil, void* data)
+{
+    lil->data = data;
+}
+
+LILAPI void* lil_get_data(lil_t lil)
+{
+    return lil->data;
+}
+
+/* copies the commands of src into lil, which has none; values are copied
+ * rather than shared because the two may be used from different threads */
+static void copy_cmds(lil_t lil, lil_t src)
+{
+    size_t i, j;
+    lil_func_t* ncmd = realloc(lil->cmd, sizeof(lil_func_t)*(src->cmds ? src->cmds : 1));
+    if (!ncmd) return;
+    lil->cmd = ncmd;
+    for (i=0; i<src->cmds; i++) {
+        lil_func_t scmd = src->cmd[i];
+        lil_func_t cmd = calloc(1, sizeof(struct _lil_func_t));
+        if (!cmd) break;
+        cmd->name = strclone(scmd->name);
+        cmd->proc = scmd->proc;
+        cmd->code = copy_value(scmd->code);
+        if (scmd->argnames) {
+            cmd->argnames = lil_alloc_list();
+            for (j=0; j<scmd->argnames->c; j++)
+                lil_list_append(cmd->argnames, copy_value(scmd->argnames->v[j]));
+        }
+        ncmd[lil->cmds++] = cmd;
+        /* after a rename two commands may share a name, keep the one src finds */
+        if (hm_get(&src->cmdmap, scmd->name) == scmd) hm_put(&lil->cmdmap, cmd->name, cmd);
+    }
+    memcpy(lil->stdoff, src->stdoff, sizeof(lil->stdoff));
+    lil->cmdsdirty = 0;
+}
+
+/* copies the global variables of src into the empty root environment of lil */
+static void copy_globals(lil_t lil, lil_t src)
+{
+    lil_env_t env = lil->rootenv;
+    lil_env_t senv = src->rootenv;
+    size_t i;
+    if (!senv->vars) return;
+    env->var = malloc(sizeof(lil_var_t)*senv->vars);
+    if (!env->var) return;
+    for (i=0; i<senv->vars; i++) {
+        lil_var_t svar = senv->var[i];
+        lil_var_t var = calloc(1, sizeof(struct _lil_var_t));
+        if (!var) break;
+        var->n = strclone(svar->n);
+        var->w = svar->w ? strclone(svar->w) : NULL;
+        var->env = env;
+        var->v = copy_value(svar->v);
+        env->var[env->vars++] = var;
+        hm_put(&env->varmap, var->n, var);
+    }
+}
+
+lil_t lil_clone_interp(lil_t src)
+{
+    lil_t lil = lil_new();
+    copy_cmds(lil, src);
+    copy_globals(lil, src);
+    free(lil->dollarprefix);
+    lil->dollarprefix = strclone(src->dollarprefix);
+    lil->catcher = src->catcher ? strclone(src->catcher) : NULL;
+    memcpy(lil->callback, src->callback, sizeof(lil->callback));
+    lil->data = src->data;
+    lil_set_output(lil, src->outpolicy, src->outsize);
+    return lil;
+}
+
+/* puts a pooled interpreter back to the state of the pool's prototype */
+static void reset_lil(lil_t lil, lil_t proto)
+{
+    lil_flush(lil);
+    if (lil->outpolicy != proto->outpolicy || lil->outsize != proto->outsize) lil_set_output(lil, proto->outpolicy, proto->outsize);
+    free_exec(lil, lil->mainexec);
+    lil->mainexec = NULL;
+    while (lil->execs) {
+        lil_exec_t* next = lil->execs->next;
+        free_exec(lil, lil->execs);
+        lil->execs = next;
+    }
+    lil->lastexec = 0;
+    while (lil->env) {
+        lil_env_t next = lil->env->parent;
+        lil_free_env(lil->env);
+        lil->env = next;
+    }
+    lil->rootenv = lil->env = lil_alloc_env(NULL);
+    copy_globals(lil, proto);
+    lil->downenv = NULL;
+    lil->code = lil->rootcode = NULL;
+    lil->clen = lil->head = 0;
+    lil->ignoreeol = 0;
+    lil->parse_depth = 0;
+    lil->error = ERROR_NOERROR;
+    free(lil->err_msg);
+    lil->err_msg = NULL;
+    free(lil->catcher);
+    lil->catcher = proto->catcher ? strclone(proto->catcher) : NULL;
+    lil->in_catcher = 0;
+    free(lil->dollarprefix);
+    lil->dollarprefix = strclone(proto->dollarprefix);
+    memcpy(lil->callback, proto->callback, sizeof(lil->callback));
+    lil->data = proto->data;
+    free_rings(lil);
+    free_mapped(lil);
+    /* commands added by the job are simply dropped, the whole table is only
+     * copied again if the job redefined, renamed or removed one of the others */
+    free_cmds(lil, proto->cmds);
+    if (lil->cmdsdirty) {
+        free_cmds(lil, 0);
+        hm_destroy(&lil->cmdmap);
+        hm_init(&lil->cmdmap);
+        copy_cmds(lil, proto);
+    }
+}
+
+lil_pool_t lil_pool_new(size_t count, lil_pool_setup_proc_t setup)
+{
+    lil_pool_t pool = calloc(1, sizeof(struct _lil_pool_t));
+    size_t i;
+    if (!pool) return NULL;
+    pool->idle = malloc(sizeof(lil_t)*(count ? count : 1));
+    if (!pool->idle) {
+        free(pool);
+        return NULL;
+    }
+    pool->proto = lil_new();
+    if (setup) setup(pool->proto);
+    for (i=0; i<count; i++) pool->idle[pool->idles++] = lil_clone_interp(pool->proto);
+#ifdef LIL_ENABLE_THREADS
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+#endif
+    return pool;
+}
+
+void lil_pool_free(lil_pool_t pool)
+{
+    size_t i;
+    if (!pool) return;
+    for (i=0; i<pool->idles; i++) lil_free(pool->idle[i]);
+    lil_free(pool->proto);
+    free(pool->idle);
+#ifdef LIL_ENABLE_THREADS
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+#endif
+    free(pool);
+}
+
+lil_t lil_pool_get(lil_pool_t pool)
+{
+    lil_t lil = NULL;
+#ifdef LIL_ENABLE_THREADS
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->idles) pthread_cond_wait(&pool->cond, &pool->lock);
+#endif
+    if (pool->idles) lil = pool->idle[--pool->idles];
+#ifdef LIL_ENABLE_THREADS
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    return lil;
+}
+
+void lil_pool_put(lil_pool_t pool, lil_t lil)
+{
+    if (!lil) return;
+    reset_lil(lil, pool->proto);
+#ifdef LIL_ENABLE_THREADS
+    pthread_mutex_lock(&pool->lock);
+#endif
+    pool->idle[pool->idles++] = lil;
+#ifdef LIL_ENABLE_THREADS
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+/* appends n bytes of s to a buffer that grows geometrically and keeps it
+ * zero terminated, returns 0 if out of memory */
+static int buf_append(char** buf, size_t* len, size_t* cap, const char* s, size_t n)
+{
+    if (*len + n + 1 > *cap) {
+        size_t ncap = *cap ? *cap : 64;
+        char* nbuf;
+        while (ncap < *len + n + 1) ncap *= 2;
+        nbuf = realloc(*buf, ncap);
+        if (!nbuf) return 0;
+        *buf = nbuf;
+        *cap = ncap;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = 0;
+    return 1;
+}
+
+/* hands what lil_embedded_stream collected to its sink */
+static void send_embed(lil_t lil, const char* data, size_t len)
+{
+    if (!len || lil->embclosed) return;
+    if (!lil->embsink(lil, data, len, lil->embdata)) {
+        lil->embclosed = 1;
+        lil_set_error(lil, "embedded output closed");
+    }
+}
+
+static LILCALLBACK void fnc_embed_write(lil_t lil, const char* msg)
+{
+    size_t len;
+    if (lil->callback[LIL_CALLBACK_EMBEDDEDFILTER]) {
+        lil_embeddedfilter_callback_proc_t proc = (lil_embeddedfilter_callback_proc_t)lil->callback[LIL_CALLBACK_EMBEDDEDFILTER];
+        msg = proc(lil, msg);
+        if (!msg) return;
+    }
+    len = strlen(msg);
+    if (lil->embsink && lil->embedlen + len > EMBED_CHUNK) {
+        send_embed(lil, lil->embed, lil->embedlen);
+        lil->embedlen = 0;
+        if (len >= EMBED_CHUNK) {
+            send_embed(lil, msg, len);
+            return;
+        }
+    }
+    buf_append(&lil->embed, &lil->embedlen, &lil->embedcap, msg, len);
+}
+
+/* finds pat in the len bytes at s */
+static const char* find_str(const char* s, size_t len, const char* pat, size_t patlen)
+{
+    const char* end = s + len;
+    while ((size_t)(end - s) >= patlen && (s = memchr(s, pat[0], end - s - patlen + 1))) {
+        if (!memcmp(s, pat, patlen)) return s;
+        s++;
+    }
+    return NULL;
+}
+
+/* turns a template into a script that writes its text between the code, in
+ * one pass */
+static char* embed_script(const char* code, size_t codelen, size_t* len)
+{
+    char* script = NULL;
+    size_t cap = 0, head = 0;
+    int ok = 1;
+    *len = 0;
+    while (ok && head < codelen) {
+        const char* tag = find_str(code + head, codelen - head, "<?lil", 5);
+        size_t end = tag ? (size_t)(tag - code) : codelen;
+        if (end > head) {
+            /* braces in the text are written with \o and \c */
+            ok = buf_append(&script, len, &cap, "\nwrite {", 8);
+            while (ok && head < end) {
+                size_t run = head;
+                while (run < end && code[run] != '{' && code[run] != '}') run++;
+                ok = buf_append(&script, len, &cap, code + head, run - head);
+                if (ok && run < end) ok = buf_append(&script, len, &cap, code[run] == '{' ? "}\"\\o\"{" : "}\"\\c\"{", 6);
+                head = run < end ? run + 1 : end;
+            }
+            if (ok) ok = buf_append(&script, len, &cap, "}\n", 2);
+        }
+        if (!tag || !ok) break;
+        head = end + 5;
+        tag = find_str(code + head, codelen - head, "?>", 2);
+        end = tag ? (size_t)(tag - code) : codelen;
+        ok = buf_append(&script, len, &cap, code + head, end - head) && buf_append(&script, len, &cap, "\n", 1);
+        head = tag ? end + 2 : codelen;
+    }
+    if (!ok) {
+        free(script);
+        return NULL;
+    }
+    return script ? script : strclone("");
+}
+
+/* compiles a template into e */
+static int compile_embed(lil_t lil, lil_embed_t* e, const char* code, size_t len)
+{
+    size_t slen;
+    char* script = embed_script(code, len, &slen);
+    if (!script) return 0;
+    e->image = lil_compile(lil, script, slen, NULL);
+    free(script);
+    e->code = malloc(len + 1);
+    if (!e->image || !e->code) {
+        free(e->image);
+        free(e->code);
+        e->image = e->code = NULL;
+        return 0;
+    }
+    memcpy(e->code, code, len + 1);
+    e->len = len;
+    return 1;
+}
+
+/* returns the cached compiled template, compiling it in place of the oldest
+ * one not being rendered; NULL if all are busy */
+static lil_embed_t* find_embed(lil_t lil, const char* code, size_t len)
+{
+    size_t i;
+    lil_embed_t* e;
+    for (i=0; i<EMBED_CACHE; i++) {
+        e = lil->embcache + i;
+        if (e->image && e->len == len && !memcmp(e->code, code, len)) return e;
+    }
+    for (i=0; i<EMBED_CACHE; i++) {
+        e = lil->embcache + (lil->embnext + i) % EMBED_CACHE;
+        if (e->busy) continue;
+        lil->embnext = (lil->embnext + i + 1) % EMBED_CACHE;
+        free(e->image);
+        free(e->code);
+        e->image = e->code = NULL;
+        return compile_embed(lil, e, code, len) ? e : NULL;
+    }
+    return NULL;
+}
+
+static void free_embeds(lil_t lil)
+{
+    size_t i;
+    for (i=0; i<EMBED_CACHE; i++) {
+        free(lil->embcache[i].image);
+        free(lil->embcache[i].code);
+    }
+}
+
+/* runs a template with the write callback set to fnc_embed_write */
+static void render_embed(lil_t lil, const char* code)
+{
+    size_t codelen = strlen(code);
+    lil_embed_t tmp, *e = find_embed(lil, code, codelen);
+    if (!e) {
+        /* every cached template is being rendered by an outer call */
+        memset(&tmp, 0, sizeof(tmp));
+        if (!compile_embed(lil, &tmp, code, codelen)) return;
+        e = &tmp;
+    }
+    e->busy++;
+    lil_free_value(lil_parse_image(lil, e->image, 0, 1));
+    e->busy--;
+    if (e == &tmp) {
+        free(tmp.image);
+        free(tmp.code);
+    }
+    lil_flush(lil);
+}
+
+/* the output state of lil_embedded, saved around nested calls */
+typedef struct _embed_state_t
+{
+    char* embed;
+    size_t embedlen;
+    size_t embedcap;
+    lil_embedded_sink_proc_t embsink;
+    void* embdata;
+    int embclosed;
+    lil_callback_proc_t write;
+} embed_state_t;
+
+static void begin_embed(lil_t lil, embed_state_t* save, lil_embedded_sink_proc_t sink, void* userdata)
+{
+    lil_flush(lil);
+    save->embed = lil->embed;
+    save->embedlen = lil->embedlen;
+    save->embedcap = lil->embedcap;
+    save->embsink = lil->embsink;
+    save->embdata = lil->embdata;
+    save->embclosed = lil->embclosed;
+    save->write = lil->callback[LIL_CALLBACK_WRITE];
+    lil->callback[LIL_CALLBACK_WRITE] = (lil_callback_proc_t)fnc_embed_write;
+    lil->embed = NULL;
+    lil->embedlen = lil->embedcap = 0;
+    lil->embsink = sink;
+    lil->embdata = userdata;
+    lil->embclosed = 0;
+}
+
+static void end_embed(lil_t lil, embed_state_t* save)
+{
+    lil->embed = save->embed;
+    lil->embedlen = save->embedlen;
+    lil->embedcap = save->embedcap;
+    lil->embsink = save->embsink;
+    lil->embdata = save->embdata;
+    lil->embclosed = save->embclosed;
+    lil->callback[LIL_CALLBACK_WRITE] = save->write;
+}
+
+char* lil_embedded(lil_t lil, const char* code, unsigned int flags)
+{
+    embed_state_t save;
+    char* result;
+    begin_embed(lil, &save, NULL, NULL);
+    render_embed(lil, code);
+    result = lil->embed ? lil->embed : strclone("");
+    end_embed(lil, &save);
+    return result;
+}
+
+/* flags is reserved, like lil_embedded's, and should be 0 */
+int lil_embedded_stream(lil_t lil, const char* code, unsigned int flags, lil_embedded_sink_proc_t sink, void* userdata)
+{
+    embed_state_t save;
+    int ok;
+    begin_embed(lil, &save, sink, userdata);
+    render_embed(lil, code);
+    send_embed(lil, lil->embed, lil->embedlen);
+    ok = !lil->embclosed && !lil->error;
+    free(lil->embed);
+    end_embed(lil, &save);
+    return ok;
+}
+
+void lil_freemem(void* ptr)
+{
+    free(ptr);
+}
+
+static void write_out(lil_t lil, const char* msg)
+{
+    if (lil->callback[LIL_CALLBACK_WRITE]) {
+        lil_write_callback_proc_t proc = (lil_write_callback_proc_t)lil->callback[LIL_CALLBACK_WRITE];
+        proc(lil, msg);
+    } else printf("%s", msg);
+}
+
+void lil_write(lil_t lil, const char* msg)
+{
+    size_t len;
+    if (!lil->outbuf) {
+        write_out(lil, msg);
+        return;
+    }
+    len = strlen(msg);
+    if (lil->outlen + len >= lil->outsize) {
+        lil_flush(lil);
+        /* no point in copying what doesn't fit anyway */
+        if (len >= lil->outsize) {
+            write_out(lil, msg);
+            return;
+        }
+    }
+    memcpy(lil->outbuf + lil->outlen, msg, len + 1);
+    lil->outlen += len;
+    if (lil->outpolicy == LIL_OUTPUT_LINE && memchr(msg, '\n', len)) lil_flush(lil);
+}
+
+void lil_flush(lil_t lil)
+{
+    if (!lil->outlen) return;
+    lil->outlen = 0;
+    write_out(lil, lil->outbuf);
+}
+
+int lil_set_output(lil_t lil, int policy, size_t size)
+{
+    char* buf = NULL;
+    lil_flush(lil);
+    if (policy != LIL_OUTPUT_DIRECT) {
+        if (size < 2) size = 2;
+        buf = malloc(size);
+        if (!buf) return 0;
+    }
+    free(lil->outbuf);
+    lil->outbuf = buf;
+    lil->outsize = buf ? size : 0;
+    lil->outpolicy = buf ? policy : LIL_OUTPUT_DIRECT;
+    return 1;
+}
+
+static LILCALLBACK lil_value_t fnc_reflect(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_func_t func;
+    const char* type;
+    size_t i;
     lil_value_t r;
     if (!argc) return NULL;
     type = lil_to_string(argv[0]);
@@ -2340,10 +3833,15 @@ static LILCALLBACK lil_value_t fnc_reflect(lil_t lil, size_t argc, lil_value_t*
         return lil_clone_value(func->code);
     }
     if (!strcmp(type, "func-count")) {
-        return lil_alloc_integer(lil->cmds);
+        size_t count = lil->cmds;
+        for (i=0; stdcmd(i); i++)
+            if (!STDCMD_HIDDEN(lil, i)) count++;
+        return lil_alloc_integer(count);
     }
     if (!strcmp(type, "funcs")) {
         lil_list_t funcs = lil_alloc_list();
+        for (i=0; (func = stdcmd(i)); i++)
+            if (!STDCMD_HIDDEN(lil, i)) lil_list_append(funcs, lil_alloc_string(func->name));
         for (i=0; i<lil->cmds; i++)
             lil_list_append(funcs, lil_alloc_string(lil->cmd[i]->name));
         r = lil_list_to_value(funcs, 1);
@@ -2374,7 +3872,7 @@ static LILCALLBACK lil_value_t fnc_reflect(lil_t lil, size_t argc, lil_value_t*
         const char* target;
         if (argc == 1) return NULL;
         target = lil_to_string(argv[1]);
-        return hm_has(&lil->cmdmap, target) ? lil_alloc_string("1") : NULL;
+        return find_cmd(lil, target) ? lil_alloc_string("1") : NULL;
     }
     if (!strcmp(type, "has-var")) {
         const char* target;
@@ -2472,7 +3970,17 @@ static LILCALLBACK lil_value_t fnc_rename(lil_t lil, size_t argc, lil_value_t* a
         return NULL;
     }
     r = lil_alloc_string(func->name);
-    if (newname[0]) {
+    if (stdcmd_index(func) >= 0) {
+        hide_stdcmd(lil, oldname);
+        if (newname[0]) {
+            lil_func_t ncmd = add_func(lil, newname);
+            if (ncmd) ncmd->proc = func->proc;
+            drop_jail(lil);
+        }
+    } else if (newname[0]) {
+        hide_stdcmd(lil, newname);
+        if (func->proc) drop_jail(lil);
+        lil->cmdsdirty = 1;
         hm_put(&lil->cmdmap, oldname, 0);
         hm_put(&lil->cmdmap, newname, func);
         free(func->name);
@@ -2530,7 +4038,8 @@ static LILCALLBACK lil_value_t fnc_local(lil_t lil, size_t argc, lil_value_t* ar
     return NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_write(lil_t lil, size_t argc, lil_value_t* argv)
+/* writes the arguments separated by spaces with a single lil_write */
+static void write_args(lil_t lil, size_t argc, lil_value_t* argv, const char* end)
 {
     size_t i;
     lil_value_t msg = lil_alloc_string(NULL);
@@ -2538,15 +4047,26 @@ static LILCALLBACK lil_value_t fnc_write(lil_t lil, size_t argc, lil_value_t* ar
         if (i) lil_append_char(msg, ' ');
         lil_append_val(msg, argv[i]);
     }
+    lil_append_string(msg, end);
     lil_write(lil, lil_to_string(msg));
     lil_free_value(msg);
+}
+
+static LILCALLBACK lil_value_t fnc_write(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    write_args(lil, argc, argv, "");
     return NULL;
 }
 
 static LILCALLBACK lil_value_t fnc_print(lil_t lil, size_t argc, lil_value_t* argv)
 {
-    fnc_write(lil, argc, argv);
-    lil_write(lil, "\n");
+    write_args(lil, argc, argv, "\n");
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_flush(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_flush(lil);
     return NULL;
 }
 
@@ -2673,22 +4193,36 @@ static LILCALLBACK lil_value_t fnc_jaileval(lil_t lil, size_t argc, lil_value_t*
     size_t i;
     lil_t sublil;
     lil_value_t r;
-    size_t base = 0;
+    size_t base = 0, gen;
     if (!argc) return NULL;
     if (!strcmp(lil_to_string(argv[0]), "clean")) {
         base = 1;
         if (argc == 1) return NULL;
     }
-    sublil = lil_new();
-    if (base != 1) {
-        for (i=lil->syscmds; i<lil->cmds; i++) {
-            lil_func_t fnc = lil->cmd[i];
-            if (!fnc->proc) continue;
-            lil_register(sublil, fnc->name, fnc->proc);
+    /* the jail is set up once, then cloned or reset for every call */
+    if (lil->jail && lil->jailclean != (base == 1)) drop_jail(lil);
+    if (!lil->jail) {
+        lil_t jail = lil_new();
+        if (base != 1) {
+            for (i=0; i<lil->cmds; i++) {
+                lil_func_t fnc = lil->cmd[i];
+                if (!fnc->proc) continue;
+                lil_register(jail, fnc->name, fnc->proc);
+            }
         }
+        lil->jail = jail;
+        lil->jailclean = base == 1;
     }
+    gen = lil->jailgen;
+    sublil = lil->jailbox ? lil->jailbox : lil_clone_interp(lil->jail);
+    lil->jailbox = NULL;
     r = lil_parse_value(sublil, argv[base], 1);
-    lil_free(sublil);
+    if (lil->jailgen == gen && !lil->jailbox) {
+        reset_lil(sublil, lil->jail);
+        lil->jailbox = sublil;
+    } else {
+        lil_free(sublil);
+    }
     return r;
 }
 
@@ -2697,20 +4231,46 @@ static LILCALLBACK lil_value_t fnc_count(lil_t lil, size_t argc, lil_value_t* ar
     lil_list_t list;
     char buff[64];
     if (!argc) return alloc_value("0");
+    if (argv[0]->t == LIL_TYPE_LIST) {
+        sprintf(buff, "%u", (unsigned int)argv[0]->items->c);
+        return alloc_value(buff);
+    }
     list = lil_subst_to_list(lil, argv[0]);
     sprintf(buff, "%u", (unsigned int)list->c);
     lil_free_list(list);
     return alloc_value(buff);
 }
 
+/* returns item i of val, whose items are known to be where its item
+ * positions say, without parsing the rest of the list */
+static lil_value_t list_item(lil_t lil, lil_value_t val, size_t i)
+{
+    const char* s = value_bytes(val);
+    size_t at = val->items->at[i*2], len = val->items->at[i*2 + 1];
+    lil_list_t list;
+    lil_value_t r;
+    if (s[at] != '{') return alloc_slice(val, at, len);
+    if (!memchr(s + at + 1, '{', len - 2) && !memchr(s + at + 1, '}', len - 2))
+        return alloc_slice(val, at + 1, len - 2);
+    /* braces in the item are written as escapes that must be parsed */
+    r = alloc_slice(val, at, len);
+    list = lil_subst_to_list(lil, r);
+    lil_free_value(r);
+    r = list->c ? lil_clone_value(list->v[0]) : alloc_value(NULL);
+    lil_free_list(list);
+    return r;
+}
+
 static LILCALLBACK lil_value_t fnc_index(lil_t lil, size_t argc, lil_value_t* argv)
 {
     lil_list_t list;
     size_t index;
     lil_value_t r;
     if (argc < 2) return NULL;
-    list = lil_subst_to_list(lil, argv[0]);
     index = (size_t)lil_to_integer(argv[1]);
+    if (argv[0]->t == LIL_TYPE_LIST)
+        return index < argv[0]->items->c ? list_item(lil, argv[0], index) : NULL;
+    list = lil_subst_to_list(lil, argv[0]);
     if (index >= list->c)
         r = NULL;
     else
@@ -2727,7 +4287,7 @@ static LILCALLBACK lil_value_t fnc_indexof(lil_t lil, size_t argc, lil_value_t*
     if (argc < 2) return NULL;
     list = lil_subst_to_list(lil, argv[0]);
     for (index = 0; index < list->c; index++)
-        if (!strcmp(lil_to_string(list->v[index]), lil_to_string(argv[1]))) {
+        if (!compare_values(list->v[index], argv[1])) {
             r = lil_alloc_integer(index);
             break;
         }
@@ -2735,40 +4295,63 @@ static LILCALLBACK lil_value_t fnc_indexof(lil_t lil, size_t argc, lil_value_t*
     return r;
 }
 
-static LILCALLBACK lil_value_t fnc_append(lil_t lil, size_t argc, lil_value_t* argv)
-{
-    lil_list_t list;
-    lil_value_t r;
-    size_t i, base = 1;
-    int access = LIL_SETVAR_LOCAL;
-    const char* varname;
-    if (argc < 2) return NULL;
-    varname = lil_to_string(argv[0]);
-    if (!strcmp(varname, "global")) {
-        if (argc < 3) return NULL;
-        varname = lil_to_string(argv[1]);
-        base = 2;
-        access = LIL_SETVAR_GLOBAL;
+/* steps over the list item at s[*i] of a list that is in the form
+ * lil_list_to_value writes (items separated by single spaces and braced
+ * only when they need it, with no braces inside), setting *b and *e to
+ * where its bytes start and end, braces included; returns 0 if the list
+ * isn't in that form and has to be parsed */
+static int list_step(const char* s, size_t len, size_t* i, size_t* b, size_t* e)
+{
+    size_t j = *i;
+    *b = j;
+    if (s[j] == '{') {
+        while (++j < len && s[j] != '{' && s[j] != '}');
+        if (j == len || s[j] == '{') return 0;
+        /* an item that doesn't need braces would lose them */
+        if (j > *b + 1 && scan_class(s + *b + 1, s + j, CC_ESCAPE) == s + j) return 0;
+        j++;
+    } else {
+        j = scan_class(s + j, s + len, CC_ESCAPE) - s;
+        if (j == *b) return 0;
     }
-    list = lil_subst_to_list(lil, lil_get_var(lil, varname));
-    for (i=base; i<argc; i++)
-        lil_list_append(list, lil_clone_value(argv[i]));
-    r = lil_list_to_value(list, 1);
-    lil_free_list(list);
-    lil_set_var(lil, varname, r, access);
-    return r;
+    *e = j;
+    if (j < len && (s[j] != ' ' || ++j == len)) return 0;
+    *i = j;
+    return 1;
+}
+
+/* finds the bytes of the items from to to-1 of a list in the form
+ * list_step takes so that slice can share them */
+static int list_span(lil_value_t list, lilint_t from, lilint_t to, size_t* start, size_t* end)
+{
+    const char* s = value_bytes(list);
+    size_t len = list->l, i = 0, b, e;
+    lilint_t item = 0;
+    *start = len;
+    *end = 0;
+    while (i < len) {
+        if (!list_step(s, len, &i, &b, &e)) return 0;
+        if (item == from) *start = b;
+        if (item < to) *end = e;
+        item++;
+    }
+    if (*end < *start) *end = *start;
+    return 1;
 }
 
 static LILCALLBACK lil_value_t fnc_slice(lil_t lil, size_t argc, lil_value_t* argv)
 {
     lil_list_t list, slice;
-    size_t i;
+    size_t i, start, end;
     lilint_t from, to;
     lil_value_t r;
     if (argc < 1) return NULL;
     if (argc < 2) return lil_clone_value(argv[0]);
     from = lil_to_integer(argv[1]);
     if (from < 0) from = 0;
+    to = argc > 2 ? lil_to_integer(argv[2]) : (lilint_t)argv[0]->l;
+    if (list_span(argv[0], from, to, &start, &end))
+        return end > start ? alloc_slice(argv[0], start, end - start) : alloc_value(NULL);
     list = lil_subst_to_list(lil, argv[0]);
     to = argc > 2 ? lil_to_integer(argv[2]) : (lilint_t)list->c;
     if (to > (lilint_t)list->c) to = list->c;
@@ -2810,21 +4393,369 @@ static LILCALLBACK lil_value_t fnc_filter(lil_t lil, size_t argc, lil_value_t* a
     return r;
 }
 
-static LILCALLBACK lil_value_t fnc_list(lil_t lil, size_t argc, lil_value_t* argv)
+#define SORT_ASCII 0
+#define SORT_INTEGER 1
+#define SORT_REAL 2
+
+/* a list item with the key it is sorted by, converted once before sorting */
+typedef struct _sort_item_t
 {
-    lil_list_t list = lil_alloc_list();
-    lil_value_t r;
-    size_t i;
-    for (i=0; i<argc; i++)
-        lil_list_append(list, lil_clone_value(argv[i]));
-    r = lil_list_to_value(list, 1);
-    lil_free_list(list);
-    return r;
+    lil_value_t v;
+    union {
+        lilint_t i;
+        double f;
+    } k;
+} sort_item_t;
+
+typedef struct _sort_t
+{
+    lil_t lil;
+    int mode;
+    int decreasing;
+    const char* cmd;
+} sort_t;
+
+static int sort_compare(sort_t* sort, const sort_item_t* a, const sort_item_t* b)
+{
+    int r;
+    if (sort->cmd) {
+        lil_value_t args[2], res;
+        if (sort->lil->error) return 0;
+        args[0] = a->v;
+        args[1] = b->v;
+        res = lil_call(sort->lil, sort->cmd, 2, args);
+        /* a function that returns nothing compares everything as equal */
+        r = res ? (int)lil_to_integer(res) : 0;
+        lil_free_value(res);
+    } else if (sort->mode == SORT_INTEGER) {
+        r = a->k.i < b->k.i ? -1 : a->k.i > b->k.i;
+    } else if (sort->mode == SORT_REAL) {
+        r = a->k.f < b->k.f ? -1 : a->k.f > b->k.f;
+    } else {
+        r = compare_values(a->v, b->v);
+    }
+    return sort->decreasing ? -r : r;
+}
+
+/* stable merge sort of n items, using tmp (of n items) for merging */
+static void merge_sort(sort_t* sort, sort_item_t* items, sort_item_t* tmp, size_t n)
+{
+    size_t mid = n/2, i = 0, j, k = 0;
+    if (n < 2) return;
+    merge_sort(sort, items, tmp, mid);
+    merge_sort(sort, items + mid, tmp, n - mid);
+    /* nothing to merge if the halves are already in order */
+    if (sort_compare(sort, &items[mid - 1], &items[mid]) <= 0) return;
+    j = mid;
+    while (i < mid && j < n) {
+        if (sort_compare(sort, &items[j], &items[i]) < 0)
+            tmp[k++] = items[j++];
+        else
+            tmp[k++] = items[i++];
+    }
+    while (i < mid) tmp[k++] = items[i++];
+    memcpy(items, tmp, k*sizeof(sort_item_t));
 }
 
-static LILCALLBACK lil_value_t fnc_subst(lil_t lil, size_t argc, lil_value_t* argv)
+static LILCALLBACK lil_value_t fnc_lsort(lil_t lil, size_t argc, lil_value_t* argv)
 {
-    if (argc < 1) return NULL;
+    lil_list_t list;
+    sort_item_t* items;
+    sort_t sort;
+    lil_value_t r;
+    size_t i, c;
+    int unique = 0;
+    if (argc < 1) return NULL;
+    sort.lil = lil;
+    sort.mode = SORT_ASCII;
+    sort.decreasing = 0;
+    sort.cmd = NULL;
+    for (i=0; i + 1 < argc; i++) {
+        const char* opt = lil_to_string(argv[i]);
+        if (!strcmp(opt, "-ascii")) sort.mode = SORT_ASCII;
+        else if (!strcmp(opt, "-integer")) sort.mode = SORT_INTEGER;
+        else if (!strcmp(opt, "-real")) sort.mode = SORT_REAL;
+        else if (!strcmp(opt, "-increasing")) sort.decreasing = 0;
+        else if (!strcmp(opt, "-decreasing")) sort.decreasing = 1;
+        else if (!strcmp(opt, "-unique")) unique = 1;
+        else if (!strcmp(opt, "-command") && i + 2 < argc) sort.cmd = lil_to_string(argv[++i]);
+        else {
+            lil_set_error(lil, "unknown lsort option");
+            return NULL;
+        }
+    }
+    if (sort.cmd && !find_cmd(lil, sort.cmd)) {
+        lil_set_error(lil, "unknown lsort command");
+        return NULL;
+    }
+    list = lil_subst_to_list(lil, argv[argc - 1]);
+    items = malloc(sizeof(sort_item_t)*list->c*2 + 1);
+    if (!items) {
+        lil_free_list(list);
+        return NULL;
+    }
+    for (i=0; i<list->c; i++) {
+        items[i].v = list->v[i];
+        if (sort.mode == SORT_INTEGER) items[i].k.i = lil_to_integer(items[i].v);
+        else if (sort.mode == SORT_REAL) items[i].k.f = lil_to_double(items[i].v);
+    }
+    merge_sort(&sort, items, items + list->c, list->c);
+    /* put the items back in the list in their new order, keeping only the
+     * last of equal items with -unique */
+    for (i=0, c=0; i<list->c; i++) {
+        if (unique && i + 1 < list->c && !sort_compare(&sort, &items[i], &items[i + 1]))
+            lil_free_value(items[i].v);
+        else
+            list->v[c++] = items[i].v;
+    }
+    list->c = c;
+    free(items);
+    r = lil->error ? NULL : lil_list_to_value(list, 1);
+    lil_free_list(list);
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_range(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lilint_t start = 0, end, step = 1;
+    uint64_t span, ustep, n, k;
+    lil_value_t val;
+    char buf[32], *d;
+    if (argc < 1) return NULL;
+    if (argc == 1) {
+        end = lil_to_integer(argv[0]);
+    } else {
+        start = lil_to_integer(argv[0]);
+        end = lil_to_integer(argv[1]);
+        if (argc > 2) step = lil_to_integer(argv[2]);
+    }
+    if (!step) {
+        lil_set_error(lil, "range step can't be zero");
+        return NULL;
+    }
+    /* counted in unsigned numbers so that no range overflows */
+    if (step > 0) {
+        ustep = (uint64_t)step;
+        span = end > start ? (uint64_t)end - (uint64_t)start : 0;
+    } else {
+        ustep = 0 - (uint64_t)step;
+        span = start > end ? (uint64_t)start - (uint64_t)end : 0;
+    }
+    n = span ? (span - 1)/ustep + 1 : 0;
+    if (n > (size_t)-1/32) {
+        lil_set_error(lil, "range too long");
+        return NULL;
+    }
+    val = alloc_value(NULL);
+    if (!n) return val;
+    /* every number takes at most as many bytes as the longer of the ends */
+    k = (uint64_t)snprintf(buf, sizeof(buf), LILINT_PRINTF, start);
+    if ((uint64_t)snprintf(buf, sizeof(buf), LILINT_PRINTF, end) > k) k = (uint64_t)snprintf(buf, sizeof(buf), LILINT_PRINTF, end);
+    if (!value_room(val, (size_t)(n*(k + 3)))) return val;
+    for (k=0; k<n; k++) {
+        lilint_t v = (lilint_t)((uint64_t)start + (step > 0 ? k*ustep : 0 - k*ustep));
+        int len = snprintf(buf, sizeof(buf), LILINT_PRINTF, v);
+        if (!(d = value_room(val, (size_t)len + 3))) break;
+        if (k) *d++ = ' ';
+        /* negative numbers need braces in a list, like "{-1}" */
+        if (v < 0) *d++ = '{';
+        memcpy(d, buf, (size_t)len);
+        d += len;
+        if (v < 0) *d++ = '}';
+        *d = 0;
+        val->l = (size_t)(d - val->d);
+    }
+    fit_value(val);
+    return val;
+}
+
+static LILCALLBACK lil_value_t fnc_lrepeat(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list;
+    lil_value_t items, val;
+    lilint_t count;
+    size_t i;
+    char* d;
+    if (argc < 2) return NULL;
+    count = lil_to_integer(argv[0]);
+    val = alloc_value(NULL);
+    if (count <= 0) return val;
+    /* the items are escaped once and their text is copied count times */
+    list = lil_alloc_list();
+    for (i=1; i<argc; i++)
+        lil_list_append(list, lil_clone_value(argv[i]));
+    items = lil_list_to_value(list, 1);
+    lil_free_list(list);
+    if ((uint64_t)count > ((size_t)-1 - 1)/(items->l + 1)) {
+        lil_set_error(lil, "lrepeat result too long");
+    } else if ((d = value_room(val, (size_t)count*(items->l + 1)))) {
+        const char* s = value_bytes(items);
+        for (i=0; i<(size_t)count; i++) {
+            if (i) *d++ = ' ';
+            memcpy(d, s, items->l);
+            d += items->l;
+        }
+        *d = 0;
+        val->l = (size_t)(d - val->d);
+        fit_value(val);
+    }
+    lil_free_value(items);
+    return val;
+}
+
+static LILCALLBACK lil_value_t fnc_lreverse(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list;
+    lil_value_t r;
+    size_t i;
+    if (argc < 1) return NULL;
+    list = lil_subst_to_list(lil, argv[0]);
+    for (i=0; i<list->c/2; i++) {
+        r = list->v[i];
+        list->v[i] = list->v[list->c - 1 - i];
+        list->v[list->c - 1 - i] = r;
+    }
+    r = lil_list_to_value(list, 1);
+    lil_free_list(list);
+    return r;
+}
+
+/* compares item i of the list lsearch looks in with key; the item is cut
+ * out of the list's text if the list wasn't parsed */
+static int search_compare(sort_t* sort, const sort_item_t* key, lil_value_t text, lil_list_t list, const size_t* at, size_t i)
+{
+    sort_item_t item;
+    int r;
+    if (list) {
+        item.v = list->v[i];
+    } else {
+        size_t b = at[i*2], e = at[i*2 + 1];
+        if (value_bytes(text)[b] == '{') {
+            b++;
+            e--;
+        }
+        item.v = alloc_slice(text, b, e - b);
+    }
+    if (sort->mode == SORT_INTEGER) item.k.i = lil_to_integer(item.v);
+    else if (sort->mode == SORT_REAL) item.k.f = lil_to_double(item.v);
+    r = sort_compare(sort, &item, key);
+    if (!list) lil_free_value(item.v);
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_lsearch(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list = NULL;
+    lil_value_t text;
+    sort_item_t key;
+    sort_t sort;
+    const char* s;
+    size_t i, lo, hi, c = 0, cap = 0, pos = 0;
+    size_t* at = NULL;
+    lilint_t found = -1;
+    int sorted = 0;
+    if (argc < 2) return NULL;
+    sort.lil = lil;
+    sort.mode = SORT_ASCII;
+    sort.decreasing = 0;
+    sort.cmd = NULL;
+    for (i=0; i + 2 < argc; i++) {
+        const char* opt = lil_to_string(argv[i]);
+        if (!strcmp(opt, "-exact")) continue;
+        else if (!strcmp(opt, "-sorted")) sorted = 1;
+        else if (!strcmp(opt, "-ascii")) sort.mode = SORT_ASCII;
+        else if (!strcmp(opt, "-integer")) sort.mode = SORT_INTEGER;
+        else if (!strcmp(opt, "-real")) sort.mode = SORT_REAL;
+        else if (!strcmp(opt, "-increasing")) sort.decreasing = 0;
+        else if (!strcmp(opt, "-decreasing")) sort.decreasing = 1;
+        else if (!strcmp(opt, "-command") && i + 3 < argc) sort.cmd = lil_to_string(argv[++i]);
+        else {
+            lil_set_error(lil, "unknown lsearch option");
+            return NULL;
+        }
+    }
+    if (sort.cmd && !find_cmd(lil, sort.cmd)) {
+        lil_set_error(lil, "unknown lsearch command");
+        return NULL;
+    }
+    /* the items of a list that lil_list_to_value wrote are found without
+     * parsing it, so that they needn't all be copied */
+    text = argv[argc - 2];
+    s = value_bytes(text);
+    while (pos < text->l) {
+        if (c == cap) {
+            size_t* grown = realloc(at, sizeof(size_t)*(cap ? cap*4 : 128));
+            if (!grown) break;
+            at = grown;
+            cap = cap ? cap*2 : 64;
+        }
+        if (!list_step(s, text->l, &pos, &at[c*2], &at[c*2 + 1])) break;
+        c++;
+    }
+    if (pos < text->l) {
+        list = lil_subst_to_list(lil, text);
+        c = list->c;
+    }
+    key.v = argv[argc - 1];
+    if (sort.mode == SORT_INTEGER) key.k.i = lil_to_integer(key.v);
+    else if (sort.mode == SORT_REAL) key.k.f = lil_to_double(key.v);
+    /* binary search for the first item not before the key if the list is
+     * sorted like lsort with the same options would sort it */
+    lo = 0;
+    hi = sorted ? c : 0;
+    while (lo < hi && !lil->error) {
+        size_t mid = lo + (hi - lo)/2;
+        if (search_compare(&sort, &key, text, list, at, mid) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (i=lo; i<c && !lil->error; i++) {
+        if (!search_compare(&sort, &key, text, list, at, i)) {
+            found = (lilint_t)i;
+            break;
+        }
+        if (sorted) break;
+    }
+    free(at);
+    if (list) lil_free_list(list);
+    return lil->error ? NULL : lil_alloc_integer(found);
+}
+
+static LILCALLBACK lil_value_t fnc_lassign(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list;
+    lil_value_t r, empty;
+    size_t i;
+    if (argc < 1) return NULL;
+    list = lil_subst_to_list(lil, argv[0]);
+    empty = alloc_value(NULL);
+    for (i=1; i<argc; i++)
+        lil_set_var(lil, lil_to_string(argv[i]), i - 1 < list->c ? list->v[i - 1] : empty, LIL_SETVAR_LOCAL);
+    lil_free_value(empty);
+    /* the items left over are returned */
+    for (i=0; i<argc - 1 && i<list->c; i++)
+        lil_free_value(list->v[i]);
+    if (i) memmove(list->v, list->v + i, (list->c - i)*sizeof(lil_value_t));
+    list->c -= i;
+    r = lil_list_to_value(list, 1);
+    lil_free_list(list);
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_list(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list = lil_alloc_list();
+    lil_value_t r;
+    size_t i;
+    for (i=0; i<argc; i++)
+        lil_list_append(list, lil_clone_value(argv[i]));
+    r = lil_list_to_value(list, 1);
+    lil_free_list(list);
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_subst(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc < 1) return NULL;
     return lil_subst_to_value(lil, argv[0]);
 }
 
@@ -2873,532 +4804,4215 @@ static LILCALLBACK lil_value_t fnc_foreach(lil_t lil, size_t argc, lil_value_t*
     return r;
 }
 
-static LILCALLBACK lil_value_t fnc_return(lil_t lil, size_t argc, lil_value_t* argv)
+static unsigned long dict_hash(lil_value_t key)
 {
-    lil->env->breakrun = 1;
-    lil_free_value(lil->env->retval);
-    lil->env->retval = argc < 1 ? NULL : lil_clone_value(argv[0]);
-    lil->env->retval_set = 1;
-    return argc < 1 ? NULL : lil_clone_value(argv[0]);
+    const char* s = value_bytes(key);
+    unsigned long hash = 5381;
+    size_t i;
+    for (i=0; i<key->l; i++) hash = ((hash << 5) + hash) + (unsigned char)s[i];
+    return hash;
 }
 
-static LILCALLBACK lil_value_t fnc_result(lil_t lil, size_t argc, lil_value_t* argv)
+/* puts the entries of dict in the slots, with at least one slot per entry */
+static int index_dict(lil_dict_t* dict)
 {
-    if (argc > 0) {
-        lil_free_value(lil->env->retval);
-        lil->env->retval = lil_clone_value(argv[0]);
-        lil->env->retval_set = 1;
+    size_t i, slots = 8, *slot;
+    while (slots < dict->c) slots *= 2;
+    slot = calloc(slots, sizeof(size_t));
+    if (!slot) return 0;
+    free(dict->slot);
+    dict->slot = slot;
+    dict->mask = slots - 1;
+    for (i=0; i<dict->c; i++) {
+        dict->e[i].next = slot[dict->e[i].h & dict->mask];
+        slot[dict->e[i].h & dict->mask] = i + 1;
     }
-    return lil->env->retval_set ? lil_clone_value(lil->env->retval) : NULL;
+    return 1;
 }
 
-static LILCALLBACK lil_value_t fnc_expr(lil_t lil, size_t argc, lil_value_t* argv)
+/* returns the index + 1 of the entry for key, or 0 */
+static size_t dict_find(lil_dict_t* dict, lil_value_t key, unsigned long h)
 {
-    if (argc == 1) return lil_eval_expr(lil, argv[0]);
-    if (argc > 1) {
-        lil_value_t val = alloc_value(NULL), r;
-        size_t i;
-        for (i=0; i<argc; i++) {
-            if (i) lil_append_char(val, ' ');
-            lil_append_val(val, argv[i]);
+    size_t i = dict->slot[h & dict->mask];
+    while (i && (dict->e[i - 1].h != h || compare_values(dict->e[i - 1].k, key)))
+        i = dict->e[i - 1].next;
+    return i;
+}
+
+/* sets the value of key, taking over both; returns the index + 1 of the
+ * entry or 0 if there is no memory for it */
+static size_t dict_put(lil_dict_t* dict, lil_value_t key, lil_value_t val)
+{
+    unsigned long h = dict_hash(key);
+    size_t i = dict_find(dict, key, h);
+    lil_dict_entry_t* e;
+    if (i) {
+        lil_free_value(key);
+        lil_free_value(dict->e[i - 1].v);
+        dict->e[i - 1].v = val;
+        return i;
+    }
+    if (dict->c == dict->cap) {
+        size_t cap = dict->cap ? (dict->cap + dict->cap / 2) : 8;
+        e = realloc(dict->e, sizeof(lil_dict_entry_t)*cap);
+        if (!e) {
+            lil_free_value(key);
+            lil_free_value(val);
+            return 0;
         }
-        r = lil_eval_expr(lil, val);
-        lil_free_value(val);
-        return r;
+        dict->e = e;
+        dict->cap = cap;
     }
-    return NULL;
+    e = dict->e + dict->c++;
+    e->k = key;
+    e->v = val;
+    e->h = h;
+    e->at = e->len = 0;
+    if (dict->c > dict->mask + 1) {
+        index_dict(dict);
+    } else {
+        e->next = dict->slot[h & dict->mask];
+        dict->slot[h & dict->mask] = dict->c;
+    }
+    return dict->c;
 }
 
-static lil_value_t real_inc(lil_t lil, const char* varname, float v)
+static lil_dict_t* alloc_dict(void)
 {
-    lil_value_t pv = lil_get_var(lil, varname);
-    double dv = lil_to_double(pv) + v;
-    if (fmod(dv, 1))
-        pv = lil_alloc_double(dv);
-    else
-        pv = lil_alloc_integer((lilint_t)dv);
-    lil_set_var(lil, varname, pv, LIL_SETVAR_LOCAL);
-    return pv;
+    lil_dict_t* dict = calloc(1, sizeof(lil_dict_t));
+    if (!dict) return NULL;
+    dict->refs = 1;
+    if (!index_dict(dict)) {
+        free(dict);
+        return NULL;
+    }
+    return dict;
 }
 
-static LILCALLBACK lil_value_t fnc_inc(lil_t lil, size_t argc, lil_value_t* argv)
+/* returns the dict of val, making it from the text of val (a list of keys
+ * and values) the first time */
+static lil_dict_t* get_dict(lil_t lil, lil_value_t val)
 {
-    if (argc < 1) return NULL;
-    return real_inc(lil, lil_to_string(argv[0]), argc > 1 ? lil_to_double(argv[1]) : 1);
+    lil_dict_t* dict;
+    lil_list_t list;
+    size_t i;
+    if (val->t == LIL_TYPE_DICT) return val->dict;
+    dict = alloc_dict();
+    if (!dict) return NULL;
+    list = lil_subst_to_list(lil, val);
+    for (i=0; i<list->c; i += 2)
+        dict_put(dict, list->v[i], i + 1 < list->c ? list->v[i + 1] : alloc_value(NULL));
+    list->c = 0;
+    lil_free_list(list);
+    drop_type(val);
+    val->t = LIL_TYPE_DICT;
+    val->dict = dict;
+    return dict;
 }
 
-static LILCALLBACK lil_value_t fnc_dec(lil_t lil, size_t argc, lil_value_t* argv)
+/* makes the text of val the entries of its dict, so that the place of each
+ * entry is known */
+static int place_dict(lil_value_t val, lil_dict_t* dict)
 {
-    if (argc < 1) return NULL;
-    return real_inc(lil, lil_to_string(argv[0]), -(argc > 1 ? lil_to_double(argv[1]) : 1));
+    lil_value_t text = alloc_value(NULL);
+    size_t i;
+    if (!text) return 0;
+    for (i=0; i<dict->c; i++) {
+        if (i) lil_append_char(text, ' ');
+        dict->e[i].at = text->l;
+        append_item(text, dict->e[i].k, 1);
+        lil_append_char(text, ' ');
+        append_item(text, dict->e[i].v, 1);
+        dict->e[i].len = text->l - dict->e[i].at;
+    }
+    if ((text->m || text->s) && !own_value(text)) {
+        lil_free_value(text);
+        return 0;
+    }
+    free_data(val);
+    val->d = text->d;
+    val->l = text->l;
+    free(text);
+    dict->placed = 1;
+    return 1;
 }
 
-static LILCALLBACK lil_value_t fnc_read(lil_t lil, size_t argc, lil_value_t* argv)
+/* gives val a dict of its own that can be changed along with its text */
+static lil_dict_t* own_dict(lil_t lil, lil_value_t val)
 {
-    FILE* f;
-    size_t size;
-    char* buffer;
-    lil_value_t r;
-    if (argc < 1) return NULL;
-    if (lil->callback[LIL_CALLBACK_READ]) {
-        lil_read_callback_proc_t proc = (lil_read_callback_proc_t) lil->callback[LIL_CALLBACK_READ];
-        buffer = proc(lil, lil_to_string(argv[0]));
-    } else {
-        f = fopen(lil_to_string(argv[0]), "rb");
-        if (!f) return NULL;
-        fseek(f, 0, SEEK_END);
-        size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        buffer = malloc(size + 1);
-        fread(buffer, 1, size, f);
-        buffer[size] = 0;
-        fclose(f);
+    lil_dict_t* dict = get_dict(lil, val);
+    lil_dict_t* copy;
+    size_t i;
+    if (!dict) return NULL;
+    if (dict->refs > 1) {
+        copy = alloc_dict();
+        if (!copy) return NULL;
+        for (i=0; i<dict->c; i++) {
+            dict_put(copy, lil_clone_value(dict->e[i].k), lil_clone_value(dict->e[i].v));
+            copy->e[i].at = dict->e[i].at;
+            copy->e[i].len = dict->e[i].len;
+        }
+        copy->placed = dict->placed && copy->c == dict->c;
+        dict->refs--;
+        val->dict = dict = copy;
     }
-    r = lil_alloc_string(buffer);
-    free(buffer);
-    return r;
+    if (!dict->placed && !place_dict(val, dict)) return NULL;
+    if ((val->m || val->s) && !own_value(val)) return NULL;
+    return dict;
 }
 
-static LILCALLBACK lil_value_t fnc_store(lil_t lil, size_t argc, lil_value_t* argv)
+/* replaces len bytes of the text of val from at with n bytes of s */
+static int splice_text(lil_value_t val, size_t at, size_t len, const char* s, size_t n)
 {
-    FILE* f;
-    const char* buffer;
-    if (argc < 2) return NULL;
-    if (lil->callback[LIL_CALLBACK_STORE]) {
-        lil_store_callback_proc_t proc = (lil_store_callback_proc_t)lil->callback[LIL_CALLBACK_STORE];
-        proc(lil, lil_to_string(argv[0]), lil_to_string(argv[1]));
-    } else {
-        f = fopen(lil_to_string(argv[0]), "wb");
-        if (!f) return NULL;
-        buffer = lil_to_string(argv[1]);
-        fwrite(buffer, 1, strlen(buffer), f);
-        fclose(f);
+    char* d = val->d;
+    if (n > len) {
+        int empty = !val->d;
+        d = grow_data(val, val->l - len + n);
+        if (!d) return 0;
+        if (empty) d[0] = 0;
     }
-    return lil_clone_value(argv[1]);
+    if (!d) return 1;
+    memmove(d + at + n, d + at + len, val->l - at - len + 1);
+    if (n) memcpy(d + at, s, n);
+    val->l = val->l - len + n;
+    return 1;
 }
 
-static LILCALLBACK lil_value_t fnc_if(lil_t lil, size_t argc, lil_value_t* argv)
+/* moves the entries after the i-th by delta bytes in the text */
+static void shift_entries(lil_dict_t* dict, size_t i, size_t delta)
 {
-    lil_value_t val, r = NULL;
-    int base = 0, not = 0, v;
-    if (argc < 1) return NULL;
-    if (!strcmp(lil_to_string(argv[0]), "not")) base = not = 1;
-    if (argc < (size_t)base + 2) return NULL;
-    val = lil_eval_expr(lil, argv[base]);
-    if (!val || lil->error) return NULL;
-    v = lil_to_boolean(val);
-    if (not) v = !v;
-    if (v) {
-        r = lil_parse_value(lil, argv[base + 1], 0);
-    } else if (argc > (size_t)base + 2) {
-        r = lil_parse_value(lil, argv[base + 2], 0);
+    for (i++; i<dict->c; i++) dict->e[i].at += delta;
+}
+
+/* sets key to v in val (which must have been given to own_dict) and writes
+ * the change into its text */
+static void dict_set_entry(lil_value_t val, lil_dict_t* dict, lil_value_t key, lil_value_t v)
+{
+    size_t c = dict->c, i = dict_put(dict, lil_clone_value(key), lil_clone_value(v));
+    lil_dict_entry_t* e;
+    lil_value_t text;
+    if (!i) return;
+    e = dict->e + i - 1;
+    text = alloc_value(i > 1 && dict->c > c ? " " : NULL);
+    append_item(text, e->k, 1);
+    lil_append_char(text, ' ');
+    append_item(text, e->v, 1);
+    if (dict->c > c) {
+        e->at = val->l + (i > 1);
+        e->len = text->l - (i > 1);
+        splice_text(val, val->l, 0, text->d, text->l);
+    } else {
+        splice_text(val, e->at, e->len, text->d, text->l);
+        shift_entries(dict, i - 1, text->l - e->len);
+        e->len = text->l;
     }
-    lil_free_value(val);
-    return r;
+    lil_free_value(text);
+}
+
+/* removes key from val (which must have been given to own_dict) and from
+ * its text */
+static void dict_remove_entry(lil_value_t val, lil_dict_t* dict, lil_value_t key)
+{
+    size_t i = dict_find(dict, key, dict_hash(key)), at, len;
+    if (!i--) return;
+    /* take the space before the entry, or after it for the first one */
+    at = dict->e[i].at;
+    len = dict->e[i].len;
+    if (i) at--;
+    if (dict->c > 1) len++;
+    splice_text(val, at, len, NULL, 0);
+    shift_entries(dict, i, (size_t)0 - len);
+    lil_free_value(dict->e[i].k);
+    lil_free_value(dict->e[i].v);
+    memmove(dict->e + i, dict->e + i + 1, sizeof(lil_dict_entry_t)*(dict->c - i - 1));
+    dict->c--;
+    index_dict(dict);
+}
+
+/* takes the value of a variable to change it in place, leaving the variable
+ * empty until it is set again; the value is copied if callbacks could see
+ * the variable in between */
+static lil_value_t take_var(lil_t lil, const char* name)
+{
+    lil_var_t var = lil_find_var(lil, lil->env, name);
+    lil_value_t val;
+    if (!var || lil->callback[LIL_CALLBACK_GETVAR] || lil->callback[LIL_CALLBACK_SETVAR] || var->w)
+        return lil_clone_value(lil_get_var(lil, name));
+    val = var->v;
+    var->v = alloc_value(NULL);
+    return val;
 }
 
-static LILCALLBACK lil_value_t fnc_while(lil_t lil, size_t argc, lil_value_t* argv)
+/* stores val back into the variable take_var took it from, without
+ * copying it if take_var didn't; frees val */
+static void put_var(lil_t lil, const char* name, lil_value_t val)
 {
-    lil_value_t val, r = NULL;
-    int base = 0, not = 0, v;
-    if (argc < 1) return NULL;
-    if (!strcmp(lil_to_string(argv[0]), "not")) base = not = 1;
-    if (argc < (size_t)base + 2) return NULL;
-    while (!lil->error && !lil->env->breakrun) {
-        val = lil_eval_expr(lil, argv[base]);
-        if (!val || lil->error) return NULL;
-        v = lil_to_boolean(val);
-        if (not) v = !v;
-        if (!v) {
-            lil_free_value(val);
-            break;
-        }
-        if (r) lil_free_value(r);
-        r = lil_parse_value(lil, argv[base + 1], 0);
+    lil_var_t var = lil_find_var(lil, lil->env, name);
+    if (!var || lil->callback[LIL_CALLBACK_GETVAR] || lil->callback[LIL_CALLBACK_SETVAR] || var->w) {
+        lil_set_var(lil, name, val, LIL_SETVAR_LOCAL);
         lil_free_value(val);
+        return;
     }
-    return r;
+    lil_free_value(var->v);
+    var->v = val;
 }
 
-static LILCALLBACK lil_value_t fnc_for(lil_t lil, size_t argc, lil_value_t* argv)
+/* makes room in items for n more */
+static int items_room(lil_items_t* items, size_t n)
 {
-    lil_value_t val, r = NULL;
-    if (argc < 4) return NULL;
-    lil_free_value(lil_parse_value(lil, argv[0], 0));
-    while (!lil->error && !lil->env->breakrun) {
-        val = lil_eval_expr(lil, argv[1]);
-        if (!val || lil->error) return NULL;
-        if (!lil_to_boolean(val)) {
-            lil_free_value(val);
+    size_t cap = items->cap ? items->cap : 8, *at;
+    while (cap < items->c + n) cap *= 2;
+    if (cap == items->cap) return 1;
+    at = realloc(items->at, sizeof(size_t)*2*cap);
+    if (!at) return 0;
+    items->at = at;
+    items->cap = cap;
+    return 1;
+}
+
+/* returns where the items of val are in its text, finding them the first
+ * time; a text not in the form list_step takes is rewritten in that form */
+static lil_items_t* get_items(lil_t lil, lil_value_t val)
+{
+    lil_items_t* items;
+    lil_list_t list;
+    lil_value_t text;
+    const char* s = value_bytes(val);
+    size_t i = 0, b, e;
+    if (val->t == LIL_TYPE_LIST) return val->items;
+    items = calloc(1, sizeof(lil_items_t));
+    if (!items) return NULL;
+    items->refs = 1;
+    while (i < val->l && list_step(s, val->l, &i, &b, &e) && items_room(items, 1)) {
+        items->at[items->c*2] = b;
+        items->at[items->c*2 + 1] = e - b;
+        items->c++;
+    }
+    if (i < val->l) {
+        list = lil_subst_to_list(lil, val);
+        text = alloc_value(NULL);
+        items->c = 0;
+        for (i=0; i<list->c && items_room(items, 1); i++) {
+            if (i) lil_append_char(text, ' ');
+            items->at[i*2] = text->l;
+            append_item(text, list->v[i], 1);
+            items->at[i*2 + 1] = text->l - items->at[i*2];
+            items->c++;
+        }
+        i = i < list->c;
+        lil_free_list(list);
+        if (i || ((text->m || text->s) && !own_value(text))) {
+            lil_free_value(text);
+            free_items(items);
+            return NULL;
+        }
+        free_data(val);
+        val->d = text->d;
+        val->l = text->l;
+        free(text);
+    }
+    drop_type(val);
+    val->t = LIL_TYPE_LIST;
+    val->items = items;
+    return items;
+}
+
+/* gives val item positions of its own that can be changed along with its
+ * text */
+static lil_items_t* own_items(lil_t lil, lil_value_t val)
+{
+    lil_items_t* items = get_items(lil, val);
+    lil_items_t* copy;
+    if (!items) return NULL;
+    if (items->refs > 1) {
+        copy = calloc(1, sizeof(lil_items_t));
+        if (!copy || !items_room(copy, items->c)) {
+            free(copy);
+            return NULL;
+        }
+        memcpy(copy->at, items->at, sizeof(size_t)*2*items->c);
+        copy->c = items->c;
+        copy->refs = 1;
+        items->refs--;
+        val->items = items = copy;
+    }
+    if ((val->m || val->s) && !own_value(val)) return NULL;
+    return items;
+}
+
+/* replaces the items from to to-1 of val (which must have been given to
+ * own_items) with the n values of v and writes the change into its text */
+static int items_splice(lil_value_t val, lil_items_t* items, size_t from, size_t to, size_t n, lil_value_t* v)
+{
+    size_t *at, pos, len, i;
+    lil_value_t text;
+    int lead = 0, trail = 0;
+    if (n > to - from && !items_room(items, n - (to - from))) return 0;
+    at = items->at;
+    /* the bytes that go, with a space between the items that go or come
+     * and the ones that stay */
+    if (!items->c) {
+        pos = 0;
+        len = val->l;
+    } else if (from < to) {
+        pos = at[from*2];
+        len = at[(to - 1)*2] + at[(to - 1)*2 + 1] - pos;
+        if (!n && to < items->c) {
+            len = at[to*2] - pos;
+        } else if (!n && from) {
+            pos = at[(from - 1)*2] + at[(from - 1)*2 + 1];
+            len = at[(to - 1)*2] + at[(to - 1)*2 + 1] - pos;
+        }
+    } else if (from < items->c) {
+        pos = at[from*2];
+        len = 0;
+        trail = n > 0;
+    } else {
+        pos = at[(items->c - 1)*2] + at[(items->c - 1)*2 + 1];
+        len = 0;
+        lead = n > 0;
+    }
+    memmove(at + (from + n)*2, at + to*2, sizeof(size_t)*2*(items->c - to));
+    items->c = items->c - (to - from) + n;
+    text = alloc_value(lead ? " " : NULL);
+    for (i=0; i<n; i++) {
+        if (i) lil_append_char(text, ' ');
+        at[(from + i)*2] = pos + text->l;
+        append_item(text, v[i], 1);
+        at[(from + i)*2 + 1] = pos + text->l - at[(from + i)*2];
+    }
+    if (trail) lil_append_char(text, ' ');
+    for (i=from + n; i<items->c; i++) at[i*2] += text->l - len;
+    /* the text gets room to grow so that appending takes amortized O(1) */
+    i = text->l > len && !value_room(val, text->l - len);
+    if (!i) i = !splice_text(val, pos, len, value_bytes(text), text->l);
+    lil_free_value(text);
+    /* the positions don't match the text if it couldn't be changed */
+    if (i) drop_type(val);
+    return !i;
+}
+
+static LILCALLBACK lil_value_t fnc_append(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_items_t* items;
+    lil_env_t save_env = lil->env;
+    lil_value_t val, r;
+    size_t base = 1;
+    const char* varname;
+    if (argc < 2) return NULL;
+    varname = lil_to_string(argv[0]);
+    if (!strcmp(varname, "global")) {
+        if (argc < 3) return NULL;
+        varname = lil_to_string(argv[1]);
+        base = 2;
+        lil->env = lil->rootenv;
+    }
+    val = take_var(lil, varname);
+    items = own_items(lil, val);
+    if (items) items_splice(val, items, items->c, items->c, argc - base, argv + base);
+    r = lil_clone_value(val);
+    put_var(lil, varname, val);
+    lil->env = save_env;
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_lset(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_items_t* items;
+    lil_value_t val;
+    const char* varname;
+    lilint_t index;
+    if (argc < 3) return NULL;
+    varname = lil_to_string(argv[0]);
+    index = lil_to_integer(argv[1]);
+    val = take_var(lil, varname);
+    items = own_items(lil, val);
+    if (items && (index < 0 || (size_t)index > items->c))
+        lil_set_error(lil, "lset index out of range");
+    else if (items)
+        items_splice(val, items, (size_t)index, (size_t)index + ((size_t)index < items->c), 1, argv + 2);
+    put_var(lil, varname, val);
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_linsert(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_items_t* items;
+    lil_value_t val;
+    const char* varname;
+    lilint_t index;
+    if (argc < 3) return NULL;
+    varname = lil_to_string(argv[0]);
+    index = lil_to_integer(argv[1]);
+    val = take_var(lil, varname);
+    items = own_items(lil, val);
+    if (items) {
+        if (index < 0) index = 0;
+        if ((size_t)index > items->c) index = (lilint_t)items->c;
+        items_splice(val, items, (size_t)index, (size_t)index, argc - 2, argv + 2);
+    }
+    put_var(lil, varname, val);
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_lremove(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_items_t* items;
+    lil_value_t val;
+    const char* varname;
+    lilint_t from, to;
+    if (argc < 2) return NULL;
+    varname = lil_to_string(argv[0]);
+    from = lil_to_integer(argv[1]);
+    to = argc > 2 ? lil_to_integer(argv[2]) : from;
+    val = take_var(lil, varname);
+    items = own_items(lil, val);
+    /* a single index must be an item, a range has to be inside the list */
+    if (items && (from < 0 || to < from || (uint64_t)to > items->c || (argc < 3 && (size_t)from == items->c)))
+        lil_set_error(lil, "lremove index out of range");
+    else if (items && (to > from || argc < 3))
+        items_splice(val, items, (size_t)from, (size_t)to + (argc < 3), 0, NULL);
+    put_var(lil, varname, val);
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_dict(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* type;
+    lil_dict_t* dict;
+    lil_value_t val;
+    size_t i;
+    if (!argc) return NULL;
+    type = lil_to_string(argv[0]);
+    if (!strcmp(type, "set") || !strcmp(type, "remove")) {
+        const char* varname;
+        int set = type[0] == 's';
+        if (argc < 2) return NULL;
+        varname = lil_to_string(argv[1]);
+        val = take_var(lil, varname);
+        dict = own_dict(lil, val);
+        if (dict) {
+            if (set) {
+                for (i=2; i + 1 < argc; i += 2) dict_set_entry(val, dict, argv[i], argv[i + 1]);
+            } else {
+                for (i=2; i<argc; i++) dict_remove_entry(val, dict, argv[i]);
+            }
+        }
+        lil_set_var(lil, varname, val, LIL_SETVAR_LOCAL);
+        return val;
+    }
+    if (!strcmp(type, "for")) {
+        lil_list_t rlist;
+        if (argc < 5) return NULL;
+        dict = get_dict(lil, argv[3]);
+        if (!dict) return NULL;
+        /* keep the dict even if the code changes the variable it came from */
+        dict->refs++;
+        rlist = lil_alloc_list();
+        for (i=0; i<dict->c; i++) {
+            lil_value_t rv;
+            lil_set_var(lil, lil_to_string(argv[1]), dict->e[i].k, LIL_SETVAR_LOCAL_ONLY);
+            lil_set_var(lil, lil_to_string(argv[2]), dict->e[i].v, LIL_SETVAR_LOCAL_ONLY);
+            rv = lil_parse_value(lil, argv[4], 0);
+            if (rv->l) lil_list_append(rlist, rv);
+            else lil_free_value(rv);
+            if (lil->env->breakrun || lil->error) break;
+        }
+        free_dict(dict);
+        val = lil_list_to_value(rlist, 1);
+        lil_free_list(rlist);
+        return val;
+    }
+    if (argc < 2) return NULL;
+    dict = get_dict(lil, argv[1]);
+    if (!dict) return NULL;
+    if (!strcmp(type, "get")) {
+        if (argc < 3) return NULL;
+        i = dict_find(dict, argv[2], dict_hash(argv[2]));
+        if (i) return lil_clone_value(dict->e[i - 1].v);
+        return argc > 3 ? lil_clone_value(argv[3]) : NULL;
+    }
+    if (!strcmp(type, "exists")) {
+        if (argc < 3) return NULL;
+        return lil_alloc_integer(dict_find(dict, argv[2], dict_hash(argv[2])) != 0);
+    }
+    if (!strcmp(type, "size")) {
+        return lil_alloc_integer((lilint_t)dict->c);
+    }
+    if (!strcmp(type, "keys")) {
+        lil_list_t list = lil_alloc_list();
+        for (i=0; i<dict->c; i++) lil_list_append(list, lil_clone_value(dict->e[i].k));
+        val = lil_list_to_value(list, 1);
+        lil_free_list(list);
+        return val;
+    }
+    return NULL;
+}
+
+/* makes val at least size bytes long (filling it with zeros) and its data
+ * its own so that it can be changed in place; returns NULL and sets an
+ * error if there isn't enough memory (or val couldn't be allocated) */
+static char* bytes_room(lil_t lil, lil_value_t val, size_t size)
+{
+    char* d;
+    if (!val) {
+        lil_set_error(lil, "out of memory");
+        return NULL;
+    }
+    drop_type(val);
+    if ((val->m || val->s) && !own_value(val)) {
+        lil_set_error(lil, "out of memory");
+        return NULL;
+    }
+    if (size <= val->l) return val->d;
+    d = size == (size_t)-1 ? NULL : grow_data(val, size);
+    if (!d) {
+        lil_set_error(lil, "out of memory");
+        return NULL;
+    }
+    memset(d + val->l, 0, size + 1 - val->l);
+    val->l = size;
+    return d;
+}
+
+/* reads an offset or size of bytes, which can't be negative, into *n;
+ * returns 0 and sets an error if it is out of range */
+static int bytes_offset(lil_t lil, lil_value_t v, size_t* n)
+{
+    lilint_t i = lil_to_integer(v);
+    if (i < 0 || (uint64_t)i > (size_t)-1/2) {
+        lil_set_error(lil, "byte offset out of range");
+        return 0;
+    }
+    *n = (size_t)i;
+    return 1;
+}
+
+/* a packed number, like "u8", "s16le", "u32be" or "f64" (little endian if
+ * the byte order isn't given) */
+typedef struct _bytes_spec_t
+{
+    int size;
+    int sign;
+    int flt;
+    int big;
+} bytes_spec_t;
+
+static int bytes_spec(lil_t lil, const char* s, bytes_spec_t* spec)
+{
+    char* end;
+    long bits;
+    spec->sign = s[0] == 's';
+    spec->flt = s[0] == 'f';
+    if (s[0] != 'u' && !spec->sign && !spec->flt) goto bad;
+    bits = strtol(s + 1, &end, 10);
+    if (bits != 8 && bits != 16 && bits != 32 && bits != 64) goto bad;
+    if (spec->flt && bits < 32) goto bad;
+    spec->size = (int)(bits/8);
+    spec->big = !strcmp(end, "be");
+    if (end[0] && strcmp(end, "be") && strcmp(end, "le")) goto bad;
+    return 1;
+bad:
+    lil_set_error(lil, "invalid number format for bytes");
+    return 0;
+}
+
+static void bytes_pack(char* d, const bytes_spec_t* spec, lil_value_t val)
+{
+    unsigned long long u;
+    int i;
+    if (spec->flt && spec->size == 4) {
+        float f = (float)lil_to_double(val);
+        unsigned long u32;
+        memcpy(&u32, &f, 4);
+        u = u32 & 0xFFFFFFFFUL;
+    } else if (spec->flt) {
+        double f = lil_to_double(val);
+        memcpy(&u, &f, 8);
+    } else {
+        u = (unsigned long long)lil_to_integer(val);
+    }
+    for (i=0; i<spec->size; i++)
+        d[spec->big ? spec->size - 1 - i : i] = (char)(u >> (8*i));
+}
+
+static lil_value_t bytes_unpack(const char* d, const bytes_spec_t* spec)
+{
+    unsigned long long u = 0;
+    int i;
+    for (i=0; i<spec->size; i++)
+        u |= (unsigned long long)(unsigned char)d[spec->big ? spec->size - 1 - i : i] << (8*i);
+    if (spec->flt && spec->size == 4) {
+        unsigned long u32 = (unsigned long)u;
+        float f;
+        memcpy(&f, &u32, 4);
+        return lil_alloc_double(f);
+    }
+    if (spec->flt) {
+        double f;
+        memcpy(&f, &u, 8);
+        return lil_alloc_double(f);
+    }
+    /* extend the sign of the top bit */
+    if (spec->sign && spec->size < 8 && (u >> (8*spec->size - 1)) & 1)
+        u |= ~0ULL << (8*spec->size);
+    return lil_alloc_integer((lilint_t)u);
+}
+
+/* checks that the count values are bytes, 0 to 255; returns 0 and sets an
+ * error if one isn't */
+static int bytes_values(lil_t lil, lil_value_t* v, size_t count)
+{
+    size_t i;
+    for (i=0; i<count; i++) {
+        lilint_t b = lil_to_integer(v[i]);
+        if (b < 0 || b > 255) {
+            lil_set_error(lil, "byte value out of range");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static int base64_digit(char ch)
+{
+    const char* p = ch ? strchr(base64_chars, ch) : NULL;
+    return p ? (int)(p - base64_chars) : -1;
+}
+
+static LILCALLBACK lil_value_t fnc_bytes(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* type;
+    const char* s;
+    bytes_spec_t spec;
+    lil_value_t val;
+    size_t i, j, n = 0;
+    char* d;
+    if (!argc) return NULL;
+    type = lil_to_string(argv[0]);
+    if (!strcmp(type, "new")) {
+        if (argc < 2 || !bytes_offset(lil, argv[1], &n) || !bytes_values(lil, argv + 2, argc > 2)) return NULL;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n)) return val;
+        if (argc > 2) memset(val->d, (int)lil_to_integer(argv[2]), n);
+        return val;
+    }
+    if (!strcmp(type, "of")) {
+        if (!bytes_values(lil, argv + 1, argc - 1)) return NULL;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, argc - 1)) return val;
+        for (i=1; i<argc; i++) val->d[i - 1] = (char)lil_to_integer(argv[i]);
+        return val;
+    }
+    if (!strcmp(type, "pack")) {
+        if (argc < 2 || !bytes_spec(lil, lil_to_string(argv[1]), &spec)) return NULL;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, (argc - 2)*spec.size)) return val;
+        for (i=2; i<argc; i++) bytes_pack(val->d + (i - 2)*spec.size, &spec, argv[i]);
+        return val;
+    }
+    if (!strcmp(type, "set") || !strcmp(type, "put") || !strcmp(type, "append")) {
+        /* these change the variable named by the first argument in place */
+        const char* varname;
+        if (argc < 3) return NULL;
+        if (type[0] != 'a' && !bytes_offset(lil, argv[2], &n)) return NULL;
+        if (type[0] == 's' && !bytes_values(lil, argv + 3, argc - 3)) return NULL;
+        varname = lil_to_string(argv[1]);
+        val = take_var(lil, varname);
+        if (type[0] == 'a') {
+            for (i=2; i<argc; i++) {
+                n = val->l;
+                if (!bytes_room(lil, val, n + argv[i]->l)) break;
+                memcpy(val->d + n, value_bytes(argv[i]), argv[i]->l);
+            }
+        } else if (type[0] == 's') {
+            if (bytes_room(lil, val, n + argc - 3))
+                for (i=3; i<argc; i++) val->d[n + i - 3] = (char)lil_to_integer(argv[i]);
+        } else if (argc > 3 && bytes_spec(lil, lil_to_string(argv[3]), &spec)) {
+            if (bytes_room(lil, val, n + (argc - 4)*spec.size))
+                for (i=4; i<argc; i++) bytes_pack(val->d + n + (i - 4)*spec.size, &spec, argv[i]);
+        }
+        lil_set_var(lil, varname, val, LIL_SETVAR_LOCAL);
+        return val;
+    }
+    if (argc < 2) return NULL;
+    s = value_bytes(argv[1]);
+    n = argv[1]->l;
+    if (!strcmp(type, "get")) {
+        lil_list_t list;
+        size_t count;
+        if (argc < 3) return NULL;
+        i = (size_t)lil_to_integer(argv[2]);
+        if (argc < 4) return i < n ? lil_alloc_integer((unsigned char)s[i]) : NULL;
+        count = (size_t)lil_to_integer(argv[3]);
+        list = lil_alloc_list();
+        for (j=i; j<n && j-i<count; j++) lil_list_append(list, lil_alloc_integer((unsigned char)s[j]));
+        val = lil_list_to_value(list, 1);
+        lil_free_list(list);
+        return val;
+    }
+    if (!strcmp(type, "slice")) {
+        size_t start = argc > 2 ? (size_t)lil_to_integer(argv[2]) : 0;
+        size_t end = argc > 3 ? (size_t)lil_to_integer(argv[3]) : n;
+        if (end > n) end = n;
+        if (start >= end) return NULL;
+        return alloc_slice(argv[1], start, end - start);
+    }
+    if (!strcmp(type, "unpack")) {
+        lil_list_t list;
+        size_t count;
+        if (argc < 3 || !bytes_spec(lil, lil_to_string(argv[1]), &spec)) return NULL;
+        s = value_bytes(argv[2]);
+        n = argv[2]->l;
+        i = argc > 3 ? (size_t)lil_to_integer(argv[3]) : 0;
+        if (argc < 5) return i <= n && n - i >= (size_t)spec.size ? bytes_unpack(s + i, &spec) : NULL;
+        count = (size_t)lil_to_integer(argv[4]);
+        list = lil_alloc_list();
+        for (j=0; j<count && i <= n && n - i >= (size_t)spec.size; j++, i += spec.size)
+            lil_list_append(list, bytes_unpack(s + i, &spec));
+        val = lil_list_to_value(list, 1);
+        lil_free_list(list);
+        return val;
+    }
+    if (!strcmp(type, "tohex")) {
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n*2)) return val;
+        for (i=0; i<n; i++) {
+            val->d[i*2] = "0123456789abcdef"[(unsigned char)s[i] >> 4];
+            val->d[i*2 + 1] = "0123456789abcdef"[s[i] & 15];
+        }
+        return val;
+    }
+    if (!strcmp(type, "fromhex")) {
+        int hi = -1, digit;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n/2)) return val;
+        for (i=0, j=0; i<n; i++) {
+            if (charclass[(unsigned char)s[i]] & CC_SPACE) continue;
+            digit = hex_digit(s[i]);
+            if (digit < 0) {
+                lil_set_error(lil, "invalid hex digit");
+                break;
+            }
+            if (hi < 0) hi = digit;
+            else {
+                val->d[j++] = (char)(hi << 4 | digit);
+                hi = -1;
+            }
+        }
+        if (hi >= 0 && i == n) lil_set_error(lil, "odd number of hex digits");
+        val->l = j;
+        val->d[j] = 0;
+        return val;
+    }
+    if (!strcmp(type, "tobase64")) {
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, (n + 2)/3*4)) return val;
+        d = val->d;
+        for (i=0; i<n; i += 3) {
+            unsigned long v = (unsigned long)(unsigned char)s[i] << 16;
+            if (i + 1 < n) v |= (unsigned long)(unsigned char)s[i + 1] << 8;
+            if (i + 2 < n) v |= (unsigned char)s[i + 2];
+            *d++ = base64_chars[v >> 18];
+            *d++ = base64_chars[(v >> 12) & 63];
+            *d++ = i + 1 < n ? base64_chars[(v >> 6) & 63] : '=';
+            *d++ = i + 2 < n ? base64_chars[v & 63] : '=';
+        }
+        return val;
+    }
+    if (!strcmp(type, "frombase64")) {
+        unsigned long v = 0;
+        int bits = 0, digit;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n/4*3 + 3)) return val;
+        for (i=0, j=0; i<n && s[i] != '='; i++) {
+            if (charclass[(unsigned char)s[i]] & CC_SPACE) continue;
+            digit = base64_digit(s[i]);
+            if (digit < 0) {
+                lil_set_error(lil, "invalid base64 digit");
+                break;
+            }
+            v = (v << 6 | (unsigned long)digit) & 0xFFFFFF;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                val->d[j++] = (char)(v >> bits);
+            }
+        }
+        val->l = j;
+        val->d[j] = 0;
+        return val;
+    }
+    return NULL;
+}
+
+/* the element types of the arrays used by the array command; the elements
+ * are packed in the host's byte order */
+#define ARRAY_INT32 0
+#define ARRAY_INT64 1
+#define ARRAY_FLOAT64 2
+
+static const size_t array_size[] = {4, 8, 8};
+
+static int array_kind(lil_t lil, lil_value_t type)
+{
+    const char* s = lil_to_string(type);
+    if (!strcmp(s, "int32")) return ARRAY_INT32;
+    if (!strcmp(s, "int64")) return ARRAY_INT64;
+    if (!strcmp(s, "float64")) return ARRAY_FLOAT64;
+    lil_set_error(lil, "invalid array type");
+    return -1;
+}
+
+/* runs body for each element x of type T of the n elements at d.  The
+ * elements are loaded with memcpy since slices don't have to be aligned,
+ * which compilers turn into plain (vector) loads */
+#define ARRAY_EACH(T, d, n, body) do { \
+        size_t _i; \
+        for (_i=0; _i<(n); _i++) { \
+            T x; \
+            memcpy(&x, (d) + _i*sizeof(T), sizeof(T)); \
+            body; \
+        } \
+    } while (0)
+
+/* the same for the elements x and y of two arrays */
+#define ARRAY_EACH2(T, a, b, n, body) do { \
+        size_t _i; \
+        for (_i=0; _i<(n); _i++) { \
+            T x, y; \
+            memcpy(&x, (a) + _i*sizeof(T), sizeof(T)); \
+            memcpy(&y, (b) + _i*sizeof(T), sizeof(T)); \
+            body; \
+        } \
+    } while (0)
+
+/* stores v as the element i of type T at d */
+#define ARRAY_STORE(T, d, i, v) do { \
+        T _v = (T)(v); \
+        memcpy((d) + (i)*sizeof(T), &_v, sizeof(T)); \
+    } while (0)
+
+/* reads val into *n if it is a whole number, such as 3, 3.0 or 1e3 */
+static int array_whole(lil_value_t val, lilint_t* n)
+{
+    double d = lil_to_double(val);
+    *n = lil_to_integer(val);
+    if (d == (double)*n) return 1;
+    if (d != floor(d) || d < -9.2e18 || d > 9.2e18) return 0;
+    *n = (lilint_t)d;
+    return 1;
+}
+
+static void array_store(int kind, char* d, size_t i, lil_value_t val)
+{
+    lilint_t n;
+    switch (kind) {
+    case ARRAY_INT32: array_whole(val, &n); ARRAY_STORE(int32_t, d, i, n); break;
+    case ARRAY_INT64: array_whole(val, &n); ARRAY_STORE(int64_t, d, i, n); break;
+    default: ARRAY_STORE(double, d, i, lil_to_double(val));
+    }
+}
+
+static lil_value_t array_load(int kind, const char* d, size_t i)
+{
+    int32_t i32;
+    int64_t i64;
+    double f;
+    switch (kind) {
+    case ARRAY_INT32:
+        memcpy(&i32, d + i*4, 4);
+        return lil_alloc_integer(i32);
+    case ARRAY_INT64:
+        memcpy(&i64, d + i*8, 8);
+        return lil_alloc_integer(i64);
+    }
+    memcpy(&f, d + i*8, 8);
+    return lil_alloc_double(f);
+}
+
+/* sum, min, max and mean of an array */
+static lil_value_t array_reduce(lil_t lil, int kind, const char* type, const char* d, size_t n)
+{
+    if (!strcmp(type, "sum") || !strcmp(type, "mean")) {
+        uint64_t isum = 0;
+        double fsum = 0;
+        switch (kind) {
+        case ARRAY_INT32: ARRAY_EACH(int32_t, d, n, isum += (uint64_t)x); break;
+        case ARRAY_INT64: ARRAY_EACH(int64_t, d, n, isum += (uint64_t)x); break;
+        default: ARRAY_EACH(double, d, n, fsum += x);
+        }
+        if (type[0] == 'm') {
+            if (!n) return NULL;
+            return lil_alloc_double((kind == ARRAY_FLOAT64 ? fsum : (double)(int64_t)isum)/(double)n);
+        }
+        return kind == ARRAY_FLOAT64 ? lil_alloc_double(fsum) : lil_alloc_integer((lilint_t)isum);
+    }
+    if (!strcmp(type, "min") || !strcmp(type, "max")) {
+        int max = type[1] == 'a';
+        if (!n) return NULL;
+        switch (kind) {
+        case ARRAY_INT32: {
+            int32_t m;
+            memcpy(&m, d, 4);
+            if (max) ARRAY_EACH(int32_t, d, n, m = x > m ? x : m);
+            else ARRAY_EACH(int32_t, d, n, m = x < m ? x : m);
+            return lil_alloc_integer(m);
+        }
+        case ARRAY_INT64: {
+            int64_t m;
+            memcpy(&m, d, 8);
+            if (max) ARRAY_EACH(int64_t, d, n, m = x > m ? x : m);
+            else ARRAY_EACH(int64_t, d, n, m = x < m ? x : m);
+            return lil_alloc_integer(m);
+        }
+        default: {
+            double m;
+            memcpy(&m, d, 8);
+            if (max) ARRAY_EACH(double, d, n, m = x > m ? x : m);
+            else ARRAY_EACH(double, d, n, m = x < m ? x : m);
+            return lil_alloc_double(m);
+        }
+        }
+    }
+    lil_set_error(lil, "unknown array operation");
+    return NULL;
+}
+
+/* counts the elements x of type T for which "x op limit" is true, with
+ * limit converted to L */
+#define ARRAY_COUNT(T, L, d, n, op, limit, count) do { \
+        L _l = (L)(limit); \
+        if (!strcmp(op, "<")) ARRAY_EACH(T, d, n, count += x < _l); \
+        else if (!strcmp(op, "<=")) ARRAY_EACH(T, d, n, count += x <= _l); \
+        else if (!strcmp(op, ">")) ARRAY_EACH(T, d, n, count += x > _l); \
+        else if (!strcmp(op, ">=")) ARRAY_EACH(T, d, n, count += x >= _l); \
+        else if (!strcmp(op, "==")) ARRAY_EACH(T, d, n, count += x == _l); \
+        else if (!strcmp(op, "!=")) ARRAY_EACH(T, d, n, count += x != _l); \
+        else return NULL; \
+    } while (0)
+
+static lil_value_t array_count(int kind, const char* d, size_t n, const char* op, lil_value_t limit)
+{
+    size_t count = 0;
+    double fl = lil_to_double(limit);
+    lilint_t il;
+    int whole = array_whole(limit, &il);
+    /* a limit that isn't a whole number is compared as it is: every int32
+     * fits in a double, and int64 elements are only compared as doubles
+     * when the limit has a fraction or is out of their range, where
+     * rounding them can't change the result */
+    switch (kind) {
+    case ARRAY_INT32: ARRAY_COUNT(int32_t, double, d, n, op, fl, count); break;
+    case ARRAY_INT64:
+        if (whole) ARRAY_COUNT(int64_t, int64_t, d, n, op, il, count);
+        else ARRAY_COUNT(int64_t, double, d, n, op, fl, count);
+        break;
+    default: ARRAY_COUNT(double, double, d, n, op, fl, count);
+    }
+    return lil_alloc_integer((lilint_t)count);
+}
+
+/* reads an element index or count into *n, checking that n + more
+ * elements of size bytes can be asked for; returns 0 and sets an error if
+ * they can't */
+static int array_index(lil_t lil, lil_value_t v, size_t more, size_t size, size_t* n)
+{
+    lilint_t i = lil_to_integer(v);
+    if (i < 0 || (uint64_t)i > ((size_t)-1/2)/size - more) {
+        lil_set_error(lil, "array index out of range");
+        return 0;
+    }
+    *n = (size_t)i;
+    return 1;
+}
+
+/* reads a factor or offset for an integer array, which must be a whole
+ * number */
+static int array_integer(lil_t lil, lil_value_t v, lilint_t* n)
+{
+    if (!array_whole(v, n)) {
+        lil_set_error(lil, "integer arrays need whole numbers");
+        return 0;
+    }
+    return 1;
+}
+
+/* checks that the count values can be stored in an array of the given
+ * kind, which for integer arrays means they must be whole numbers */
+static int array_values(lil_t lil, int kind, lil_value_t* v, size_t count)
+{
+    lilint_t n;
+    size_t i;
+    if (kind == ARRAY_FLOAT64) return 1;
+    for (i=0; i<count; i++)
+        if (!array_integer(lil, v[i], &n)) return 0;
+    return 1;
+}
+
+static LILCALLBACK lil_value_t fnc_array(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* type;
+    const char* a;
+    const char* b;
+    lil_value_t val;
+    size_t i, n = 0, size;
+    char* d;
+    int kind;
+    if (argc < 3) return NULL;
+    type = lil_to_string(argv[0]);
+    kind = array_kind(lil, argv[1]);
+    if (kind < 0) return NULL;
+    size = array_size[kind];
+    if (!strcmp(type, "new")) {
+        if (!array_index(lil, argv[2], 0, size, &n) || !array_values(lil, kind, argv + 3, argc > 3)) return NULL;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n*size)) return val;
+        if (argc > 3) for (i=0; i<n; i++) array_store(kind, val->d, i, argv[3]);
+        return val;
+    }
+    if (!strcmp(type, "from")) {
+        lil_list_t list = lil_subst_to_list(lil, argv[2]);
+        if (!array_values(lil, kind, list->v, list->c)) {
+            lil_free_list(list);
+            return NULL;
+        }
+        val = alloc_value(NULL);
+        if (bytes_room(lil, val, list->c*size))
+            for (i=0; i<list->c; i++) array_store(kind, val->d, i, list->v[i]);
+        lil_free_list(list);
+        return val;
+    }
+    if (!strcmp(type, "set") || !strcmp(type, "append")) {
+        /* these change the array stored in the variable in place */
+        const char* varname = lil_to_string(argv[2]);
+        if (type[0] == 's' && argc > 4 && !array_index(lil, argv[3], argc - 4, size, &n)) return NULL;
+        i = type[0] == 's' ? 4 : 3;
+        if (argc > i && !array_values(lil, kind, argv + i, argc - i)) return NULL;
+        val = take_var(lil, varname);
+        if (type[0] == 'a') {
+            n = val->l/size;
+            if (bytes_room(lil, val, (n + argc - 3)*size))
+                for (i=3; i<argc; i++) array_store(kind, val->d, n + i - 3, argv[i]);
+        } else if (argc > 4) {
+            if (bytes_room(lil, val, (n + argc - 4)*size))
+                for (i=4; i<argc; i++) array_store(kind, val->d, n + i - 4, argv[i]);
+        }
+        lil_set_var(lil, varname, val, LIL_SETVAR_LOCAL);
+        return val;
+    }
+    a = value_bytes(argv[2]);
+    n = argv[2]->l/size;
+    if (!strcmp(type, "length")) return lil_alloc_integer((lilint_t)n);
+    if (!strcmp(type, "get")) {
+        if (argc < 4) return NULL;
+        i = (size_t)lil_to_integer(argv[3]);
+        return i < n ? array_load(kind, a, i) : NULL;
+    }
+    if (!strcmp(type, "list")) {
+        lil_list_t list = lil_alloc_list();
+        for (i=0; i<n; i++) lil_list_append(list, array_load(kind, a, i));
+        val = lil_list_to_value(list, 1);
+        lil_free_list(list);
+        return val;
+    }
+    if (!strcmp(type, "count")) {
+        if (argc < 5) return NULL;
+        val = array_count(kind, a, n, lil_to_string(argv[3]), argv[4]);
+        if (!val) lil_set_error(lil, "invalid comparison for array count");
+        return val;
+    }
+    if (!strcmp(type, "scale")) {
+        /* returns a*factor + offset */
+        lilint_t f = 0, o = 0;
+        if (argc < 4) return NULL;
+        if (kind != ARRAY_FLOAT64 && (!array_integer(lil, argv[3], &f) || (argc > 4 && !array_integer(lil, argv[4], &o))))
+            return NULL;
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n*size)) return val;
+        d = val->d;
+        if (kind == ARRAY_FLOAT64) {
+            double ff = lil_to_double(argv[3]), fo = argc > 4 ? lil_to_double(argv[4]) : 0;
+            ARRAY_EACH(double, a, n, ARRAY_STORE(double, d, _i, x*ff + fo));
+        } else {
+            if (kind == ARRAY_INT32) ARRAY_EACH(int32_t, a, n, ARRAY_STORE(int32_t, d, _i, (uint32_t)x*(uint32_t)f + (uint32_t)o));
+            else ARRAY_EACH(int64_t, a, n, ARRAY_STORE(int64_t, d, _i, (uint64_t)x*(uint64_t)f + (uint64_t)o));
+        }
+        return val;
+    }
+    if (!strcmp(type, "add") || !strcmp(type, "mul") || !strcmp(type, "dot")) {
+        if (argc < 4) return NULL;
+        if (argv[3]->l/size != n) {
+            lil_set_error(lil, "arrays have different lengths");
+            return NULL;
+        }
+        b = value_bytes(argv[3]);
+        if (type[0] == 'd') {
+            uint64_t isum = 0;
+            double fsum = 0;
+            switch (kind) {
+            case ARRAY_INT32: ARRAY_EACH2(int32_t, a, b, n, isum += (uint64_t)((int64_t)x*y)); break;
+            case ARRAY_INT64: ARRAY_EACH2(int64_t, a, b, n, isum += (uint64_t)x*(uint64_t)y); break;
+            default: ARRAY_EACH2(double, a, b, n, fsum += x*y);
+            }
+            return kind == ARRAY_FLOAT64 ? lil_alloc_double(fsum) : lil_alloc_integer((lilint_t)isum);
+        }
+        val = alloc_value(NULL);
+        if (!bytes_room(lil, val, n*size)) return val;
+        d = val->d;
+        switch (kind * 2 + (type[0] == 'm')) {
+        case 0: ARRAY_EACH2(int32_t, a, b, n, ARRAY_STORE(int32_t, d, _i, (uint32_t)x + (uint32_t)y)); break;
+        case 1: ARRAY_EACH2(int32_t, a, b, n, ARRAY_STORE(int32_t, d, _i, (uint32_t)x*(uint32_t)y)); break;
+        case 2: ARRAY_EACH2(int64_t, a, b, n, ARRAY_STORE(int64_t, d, _i, (uint64_t)x + (uint64_t)y)); break;
+        case 3: ARRAY_EACH2(int64_t, a, b, n, ARRAY_STORE(int64_t, d, _i, (uint64_t)x*(uint64_t)y)); break;
+        case 4: ARRAY_EACH2(double, a, b, n, ARRAY_STORE(double, d, _i, x + y)); break;
+        default: ARRAY_EACH2(double, a, b, n, ARRAY_STORE(double, d, _i, x*y));
+        }
+        return val;
+    }
+    return array_reduce(lil, kind, type, a, n);
+}
+
+/* adds the value at index i to the back of maxq (or minq), dropping the
+ * values it makes useless */
+static void ring_queue(lil_ring_t ring, size_t i, int max)
+{
+    double x = ring->v[i & ring->mask];
+    size_t* q = max ? ring->maxq : ring->minq;
+    size_t* t = max ? &ring->maxt : &ring->mint;
+    size_t h = max ? ring->maxh : ring->minh;
+    while (*t != h) {
+        double y = ring->v[q[(*t - 1) & ring->mask] & ring->mask];
+        if (max ? y > x : y < x) break;
+        (*t)--;
+    }
+    q[(*t)++ & ring->mask] = i;
+}
+
+/* counts the values the writer added since the last call */
+static void ring_collect(lil_ring_t ring)
+{
+    size_t tail = ring->tail;
+    RING_BARRIER();
+    for (; ring->seen != tail; ring->seen++) {
+        ring->sum += ring->v[ring->seen & ring->mask];
+        if (!ring->qdirty) {
+            ring_queue(ring, ring->seen, 1);
+            ring_queue(ring, ring->seen, 0);
+        }
+    }
+}
+
+/* adds the sum up again once in a while, so that rounding errors from
+ * adding and subtracting values don't pile up */
+static void ring_dropped(lil_ring_t ring)
+{
+    size_t i;
+    if (++ring->drops < ring->size) return;
+    ring->sum = 0;
+    for (i=ring->head; i!=ring->seen; i++) ring->sum += ring->v[i & ring->mask];
+    ring->drops = 0;
+}
+
+static double ring_pop_front(lil_ring_t ring)
+{
+    size_t head = ring->head;
+    double x = ring->v[head & ring->mask];
+    ring->sum -= x;
+    if (!ring->qdirty) {
+        if (ring->maxh != ring->maxt && ring->maxq[ring->maxh & ring->mask] == head) ring->maxh++;
+        if (ring->minh != ring->mint && ring->minq[ring->minh & ring->mask] == head) ring->minh++;
+    }
+    RING_BARRIER();
+    ring->head = head + 1;
+    ring_dropped(ring);
+    return x;
+}
+
+static double ring_pop_back(lil_ring_t ring)
+{
+    double x = ring->v[(ring->seen - 1) & ring->mask];
+    ring->tail = ring->seen = ring->seen - 1;
+    ring->sum -= x;
+    /* values the popped one hid may now be the largest or smallest */
+    ring->qdirty = 1;
+    ring_dropped(ring);
+    return x;
+}
+
+static void ring_push_front(lil_ring_t ring, double x)
+{
+    size_t head = ring->head - 1;
+    ring->v[head & ring->mask] = x;
+    ring->sum += x;
+    /* a value at the front is only kept if it's at least as large (or small)
+     * as all the others */
+    if (!ring->qdirty) {
+        if (ring->maxh == ring->maxt || x >= ring->v[ring->maxq[ring->maxh & ring->mask] & ring->mask])
+            ring->maxq[--ring->maxh & ring->mask] = head;
+        if (ring->minh == ring->mint || x <= ring->v[ring->minq[ring->minh & ring->mask] & ring->mask])
+            ring->minq[--ring->minh & ring->mask] = head;
+    }
+    RING_BARRIER();
+    ring->head = head;
+}
+
+static lil_value_t ring_extreme(lil_ring_t ring, int max)
+{
+    size_t i;
+    if (ring->head == ring->seen) return NULL;
+    if (ring->qdirty) {
+        ring->maxh = ring->maxt = ring->minh = ring->mint = 0;
+        for (i=ring->head; i!=ring->seen; i++) {
+            ring_queue(ring, i, 1);
+            ring_queue(ring, i, 0);
+        }
+        ring->qdirty = 0;
+    }
+    i = max ? ring->maxq[ring->maxh & ring->mask] : ring->minq[ring->minh & ring->mask];
+    return lil_alloc_double(ring->v[i & ring->mask]);
+}
+
+static LILCALLBACK lil_value_t fnc_ring(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* type;
+    const char* name;
+    lil_ring_t ring;
+    size_t i;
+    if (argc < 2) return NULL;
+    type = lil_to_string(argv[0]);
+    name = lil_to_string(argv[1]);
+    if (!strcmp(type, "new")) {
+        lilint_t size;
+        if (argc < 3) return NULL;
+        size = lil_to_integer(argv[2]);
+        if (size <= 0 || size > RING_MAX)
+            lil_set_error(lil, "invalid ring size");
+        else if (!lil_alloc_ring(lil, name, (size_t)size))
+            lil_set_error(lil, "out of memory");
+        return NULL;
+    }
+    if (!strcmp(type, "exists")) return lil_alloc_integer(lil_find_ring(lil, name) != NULL);
+    if (!strcmp(type, "delete")) {
+        lil_free_ring(lil, name);
+        return NULL;
+    }
+    ring = lil_find_ring(lil, name);
+    if (!ring) {
+        lil_set_error(lil, "unknown ring");
+        return NULL;
+    }
+    ring_collect(ring);
+    if (!strcmp(type, "push")) {
+        /* the oldest values make room for new ones */
+        for (i=2; i<argc; i++) {
+            if (ring->seen - ring->head >= ring->size) ring_pop_front(ring);
+            lil_ring_put(ring, lil_to_double(argv[i]));
+            ring_collect(ring);
+        }
+        return NULL;
+    }
+    if (!strcmp(type, "pushfront")) {
+        for (i=2; i<argc; i++) {
+            if (ring->seen - ring->head >= ring->size) ring_pop_back(ring);
+            ring_push_front(ring, lil_to_double(argv[i]));
+        }
+        return NULL;
+    }
+    if (!strcmp(type, "pop") || !strcmp(type, "popfront")) {
+        if (ring->head == ring->seen) return NULL;
+        return lil_alloc_double(type[3] ? ring_pop_front(ring) : ring_pop_back(ring));
+    }
+    if (!strcmp(type, "get")) {
+        if (argc < 3) return NULL;
+        i = (size_t)lil_to_integer(argv[2]);
+        if (i >= ring->seen - ring->head) return NULL;
+        return lil_alloc_double(ring->v[(ring->head + i) & ring->mask]);
+    }
+    if (!strcmp(type, "length")) return lil_alloc_integer((lilint_t)(ring->seen - ring->head));
+    if (!strcmp(type, "size")) return lil_alloc_integer((lilint_t)ring->size);
+    if (!strcmp(type, "list")) {
+        lil_list_t list = lil_alloc_list();
+        lil_value_t r;
+        for (i=ring->head; i!=ring->seen; i++)
+            lil_list_append(list, lil_alloc_double(ring->v[i & ring->mask]));
+        r = lil_list_to_value(list, 1);
+        lil_free_list(list);
+        return r;
+    }
+    if (!strcmp(type, "clear")) {
+        while (ring->head != ring->seen) ring_pop_front(ring);
+        return NULL;
+    }
+    if (!strcmp(type, "sum")) return lil_alloc_double(ring->sum);
+    if (!strcmp(type, "mean")) {
+        if (ring->head == ring->seen) return NULL;
+        return lil_alloc_double(ring->sum/(double)(ring->seen - ring->head));
+    }
+    if (!strcmp(type, "min")) return ring_extreme(ring, 0);
+    if (!strcmp(type, "max")) return ring_extreme(ring, 1);
+    lil_set_error(lil, "unknown ring operation");
+    return NULL;
+}
+
+/* splits a format string into literal text and conversions */
+static int parse_format(lil_format_t* f, const char* fmt, size_t len)
+{
+    /* the length modifier of LILINT_PRINTF, like "ll" in "%lli" */
+    static const char intmod[] = LILINT_PRINTF;
+    size_t i = 0, j, cap = 8;
+    f->items = malloc(sizeof(lil_fmtitem_t)*cap);
+    f->count = 0;
+    if (!f->items) return 0;
+    while (i < len) {
+        lil_fmtitem_t* item;
+        char* spec;
+        if (f->count == cap) {
+            lil_fmtitem_t* items = realloc(f->items, sizeof(lil_fmtitem_t)*cap*2);
+            if (!items) return 0;
+            f->items = items;
+            cap *= 2;
+        }
+        item = f->items + f->count++;
+        memset(item, 0, sizeof(lil_fmtitem_t));
+        if (fmt[i] != '%') {
+            for (j=i; j<len && fmt[j] != '%'; j++);
+            item->at = i;
+            item->len = j - i;
+            i = j;
+            continue;
+        }
+        if (i + 1 < len && fmt[i + 1] == '%') {
+            item->at = i + 1;
+            item->len = 1;
+            i += 2;
+            continue;
+        }
+        item->width = item->prec = -1;
+        spec = item->spec;
+        *spec++ = '%';
+        for (i++; i < len && fmt[i] && strchr("-+ 0#*", fmt[i]); i++) {
+            if (fmt[i] == '*') item->skip = 1;
+            else if (spec - item->spec < 6) *spec++ = fmt[i];
+            if (fmt[i] == '-') item->left = 1;
+        }
+        if (i < len && isdigit((unsigned char)fmt[i])) item->width = 0;
+        for (; i < len && isdigit((unsigned char)fmt[i]); i++)
+            if (item->width < 10000) item->width = item->width*10 + fmt[i] - '0';
+        if (i < len && fmt[i] == '.') {
+            item->prec = 0;
+            for (i++; i < len && isdigit((unsigned char)fmt[i]); i++)
+                if (item->prec < 10000) item->prec = item->prec*10 + fmt[i] - '0';
+        }
+        while (i < len && fmt[i] && strchr("hlLqjzt", fmt[i])) i++;
+        if (i >= len || !fmt[i] || !strchr("diuxXocsfFeEgG", fmt[i])) return 0;
+        item->conv = fmt[i++];
+        /* the width and precision are passed as arguments */
+        *spec++ = '*';
+        if (item->prec >= 0) {
+            *spec++ = '.';
+            *spec++ = '*';
+        }
+        if (strchr("diuxXo", item->conv)) {
+            memcpy(spec, intmod + 1, sizeof(intmod) - 3);
+            spec += sizeof(intmod) - 3;
+        }
+        *spec++ = item->conv;
+        *spec = 0;
+    }
+    return 1;
+}
+
+/* returns the parsed format string, parsing it in place of the oldest one
+ * if it isn't cached; NULL if it isn't valid */
+static lil_format_t* find_format(lil_t lil, lil_value_t fmt)
+{
+    const char* s = value_bytes(fmt);
+    size_t i;
+    lil_format_t* f;
+    for (i=0; i<FORMAT_CACHE; i++) {
+        f = lil->fmtcache + i;
+        if (f->fmt && f->len == fmt->l && !memcmp(f->fmt, s, fmt->l)) return f;
+    }
+    f = lil->fmtcache + lil->fmtnext;
+    lil->fmtnext = (lil->fmtnext + 1) % FORMAT_CACHE;
+    free(f->fmt);
+    free(f->items);
+    f->items = NULL;
+    f->fmt = malloc(fmt->l + 1);
+    if (f->fmt) {
+        memcpy(f->fmt, s, fmt->l);
+        f->fmt[fmt->l] = 0;
+        f->len = fmt->l;
+        if (parse_format(f, f->fmt, f->len)) return f;
+    }
+    free(f->fmt);
+    free(f->items);
+    f->fmt = NULL;
+    f->items = NULL;
+    lil_set_error(lil, "invalid format");
+    return NULL;
+}
+
+static void free_formats(lil_t lil)
+{
+    size_t i;
+    for (i=0; i<FORMAT_CACHE; i++) {
+        free(lil->fmtcache[i].fmt);
+        free(lil->fmtcache[i].items);
+    }
+}
+
+/* appends the arguments formatted with f to val, which must have room to
+ * grow (see value_room); returns 0 on errors */
+static int format_value(lil_t lil, lil_value_t val, lil_format_t* f, size_t argc, lil_value_t* argv)
+{
+    size_t i, arg = 0, guess = 0;
+    char* d;
+    /* guess the length of the result so that it's allocated once */
+    for (i=0; i<f->count; i++) {
+        lil_fmtitem_t* item = f->items + i;
+        if (item->skip) {
+            lil_set_error(lil, "format doesn't take *");
+            return 0;
+        }
+        if (!item->conv) guess += item->len;
+        else {
+            guess += item->width > 0 ? item->width : 0;
+            if (item->conv == 's' && arg < argc) guess += argv[arg]->l;
+            else guess += 24 + (item->prec > 0 ? item->prec : 0);
+            arg++;
+        }
+    }
+    if (!value_room(val, guess)) return 0;
+    for (i=0, arg=0; i<f->count; i++) {
+        lil_fmtitem_t* item = f->items + i;
+        lil_value_t a;
+        int n;
+        if (!item->conv) {
+            if (!(d = value_room(val, item->len))) return 0;
+            memcpy(d, f->fmt + item->at, item->len);
+            val->l += item->len;
+            continue;
+        }
+        if (arg >= argc) {
+            lil_set_error(lil, "not enough arguments for format");
+            break;
+        }
+        a = argv[arg++];
+        if (item->conv == 's' || item->conv == 'c') {
+            /* done here rather than by snprintf so that NULs are kept */
+            char ch = (char)(item->conv == 'c' ? lil_to_integer(a) : 0);
+            const char* s = item->conv == 'c' ? &ch : value_bytes(a);
+            size_t len = item->conv == 'c' ? 1 : a->l, pad = 0;
+            if (item->conv == 's' && item->prec >= 0 && (size_t)item->prec < len) len = (size_t)item->prec;
+            if (item->width > 0 && (size_t)item->width > len) pad = (size_t)item->width - len;
+            if (!(d = value_room(val, len + pad))) return 0;
+            if (!item->left) memset(d, ' ', pad);
+            memcpy(d + (item->left ? 0 : pad), s, len);
+            if (item->left) memset(d + len, ' ', pad);
+            val->l += len + pad;
+            continue;
+        }
+        for (;;) {
+            size_t room = val->c - val->l;
+            int width = item->width > 0 ? item->width : 0;
+            d = val->d + val->l;
+            if (strchr("eEfFgG", item->conv)) {
+                double v = lil_to_double(a);
+                n = item->prec >= 0 ? snprintf(d, room, item->spec, width, item->prec, v) : snprintf(d, room, item->spec, width, v);
+            } else {
+                lilint_t v = lil_to_integer(a);
+                n = item->prec >= 0 ? snprintf(d, room, item->spec, width, item->prec, v) : snprintf(d, room, item->spec, width, v);
+            }
+            if (n < 0) return 0;
+            if ((size_t)n < room) break;
+            if (!value_room(val, (size_t)n)) return 0;
+        }
+        val->l += (size_t)n;
+    }
+    val->d[val->l] = 0;
+    return 1;
+}
+
+static LILCALLBACK lil_value_t fnc_format(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_format_t* f;
+    lil_value_t val;
+    if (argc < 1) return NULL;
+    f = find_format(lil, argv[0]);
+    if (!f) return NULL;
+    val = alloc_value(NULL);
+    if (val) format_value(lil, val, f, argc - 1, argv + 1);
+    return val;
+}
+
+static LILCALLBACK lil_value_t fnc_scan(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_format_t* f;
+    lil_list_t list;
+    lil_value_t r;
+    const char* s;
+    size_t i, j, n, pos = 0;
+    if (argc < 2) return NULL;
+    f = find_format(lil, argv[1]);
+    if (!f) return NULL;
+    s = value_bytes(argv[0]);
+    n = argv[0]->l;
+    list = lil_alloc_list();
+    for (i=0; i<f->count; i++) {
+        lil_fmtitem_t* item = f->items + i;
+        size_t max;
+        if (!item->conv) {
+            /* spaces match any amount of space, everything else itself */
+            for (j=0; j<item->len; j++) {
+                char ch = f->fmt[item->at + j];
+                if (charclass[(unsigned char)ch] & CC_SPACE) {
+                    while (pos < n && (charclass[(unsigned char)s[pos]] & CC_SPACE)) pos++;
+                } else if (pos < n && s[pos] == ch) {
+                    pos++;
+                } else break;
+            }
+            if (j < item->len) break;
+            continue;
+        }
+        if (item->conv != 'c')
+            while (pos < n && (charclass[(unsigned char)s[pos]] & CC_SPACE)) pos++;
+        if (pos >= n) break;
+        max = item->width > 0 ? (size_t)item->width : n - pos;
+        if (max > n - pos) max = n - pos;
+        if (item->conv == 'c') {
+            r = lil_alloc_integer((unsigned char)s[pos++]);
+        } else if (item->conv == 's') {
+            for (j=pos; j<pos + max && !(charclass[(unsigned char)s[j]] & CC_SPACE); j++);
+            r = alloc_slice(argv[0], pos, j - pos);
+            pos = j;
+        } else {
+            /* numbers are read from a copy since the text may go on */
+            char buf[64], *end;
+            if (max > sizeof(buf) - 1) max = sizeof(buf) - 1;
+            memcpy(buf, s + pos, max);
+            buf[max] = 0;
+            if (strchr("eEfFgG", item->conv)) {
+                double v = strtod(buf, &end);
+                r = end == buf ? NULL : lil_alloc_double(v);
+            } else {
+                int base = item->conv == 'i' ? 0 : item->conv == 'o' ? 8 : strchr("xX", item->conv) ? 16 : 10;
+                lilint_t v = item->conv == 'd' || item->conv == 'i' ? (lilint_t)strtoll(buf, &end, base) : (lilint_t)strtoull(buf, &end, base);
+                r = end == buf ? NULL : lil_alloc_integer(v);
+            }
+            if (!r) break;
+            pos += (size_t)(end - buf);
+        }
+        if (item->skip) lil_free_value(r);
+        else lil_list_append(list, r);
+    }
+    if (argc == 2) {
+        r = lil_list_to_value(list, 1);
+    } else {
+        for (i=0; i<list->c && i + 2 < argc; i++)
+            lil_set_var(lil, lil_to_string(argv[i + 2]), list->v[i], LIL_SETVAR_LOCAL);
+        r = lil_alloc_integer((lilint_t)list->c);
+    }
+    lil_free_list(list);
+    return r;
+}
+
+/* a buffer that doubles as it grows, used by json.  With lil set, encoded
+ * text is given to lil_write every JSON_CHUNK bytes instead of kept.  There
+ * is always room for a NUL after the data */
+typedef struct _json_buf_t
+{
+    char* d;
+    size_t l;
+    size_t cap;
+    lil_t lil;
+} json_buf_t;
+
+static int json_put(json_buf_t* b, const char* s, size_t len)
+{
+    if (!len) return 1;
+    if (b->l + len >= b->cap) {
+        size_t cap = b->cap ? b->cap : JSON_CHUNK;
+        char* d;
+        if (b->lil && b->l) {
+            b->d[b->l] = 0;
+            lil_write(b->lil, b->d);
+            b->l = 0;
+        }
+        while (b->l + len >= cap) cap *= 2;
+        if (cap > b->cap) {
+            d = realloc(b->d, cap);
+            if (!d) return 0;
+            b->d = d;
+            b->cap = cap;
+        }
+    }
+    memcpy(b->d + b->l, s, len);
+    b->l += len;
+    return 1;
+}
+
+static int json_putc(json_buf_t* b, char ch)
+{
+    if (b->l + 1 < b->cap) {
+        b->d[b->l++] = ch;
+        return 1;
+    }
+    return json_put(b, &ch, 1);
+}
+
+/* returns the length of the JSON number at s, or 0 if there isn't one */
+static size_t json_number(const char* s, size_t len)
+{
+    size_t i = 0, digits;
+    if (i < len && s[i] == '-') i++;
+    if (i < len && s[i] == '0') i++;
+    else {
+        for (digits=i; i < len && isdigit((unsigned char)s[i]); i++);
+        if (i == digits) return 0;
+    }
+    if (i < len && s[i] == '.') {
+        for (digits=++i; i < len && isdigit((unsigned char)s[i]); i++);
+        if (i == digits) return 0;
+    }
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if (i < len && (s[i] == '+' || s[i] == '-')) i++;
+        for (digits=i; i < len && isdigit((unsigned char)s[i]); i++);
+        if (i == digits) return 0;
+    }
+    return i;
+}
+
+/* what json encode makes of a value, parsed from the schema once */
+#define JSON_AUTO 0
+#define JSON_STR 1
+#define JSON_NUM 2
+#define JSON_BOOL 3
+#define JSON_OBJ 4
+#define JSON_LIST 5
+
+typedef struct _json_schema_t
+{
+    int type;
+    size_t c; /* keys of an object (the last may be "*") or 1 for a list */
+    lil_value_t* keys;
+    struct _json_schema_t* sub;
+} json_schema_t;
+
+static void free_schema(json_schema_t* schema)
+{
+    size_t i;
+    for (i=0; i<schema->c; i++) {
+        if (schema->keys) lil_free_value(schema->keys[i]);
+        free_schema(schema->sub + i);
+    }
+    free(schema->keys);
+    free(schema->sub);
+}
+
+static int build_schema(lil_t lil, json_schema_t* schema, lil_value_t text, size_t depth)
+{
+    lil_list_t list;
+    const char* type;
+    size_t i;
+    int ok = 1;
+    memset(schema, 0, sizeof(json_schema_t));
+    if (!text || !text->l) return 1;
+    if (depth >= JSON_DEPTH) {
+        lil_set_error(lil, "json schema nested too deeply");
+        return 0;
+    }
+    list = lil_subst_to_list(lil, text);
+    type = list->c ? lil_to_string(list->v[0]) : "";
+    if (!strcmp(type, "str")) schema->type = JSON_STR;
+    else if (!strcmp(type, "num")) schema->type = JSON_NUM;
+    else if (!strcmp(type, "bool")) schema->type = JSON_BOOL;
+    else if (!strcmp(type, "obj")) schema->type = JSON_OBJ;
+    else if (!strcmp(type, "list")) schema->type = JSON_LIST;
+    else if (strcmp(type, "auto")) {
+        lil_set_error(lil, "invalid json schema");
+        ok = 0;
+    }
+    if (ok && schema->type == JSON_OBJ && list->c > 2) {
+        schema->c = (list->c - 1)/2;
+        schema->keys = calloc(schema->c, sizeof(lil_value_t));
+        schema->sub = calloc(schema->c, sizeof(json_schema_t));
+        if (!schema->keys || !schema->sub) schema->c = 0;
+        for (i=0; ok && i<schema->c; i++) {
+            schema->keys[i] = lil_clone_value(list->v[1 + i*2]);
+            ok = build_schema(lil, schema->sub + i, list->v[2 + i*2], depth + 1);
+        }
+    } else if (ok && schema->type == JSON_LIST && list->c > 1) {
+        schema->sub = calloc(1, sizeof(json_schema_t));
+        if (schema->sub) {
+            schema->c = 1;
+            ok = build_schema(lil, schema->sub, list->v[1], depth + 1);
+        }
+    }
+    lil_free_list(list);
+    return ok;
+}
+
+static void json_string(json_buf_t* b, const char* s, size_t len)
+{
+    size_t i, start = 0;
+    json_putc(b, '"');
+    for (i=0; i<len; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        char esc[8];
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+        json_put(b, s + start, i - start);
+        start = i + 1;
+        switch (ch) {
+        case '"': json_put(b, "\\\"", 2); break;
+        case '\\': json_put(b, "\\\\", 2); break;
+        case '\n': json_put(b, "\\n", 2); break;
+        case '\r': json_put(b, "\\r", 2); break;
+        case '\t': json_put(b, "\\t", 2); break;
+        case '\b': json_put(b, "\\b", 2); break;
+        case '\f': json_put(b, "\\f", 2); break;
+        default:
+            sprintf(esc, "\\u%04x", ch);
+            json_put(b, esc, 6);
+        }
+    }
+    json_put(b, s + start, len - start);
+    json_putc(b, '"');
+}
+
+static void json_encode(lil_t lil, json_buf_t* b, lil_value_t val, const json_schema_t* schema)
+{
+    const char* s = value_bytes(val);
+    lil_list_t list;
+    size_t i, j;
+    switch (schema->type) {
+    case JSON_AUTO:
+        if (val->l && json_number(s, val->l) == val->l) json_put(b, s, val->l);
+        else json_string(b, s, val->l);
+        return;
+    case JSON_STR:
+        json_string(b, s, val->l);
+        return;
+    case JSON_NUM:
+        if (val->l && json_number(s, val->l) == val->l) json_put(b, s, val->l);
+        else {
+            char num[64];
+            double d = lil_to_double(val);
+            /* JSON has no infinity or NaN */
+            if (d - d != 0) json_put(b, "null", 4);
+            else json_put(b, num, (size_t)sprintf(num, "%.17g", d));
+        }
+        return;
+    case JSON_BOOL:
+        if (lil_to_boolean(val)) json_put(b, "true", 4);
+        else json_put(b, "false", 5);
+        return;
+    }
+    list = lil_subst_to_list(lil, val);
+    if (schema->type == JSON_LIST) {
+        static const json_schema_t item = {JSON_AUTO, 0, NULL, NULL};
+        json_putc(b, '[');
+        for (i=0; i<list->c; i++) {
+            if (i) json_putc(b, ',');
+            json_encode(lil, b, list->v[i], schema->c ? schema->sub : &item);
+        }
+        json_putc(b, ']');
+    } else {
+        static const json_schema_t value = {JSON_AUTO, 0, NULL, NULL};
+        json_putc(b, '{');
+        for (i=0; i + 1 < list->c; i += 2) {
+            const json_schema_t* sub = &value;
+            for (j=0; j<schema->c; j++) {
+                if (!compare_values(schema->keys[j], list->v[i]) ||
+                    (schema->keys[j]->l == 1 && schema->keys[j]->d[0] == '*')) {
+                    sub = schema->sub + j;
+                    break;
+                }
+            }
+            if (i) json_putc(b, ',');
+            json_string(b, value_bytes(list->v[i]), list->v[i]->l);
+            json_putc(b, ':');
+            json_encode(lil, b, list->v[i + 1], sub);
+        }
+        json_putc(b, '}');
+    }
+    lil_free_list(list);
+}
+
+/* decodes JSON text straight into the text of a LIL value */
+typedef struct _json_parser_t
+{
+    const char* s;
+    size_t len;
+    size_t pos;
+    json_buf_t out;
+    json_buf_t str; /* the last string decoded */
+    int error;
+    /* the entries of the objects being decoded, as offsets in out of each
+     * key, its value and the end of the value, then the index of the last
+     * entry with the same key */
+    size_t* ents;
+    size_t nents;
+    size_t capents;
+    size_t* slots; /* hash table used to find keys given more than once */
+    size_t nslots;
+} json_parser_t;
+
+/* adds an entry of the object being decoded, starting at the key */
+static int json_entry(json_parser_t* p)
+{
+    if (p->nents + 4 > p->capents) {
+        size_t cap = p->capents ? p->capents*2 : 64;
+        size_t* ents = realloc(p->ents, cap*sizeof(size_t));
+        if (!ents) return 0;
+        p->ents = ents;
+        p->capents = cap;
+    }
+    p->ents[p->nents] = p->out.l;
+    p->nents += 4;
+    return 1;
+}
+
+/* makes the object whose entries start at base canonical dict text, where
+ * a key given more than once keeps its first place and its last value,
+ * like dict set does; the entries are removed */
+static int json_unique(json_parser_t* p, size_t base)
+{
+    size_t n = (p->nents - base)/4, slots = 8, i, j, dups = 0;
+    size_t* e = p->ents + base;
+    json_buf_t text;
+    if (n < 2) {
+        p->nents = base;
+        return 1;
+    }
+    while (slots < n*2) slots *= 2;
+    if (slots > p->nslots) {
+        size_t* more = realloc(p->slots, slots*sizeof(size_t));
+        if (!more) return 0;
+        p->slots = more;
+        p->nslots = slots;
+    }
+    memset(p->slots, 0, slots*sizeof(size_t));
+    for (i=0; i<n; i++) {
+        const char* key = p->out.d + e[i*4];
+        size_t len = e[i*4 + 1] - e[i*4], at;
+        unsigned long h = 5381;
+        e[i*4 + 3] = i;
+        for (j=0; j<len; j++) h = ((h << 5) + h) + (unsigned char)key[j];
+        for (at=h & (slots - 1); p->slots[at]; at = (at + 1) & (slots - 1)) {
+            size_t* first = e + (p->slots[at] - 1)*4;
+            if (first[1] - first[0] == len && !memcmp(p->out.d + first[0], key, len)) {
+                first[3] = i;
+                e[i*4 + 3] = (size_t)-1;
+                dups++;
+                break;
+            }
+        }
+        if (!p->slots[at]) p->slots[at] = i + 1;
+    }
+    if (!dups) {
+        p->nents = base;
+        return 1;
+    }
+    /* the keys are written with the space after them */
+    memset(&text, 0, sizeof(text));
+    for (i=0; i<n; i++) {
+        size_t* last;
+        if (e[i*4 + 3] == (size_t)-1) continue;
+        last = e + e[i*4 + 3]*4;
+        if (text.l) json_putc(&text, ' ');
+        json_put(&text, p->out.d + e[i*4], e[i*4 + 1] - e[i*4]);
+        json_put(&text, p->out.d + last[1], last[2] - last[1]);
+    }
+    p->out.l = e[0];
+    j = json_put(&p->out, text.d, text.l);
+    free(text.d);
+    p->nents = base;
+    return (int)j;
+}
+
+static void json_space(json_parser_t* p)
+{
+    while (p->pos < p->len && (p->s[p->pos] == ' ' || p->s[p->pos] == '\t' || p->s[p->pos] == '\n' || p->s[p->pos] == '\r'))
+        p->pos++;
+}
+
+/* writes s to the output as a list item, braced like append_item does */
+static void json_item(json_parser_t* p, const char* s, size_t len)
+{
+    size_t i, start = 0;
+    if (len && scan_class(s, s + len, CC_ESCAPE) == s + len) {
+        json_put(&p->out, s, len);
+        return;
+    }
+    json_putc(&p->out, '{');
+    for (i=0; i<len; i++) {
+        if (s[i] != '{' && s[i] != '}') continue;
+        json_put(&p->out, s + start, i - start);
+        json_put(&p->out, s[i] == '{' ? "}\"\\o\"{" : "}\"\\c\"{", 6);
+        start = i + 1;
+    }
+    json_put(&p->out, s + start, len - start);
+    json_putc(&p->out, '}');
+}
+
+static int json_hex4(json_parser_t* p, unsigned long* code)
+{
+    size_t i;
+    *code = 0;
+    if (p->len - p->pos < 4) return 0;
+    for (i=0; i<4; i++) {
+        int digit = hex_digit(p->s[p->pos + i]);
+        if (digit < 0) return 0;
+        *code = *code << 4 | (unsigned long)digit;
+    }
+    p->pos += 4;
+    return 1;
+}
+
+/* reads the string at pos into p->str */
+static int json_read_string(json_parser_t* p)
+{
+    size_t start;
+    p->str.l = 0;
+    p->pos++;
+    for (;;) {
+        unsigned long code;
+        char utf[4];
+        for (start=p->pos; p->pos < p->len && p->s[p->pos] != '"' && p->s[p->pos] != '\\'; p->pos++)
+            if ((unsigned char)p->s[p->pos] < 0x20) return 0;
+        json_put(&p->str, p->s + start, p->pos - start);
+        if (p->pos >= p->len) return 0;
+        if (p->s[p->pos++] == '"') return 1;
+        if (p->pos >= p->len) return 0;
+        switch (p->s[p->pos++]) {
+        case '"': json_putc(&p->str, '"'); break;
+        case '\\': json_putc(&p->str, '\\'); break;
+        case '/': json_putc(&p->str, '/'); break;
+        case 'b': json_putc(&p->str, '\b'); break;
+        case 'f': json_putc(&p->str, '\f'); break;
+        case 'n': json_putc(&p->str, '\n'); break;
+        case 'r': json_putc(&p->str, '\r'); break;
+        case 't': json_putc(&p->str, '\t'); break;
+        case 'u':
+            if (!json_hex4(p, &code)) return 0;
+            /* a surrogate pair gives one character, and half of one isn't
+             * a character at all */
+            if (code >= 0xD800 && code < 0xDC00) {
+                unsigned long low;
+                if (p->len - p->pos < 6 || p->s[p->pos] != '\\' || p->s[p->pos + 1] != 'u') return 0;
+                p->pos += 2;
+                if (!json_hex4(p, &low) || low < 0xDC00 || low >= 0xE000) return 0;
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            } else if (code >= 0xDC00 && code < 0xE000) {
+                return 0;
+            }
+            if (code < 0x80) {
+                utf[0] = (char)code;
+                json_put(&p->str, utf, 1);
+            } else if (code < 0x800) {
+                utf[0] = (char)(0xC0 | code >> 6);
+                utf[1] = (char)(0x80 | (code & 0x3F));
+                json_put(&p->str, utf, 2);
+            } else if (code < 0x10000) {
+                utf[0] = (char)(0xE0 | code >> 12);
+                utf[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+                utf[2] = (char)(0x80 | (code & 0x3F));
+                json_put(&p->str, utf, 3);
+            } else {
+                utf[0] = (char)(0xF0 | code >> 18);
+                utf[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+                utf[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+                utf[3] = (char)(0x80 | (code & 0x3F));
+                json_put(&p->str, utf, 4);
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+}
+
+/* decodes the value at pos.  Inside arrays and objects values are written
+ * as list items and nested arrays and objects are braced */
+static int json_decode(json_parser_t* p, size_t depth)
+{
+    char close;
+    size_t n, count, base = p->nents;
+    json_space(p);
+    if (p->pos >= p->len) return 0;
+    switch (p->s[p->pos]) {
+    case '"':
+        if (!json_read_string(p)) return 0;
+        if (depth) json_item(p, p->str.d, p->str.l);
+        else json_put(&p->out, p->str.d, p->str.l);
+        return 1;
+    case 't':
+        if (p->len - p->pos < 4 || memcmp(p->s + p->pos, "true", 4)) return 0;
+        p->pos += 4;
+        json_putc(&p->out, '1');
+        return 1;
+    case 'f':
+        if (p->len - p->pos < 5 || memcmp(p->s + p->pos, "false", 5)) return 0;
+        p->pos += 5;
+        json_putc(&p->out, '0');
+        return 1;
+    case 'n':
+        if (p->len - p->pos < 4 || memcmp(p->s + p->pos, "null", 4)) return 0;
+        p->pos += 4;
+        if (depth) json_item(p, NULL, 0);
+        return 1;
+    case '[':
+    case '{':
+        break;
+    default:
+        n = json_number(p->s + p->pos, p->len - p->pos);
+        if (!n) return 0;
+        if (depth) json_item(p, p->s + p->pos, n);
+        else json_put(&p->out, p->s + p->pos, n);
+        p->pos += n;
+        return 1;
+    }
+    if (depth >= JSON_DEPTH) return 0;
+    close = p->s[p->pos++] == '[' ? ']' : '}';
+    if (depth) json_putc(&p->out, '{');
+    for (count=0;; count++) {
+        json_space(p);
+        if (p->pos < p->len && p->s[p->pos] == close && !count) break;
+        if (count) json_putc(&p->out, ' ');
+        if (close == '}') {
+            /* the key and value become two items of a dict */
+            if (p->pos >= p->len || p->s[p->pos] != '"' || !json_read_string(p) || !json_entry(p)) return 0;
+            json_item(p, p->str.d, p->str.l);
+            json_space(p);
+            if (p->pos >= p->len || p->s[p->pos++] != ':') return 0;
+            json_putc(&p->out, ' ');
+            p->ents[p->nents - 3] = p->out.l;
+        }
+        if (!json_decode(p, depth + 1)) return 0;
+        if (close == '}') p->ents[base + count*4 + 2] = p->out.l;
+        json_space(p);
+        if (p->pos < p->len && p->s[p->pos] == ',') {
+            p->pos++;
+            continue;
+        }
+        if (p->pos >= p->len || p->s[p->pos] != close) return 0;
+        break;
+    }
+    p->pos++;
+    if (close == '}' && !json_unique(p, base)) return 0;
+    if (depth) json_putc(&p->out, '}');
+    return 1;
+}
+
+static LILCALLBACK lil_value_t fnc_strbuf(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* type;
+    const char* varname;
+    lil_value_t val;
+    size_t i;
+    if (argc < 2) return NULL;
+    type = lil_to_string(argv[0]);
+    varname = lil_to_string(argv[1]);
+    if (!strcmp(type, "length")) return lil_alloc_integer((lilint_t)lil_get_var(lil, varname)->l);
+    if (!strcmp(type, "take")) {
+        /* the variable is left empty and the text is returned without
+         * the room to grow */
+        val = take_var(lil, varname);
+        fit_value(val);
+        put_var(lil, varname, alloc_value(NULL));
+        return val;
+    }
+    if (!strcmp(type, "create")) {
+        /* put_var only keeps the room in a variable that exists */
+        if (!lil_find_var(lil, lil->env, varname)) lil_set_var(lil, varname, lil->empty, LIL_SETVAR_LOCAL);
+        val = alloc_value(NULL);
+        if (val) value_room(val, argc > 2 ? (size_t)lil_to_integer(argv[2]) : 0);
+        put_var(lil, varname, val);
+        return NULL;
+    }
+    val = take_var(lil, varname);
+    drop_type(val);
+    if ((val->m || val->s) && !own_value(val)) {
+        put_var(lil, varname, val);
+        return NULL;
+    }
+    if (!strcmp(type, "append")) {
+        for (i=2; i<argc; i++) {
+            char* d = value_room(val, argv[i]->l);
+            if (!d) break;
+            memcpy(d, value_bytes(argv[i]), argv[i]->l);
+            val->l += argv[i]->l;
+            d[argv[i]->l] = 0;
+        }
+    } else if (!strcmp(type, "appendf")) {
+        lil_format_t* f = argc > 2 ? find_format(lil, argv[2]) : NULL;
+        if (f) format_value(lil, val, f, argc - 3, argv + 3);
+    } else if (!strcmp(type, "reset")) {
+        val->l = 0;
+        if (val->d) val->d[0] = 0;
+    }
+    /* nothing is returned, so that the buffer isn't shared with a result
+     * (which would make the next append copy it) */
+    put_var(lil, varname, val);
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_json(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* type;
+    lil_value_t val;
+    if (argc < 2) return NULL;
+    type = lil_to_string(argv[0]);
+    if (!strcmp(type, "decode")) {
+        json_parser_t p;
+        memset(&p, 0, sizeof(p));
+        p.s = value_bytes(argv[1]);
+        p.len = argv[1]->l;
+        p.error = !json_decode(&p, 0);
+        json_space(&p);
+        free(p.str.d);
+        free(p.ents);
+        free(p.slots);
+        if (p.error || p.pos < p.len) {
+            free(p.out.d);
+            lil_set_error(lil, "invalid json");
+            return NULL;
+        }
+        val = alloc_value(NULL);
+        if (val && p.out.l) {
+            val->d = p.out.d;
+            val->l = p.out.l;
+            val->d[val->l] = 0;
+        } else free(p.out.d);
+        return val;
+    }
+    if (!strcmp(type, "encode") || !strcmp(type, "write")) {
+        json_schema_t schema;
+        json_buf_t b;
+        memset(&b, 0, sizeof(b));
+        if (!build_schema(lil, &schema, argc > 2 ? argv[2] : NULL, 0)) {
+            free_schema(&schema);
+            return NULL;
+        }
+        if (type[0] == 'w') b.lil = lil;
+        json_encode(lil, &b, argv[1], &schema);
+        free_schema(&schema);
+        if (b.lil) {
+            if (b.l) {
+                b.d[b.l] = 0;
+                lil_write(lil, b.d);
+            }
+            free(b.d);
+            return NULL;
+        }
+        val = alloc_value(NULL);
+        if (val && b.l) {
+            val->d = b.d;
+            val->l = b.l;
+            val->d[val->l] = 0;
+        } else free(b.d);
+        return val;
+    }
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_return(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil->env->breakrun = 1;
+    lil_free_value(lil->env->retval);
+    lil->env->retval = argc < 1 ? NULL : lil_clone_value(argv[0]);
+    lil->env->retval_set = 1;
+    return argc < 1 ? NULL : lil_clone_value(argv[0]);
+}
+
+static LILCALLBACK lil_value_t fnc_result(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc > 0) {
+        lil_free_value(lil->env->retval);
+        lil->env->retval = lil_clone_value(argv[0]);
+        lil->env->retval_set = 1;
+    }
+    return lil->env->retval_set ? lil_clone_value(lil->env->retval) : NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_expr(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc == 1) return lil_eval_expr(lil, argv[0]);
+    if (argc > 1) {
+        lil_value_t val = alloc_value(NULL), r;
+        size_t i;
+        for (i=0; i<argc; i++) {
+            if (i) lil_append_char(val, ' ');
+            lil_append_val(val, argv[i]);
+        }
+        r = lil_eval_expr(lil, val);
+        lil_free_value(val);
+        return r;
+    }
+    return NULL;
+}
+
+static lil_value_t real_inc(lil_t lil, const char* varname, float v)
+{
+    lil_value_t pv = lil_get_var(lil, varname);
+    double dv = lil_to_double(pv) + v;
+    if (fmod(dv, 1))
+        pv = lil_alloc_double(dv);
+    else
+        pv = lil_alloc_integer((lilint_t)dv);
+    lil_set_var(lil, varname, pv, LIL_SETVAR_LOCAL);
+    return pv;
+}
+
+static LILCALLBACK lil_value_t fnc_inc(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc < 1) return NULL;
+    return real_inc(lil, lil_to_string(argv[0]), argc > 1 ? lil_to_double(argv[1]) : 1);
+}
+
+static LILCALLBACK lil_value_t fnc_dec(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc < 1) return NULL;
+    return real_inc(lil, lil_to_string(argv[0]), -(argc > 1 ? lil_to_double(argv[1]) : 1));
+}
+
+/* returns a value that uses the script file's pages directly, or NULL if the
+ * file has to be read normally.  The file is remembered until the value and
+ * every view of it are freed, so store won't overwrite the mapped pages */
+static lil_value_t map_file(lil_t lil, const char* name)
+{
+#ifdef LIL_ENABLE_MMAP
+    struct stat st;
+    lil_value_t val;
+    lil_mapped_t* mapped;
+    long page = sysconf(_SC_PAGESIZE);
+    void* map;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return NULL;
+    /* the parser may look up to two bytes past the end of the code, which must
+     * be the zeros that fill the rest of the last page */
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size || page <= 0 ||
+        st.st_size % page == 0 || page - st.st_size % page < 2) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    /* script text with NULs would look shorter than it is */
+    if (memchr(map, 0, (size_t)st.st_size) && !image_size(map, (size_t)st.st_size)) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    val = calloc(1, sizeof(struct _lil_value_t));
+    mapped = malloc(sizeof(lil_mapped_t));
+    if (!val || !mapped) {
+        free(val);
+        free(mapped);
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    val->l = (size_t)st.st_size;
+    val->d = map;
+    val->t = LIL_TYPE_STRING;
+    val->m = 1;
+    mapped->sh = share_value(val);
+    if (!mapped->sh) {
+        free(mapped);
+        lil_free_value(val);
+        return NULL;
+    }
+    mapped->sh->refs++;
+    mapped->dev = st.st_dev;
+    mapped->ino = st.st_ino;
+    mapped->next = lil->mapped;
+    lil->mapped = mapped;
+    return val;
+#else
+    return NULL;
+#endif
+}
+
+static LILCALLBACK lil_value_t fnc_read(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    FILE* f;
+    size_t size;
+    char* buffer;
+    lil_value_t r;
+    if (argc < 1) return NULL;
+    if (lil->callback[LIL_CALLBACK_READ]) {
+        lil_read_callback_proc_t proc = (lil_read_callback_proc_t) lil->callback[LIL_CALLBACK_READ];
+        buffer = proc(lil, lil_to_string(argv[0]));
+        size = buffer ? strlen(buffer) : 0;
+    } else {
+        f = fopen(lil_to_string(argv[0]), "rb");
+        if (!f) return NULL;
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        buffer = malloc(size + 1);
+        size = fread(buffer, 1, size, f);
+        buffer[size] = 0;
+        fclose(f);
+    }
+    r = lil_alloc_string_len(buffer, size);
+    free(buffer);
+    return r;
+}
+
+/* returns nonzero if name is a script file whose mapping is still in use;
+ * mappings nothing uses anymore are dropped on the way */
+static int is_mapped(lil_t lil, const char* name)
+{
+#ifdef LIL_ENABLE_MMAP
+    lil_mapped_t** at = &lil->mapped;
+    struct stat st;
+    int found = 0, known = !stat(name, &st);
+    while (*at) {
+        lil_mapped_t* mapped = *at;
+        if (mapped->sh->refs == 1) {
+            *at = mapped->next;
+            release_shared(mapped->sh);
+            free(mapped);
+            continue;
+        }
+        if (known && mapped->dev == st.st_dev && mapped->ino == st.st_ino) found = 1;
+        at = &mapped->next;
+    }
+    return found;
+#else
+    return 0;
+#endif
+}
+
+static LILCALLBACK lil_value_t fnc_store(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    FILE* f;
+    const char* name;
+    char* temp = NULL;
+    if (argc < 2) return NULL;
+    if (lil->callback[LIL_CALLBACK_STORE]) {
+        lil_store_callback_proc_t proc = (lil_store_callback_proc_t)lil->callback[LIL_CALLBACK_STORE];
+        proc(lil, lil_to_string(argv[0]), lil_to_string(argv[1]));
+    } else {
+        name = lil_to_string(argv[0]);
+        /* writing over a running script would change its mapped pages, so
+         * the new text goes to another file that then replaces the name */
+        if (is_mapped(lil, name)) {
+            temp = malloc(strlen(name) + 5);
+            if (!temp) {
+                lil_set_error(lil, "out of memory");
+                return NULL;
+            }
+            strcpy(temp, name);
+            strcat(temp, ".new");
+        }
+        f = fopen(temp ? temp : name, "wb");
+        if (!f) {
+            free(temp);
+            return NULL;
+        }
+        fwrite(lil_to_string(argv[1]), 1, argv[1]->l, f);
+        if (fclose(f) && temp) {
+            remove(temp);
+            free(temp);
+            return NULL;
+        }
+        if (temp) {
+            if (rename(temp, name)) {
+                remove(temp);
+                free(temp);
+                return NULL;
+            }
+            free(temp);
+        }
+    }
+    return lil_clone_value(argv[1]);
+}
+
+static LILCALLBACK lil_value_t fnc_if(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_value_t val, r = NULL;
+    int base = 0, not = 0, v;
+    if (argc < 1) return NULL;
+    if (!strcmp(lil_to_string(argv[0]), "not")) base = not = 1;
+    if (argc < (size_t)base + 2) return NULL;
+    val = lil_eval_expr(lil, argv[base]);
+    if (!val || lil->error) return NULL;
+    v = lil_to_boolean(val);
+    if (not) v = !v;
+    if (v) {
+        r = lil_parse_value(lil, argv[base + 1], 0);
+    } else if (argc > (size_t)base + 2) {
+        r = lil_parse_value(lil, argv[base + 2], 0);
+    }
+    lil_free_value(val);
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_while(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_value_t val, r = NULL;
+    int base = 0, not = 0, v;
+    if (argc < 1) return NULL;
+    if (!strcmp(lil_to_string(argv[0]), "not")) base = not = 1;
+    if (argc < (size_t)base + 2) return NULL;
+    while (!lil->error && !lil->env->breakrun) {
+        val = lil_eval_expr(lil, argv[base]);
+        if (!val || lil->error) return NULL;
+        v = lil_to_boolean(val);
+        if (not) v = !v;
+        if (!v) {
+            lil_free_value(val);
+            break;
+        }
+        if (r) lil_free_value(r);
+        r = lil_parse_value(lil, argv[base + 1], 0);
+        lil_free_value(val);
+    }
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_for(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_value_t val, r = NULL;
+    if (argc < 4) return NULL;
+    lil_free_value(lil_parse_value(lil, argv[0], 0));
+    while (!lil->error && !lil->env->breakrun) {
+        val = lil_eval_expr(lil, argv[1]);
+        if (!val || lil->error) return NULL;
+        if (!lil_to_boolean(val)) {
+            lil_free_value(val);
+            break;
+        }
+        if (r) lil_free_value(r);
+        r = lil_parse_value(lil, argv[3], 0);
+        lil_free_value(val);
+        lil_free_value(lil_parse_value(lil, argv[2], 0));
+    }
+    return r;
+}
+
+
+static LILCALLBACK lil_value_t fnc_char(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    char s[2];
+    if (!argc) return NULL;
+    s[0] = (char)lil_to_integer(argv[0]);
+    s[1] = 0;
+    return lil_alloc_string_len(s, 1);
+}
+
+static LILCALLBACK lil_value_t fnc_charat(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    size_t index;
+    if (argc < 2) return NULL;
+    index = (size_t)lil_to_integer(argv[1]);
+    if (index >= argv[0]->l) return NULL;
+    return lil_alloc_string_len(argv[0]->d + index, 1);
+}
+
+static LILCALLBACK lil_value_t fnc_codeat(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    size_t index;
+    if (argc < 2) return NULL;
+    index = (size_t)lil_to_integer(argv[1]);
+    if (index >= argv[0]->l) return NULL;
+    return lil_alloc_integer((unsigned char)argv[0]->d[index]);
+}
+
+static LILCALLBACK lil_value_t fnc_substr(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    size_t start, end, slen;
+    if (argc < 2) return NULL;
+    slen = argv[0]->l;
+    if (!slen) return NULL;
+    start = (size_t)atoll(lil_to_string(argv[1]));
+    end = argc > 2 ? (size_t)atoll(lil_to_string(argv[2])) : slen;
+    if (end > slen) end = slen;
+    if (start >= end) return NULL;
+    return alloc_slice(argv[0], start, end - start);
+}
+
+static LILCALLBACK lil_value_t fnc_strpos(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* hay;
+    const char* str;
+    size_t min = 0;
+    if (argc < 2) return lil_alloc_integer(-1);
+    hay = value_bytes(argv[0]);
+    if (argc > 2) {
+        min = (size_t)atoll(lil_to_string(argv[2]));
+        if (min >= argv[0]->l) return lil_alloc_integer(-1);
+    }
+    str = find_bytes(hay + min, argv[0]->l - min, value_bytes(argv[1]), argv[1]->l);
+    if (!str) return lil_alloc_integer(-1);
+    return lil_alloc_integer(str - hay);
+}
+
+static LILCALLBACK lil_value_t fnc_length(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    size_t i, total = 0;
+    for (i=0; i<argc; i++) {
+        if (i) total++;
+        total += argv[i]->l;
+    }
+    return lil_alloc_integer((lilint_t)total);
+}
+
+static lil_value_t real_trim(lil_value_t val, lil_value_t chars, int left, int right)
+{
+    const char* str = value_bytes(val);
+    size_t base = 0, len = val->l;
+    unsigned char set[32];
+    if (chars) byte_set(set, value_bytes(chars), chars->l);
+    else byte_set(set, " \f\n\r\t\v", 6);
+    if (left) while (base < len && IN_BYTE_SET(set, str[base])) base++;
+    if (right) while (len > base && IN_BYTE_SET(set, str[len - 1])) len--;
+    return alloc_slice(val, base, len - base);
+}
+
+static LILCALLBACK lil_value_t fnc_trim(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (!argc) return NULL;
+    return real_trim(argv[0], argc < 2 ? NULL : argv[1], 1, 1);
+}
+
+static LILCALLBACK lil_value_t fnc_ltrim(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (!argc) return NULL;
+    return real_trim(argv[0], argc < 2 ? NULL : argv[1], 1, 0);
+}
+
+static LILCALLBACK lil_value_t fnc_rtrim(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (!argc) return NULL;
+    return real_trim(argv[0], argc < 2 ? NULL : argv[1], 0, 1);
+}
+
+static LILCALLBACK lil_value_t fnc_strcmp(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc < 2) return NULL;
+    return lil_alloc_integer(compare_values(argv[0], argv[1]));
+}
+
+static LILCALLBACK lil_value_t fnc_streq(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc < 2) return NULL;
+    return lil_alloc_integer(argv[0]->l == argv[1]->l && !memcmp(value_bytes(argv[0]), value_bytes(argv[1]), argv[0]->l));
+}
+
+static LILCALLBACK lil_value_t fnc_repstr(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    const char* src;
+    const char* from;
+    const char* to;
+    const char* sub;
+    const char* end;
+    size_t count = 0;
+    size_t fromlen;
+    size_t tolen;
+    size_t srclen;
+    char* p;
+    lil_value_t r;
+    if (argc < 1) return NULL;
+    if (argc < 3) return lil_clone_value(argv[0]);
+    src = value_bytes(argv[0]);
+    from = value_bytes(argv[1]);
+    to = value_bytes(argv[2]);
+    if (!argv[1]->l) return NULL;
+    srclen = argv[0]->l;
+    fromlen = argv[1]->l;
+    tolen = argv[2]->l;
+    /* count the occurences first so that the result is written only once;
+     * the scan continues after each match so a <to> that contains <from> is
+     * not replaced again */
+    end = src + srclen;
+    for (sub = src; (sub = find_bytes(sub, end - sub, from, fromlen)); sub += fromlen) count++;
+    if (!count) return lil_clone_value(argv[0]);
+    r = alloc_value_len(NULL, 0);
+    if (!r) return NULL;
+    r->l = srclen - count*fromlen + count*tolen;
+    r->d = p = malloc(r->l + 1);
+    if (!p) {
+        free(r);
+        return NULL;
+    }
+    while ((sub = find_bytes(src, end - src, from, fromlen))) {
+        memcpy(p, src, sub - src);
+        p += sub - src;
+        memcpy(p, to, tolen);
+        p += tolen;
+        src = sub + fromlen;
+    }
+    memcpy(p, src, end - src);
+    r->d[r->l] = 0;
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_split(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list;
+    const char* str;
+    const char* end;
+    const char* field;
+    unsigned char set[32];
+    lil_value_t val;
+    if (argc == 0) return NULL;
+    if (argc > 1) {
+        if (!argv[1]->l) return lil_clone_value(argv[0]);
+        byte_set(set, argv[1]->d, argv[1]->l);
+    } else byte_set(set, " ", 1);
+    str = value_bytes(argv[0]);
+    end = str + argv[0]->l;
+    list = lil_alloc_list();
+    /* each field is copied out in one piece */
+    for (field = str;; str++) {
+        if (str == end || IN_BYTE_SET(set, *str)) {
+            lil_list_append(list, alloc_value_len(field, str - field));
+            if (str == end) break;
+            field = str + 1;
+        }
+    }
+    val = lil_list_to_value(list, 1);
+    lil_free_list(list);
+    return val;
+}
+
+static LILCALLBACK lil_value_t fnc_try(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_value_t r;
+    if (argc < 1) return NULL;
+    if (lil->error) return NULL;
+    r = lil_parse_value(lil, argv[0], 0);
+    if (lil->error) {
+        lil->error = ERROR_NOERROR;
+        lil_free_value(r);
+        if (argc > 1) r = lil_parse_value(lil, argv[1], 0);
+        else r = 0;
+    }
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_error(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_set_error(lil, argc > 0 ? lil_to_string(argv[0]) : NULL);
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_exit(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_flush(lil);
+    if (lil->callback[LIL_CALLBACK_EXIT]) {
+        lil_exit_callback_proc_t proc = (lil_exit_callback_proc_t)lil->callback[LIL_CALLBACK_EXIT];
+        proc(lil, argc > 0 ? argv[0] : NULL);
+    }
+    return NULL;
+}
+
+static char* read_source(lil_t lil, const char* name)
+{
+    FILE* f;
+    size_t size;
+    char* buffer;
+    if (lil->callback[LIL_CALLBACK_SOURCE]) {
+        lil_source_callback_proc_t proc = (lil_source_callback_proc_t)lil->callback[LIL_CALLBACK_SOURCE];
+        buffer = proc(lil, name);
+    } else if (lil->callback[LIL_CALLBACK_READ]) {
+        lil_read_callback_proc_t proc = (lil_read_callback_proc_t)lil->callback[LIL_CALLBACK_READ];
+        buffer = proc(lil, name);
+    } else {
+        f = fopen(name, "rb");
+        if (!f) return NULL;
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        buffer = malloc(size + 1);
+        fread(buffer, 1, size, f);
+        buffer[size] = 0;
+        fclose(f);
+    }
+    return buffer;
+}
+
+/* The scan_* functions follow skip_spaces and next_word without running
+ * anything, to find where the commands of a partly read script end.  They
+ * return len when they run out of text. */
+static size_t scan_spaces(const char* s, size_t len, size_t i, int ignoreeol)
+{
+    while (i < len) {
+        if (s[i] == '#') {
+            if (i + 2 >= len) return len;
+            if (s[i + 1] == '#' && s[i + 2] != '#') {
+                i += 2;
+                while (1) {
+                    if (i + 2 >= len) return len;
+                    if (s[i] == '#' && s[i + 1] == '#' && s[i + 2] != '#') {
+                        i += 2;
+                        break;
+                    }
+                    i++;
+                }
+            } else {
+                while (i < len && !eolchar(s[i])) i++;
+            }
+        } else if (s[i] == '\\' && i + 1 < len && eolchar(s[i + 1])) {
+            i++;
+            while (i < len && eolchar(s[i])) i++;
+        } else if (s[i] == '\\' && i + 1 >= len) {
+            return len;
+        } else if (eolchar(s[i])) {
+            if (ignoreeol) i++;
+            else break;
+        } else if (isspace(s[i]))
+            i++;
+        else break;
+    }
+    return i;
+}
+
+static size_t scan_nested(const char* s, size_t len, size_t i, char open, char close)
+{
+    size_t cnt = 1;
+    for (i++; i < len; i++) {
+        if (s[i] == open) cnt++;
+        else if (s[i] == close && --cnt == 0) return i + 1;
+    }
+    return len;
+}
+
+static size_t scan_word(const char* s, size_t len, size_t i, int ignoreeol)
+{
+    i = scan_spaces(s, len, i, ignoreeol);
+    if (i >= len) return len;
+    if (s[i] == '$') return scan_word(s, len, i + 1, ignoreeol);
+    if (s[i] == '{') return scan_nested(s, len, i, '{', '}');
+    if (s[i] == '[') return scan_nested(s, len, i, '[', ']');
+    if (s[i] == '"' || s[i] == '\'') {
+        char sc = s[i++];
+        while (i < len) {
+            if (s[i] == '[' || s[i] == '$') {
+                i = s[i] == '$' ? scan_word(s, len, i + 1, ignoreeol) : scan_nested(s, len, i, '[', ']');
+                if (i >= len) return len;
+                i--;
+            } else if (s[i] == '\\') {
+                i++;
+            } else if (s[i] == sc) {
+                return i + 1;
+            }
+            i++;
+        }
+        return len;
+    }
+    return scan_class(s + i, s + len, CC_WORDEND) - s;
+}
+
+/* returns the length of the complete commands at the start of s, sets *stuck
+ * if the parser would stop at a word it can't read */
+static size_t scan_commands(const char* s, size_t len, int* stuck)
+{
+    size_t i = 0, end = 0, next;
+    while (1) {
+        i = scan_spaces(s, len, i, 0);
+        if (i >= len) break;
+        if (eolchar(s[i])) {
+            end = ++i;
+            continue;
+        }
+        next = scan_word(s, len, i, 0);
+        if (next == i) {
+            *stuck = 1;
             break;
         }
-        if (r) lil_free_value(r);
-        r = lil_parse_value(lil, argv[3], 0);
-        lil_free_value(val);
-        lil_free_value(lil_parse_value(lil, argv[2], 0));
+        i = next;
     }
-    return r;
+    return end;
 }
 
+/* maps the script if source reads files itself */
+static lil_value_t map_source(lil_t lil, const char* name)
+{
+    if (lil->callback[LIL_CALLBACK_SOURCEREAD] || lil->callback[LIL_CALLBACK_SOURCE] || lil->callback[LIL_CALLBACK_READ]) return NULL;
+    return map_file(lil, name);
+}
 
-static LILCALLBACK lil_value_t fnc_char(lil_t lil, size_t argc, lil_value_t* argv)
+/* returns a reader for name if source can stream it, NULL if the whole
+ * script has to be read with read_source */
+static lil_source_t* open_source(lil_t lil, const char* name)
 {
-    char s[2];
-    if (!argc) return NULL;
-    s[0] = (char)lil_to_integer(argv[0]);
-    s[1] = 0;
-    return lil_alloc_string(s);
+    lil_source_t* src;
+    FILE* f = NULL;
+    if (!lil->callback[LIL_CALLBACK_SOURCEREAD]) {
+        if (lil->callback[LIL_CALLBACK_SOURCE] || lil->callback[LIL_CALLBACK_READ]) return NULL;
+        f = fopen(name, "rb");
+        if (!f) return NULL;
+    }
+    src = calloc(1, sizeof(lil_source_t));
+    if (!src) {
+        if (f) fclose(f);
+        return NULL;
+    }
+    src->name = strclone(name);
+    src->f = f;
+    return src;
 }
 
-static LILCALLBACK lil_value_t fnc_charat(lil_t lil, size_t argc, lil_value_t* argv)
+static void close_source(lil_source_t* src)
 {
-    size_t index;
-    char chstr[2];
-    const char* str;
+    if (!src) return;
+    if (src->f) fclose(src->f);
+    free(src->name);
+    lil_free_value(src->piece);
+    free(src->buf);
+    free(src);
+}
+
+/* makes the position of an error in the running piece relative to the file */
+static void source_error(lil_t lil, lil_source_t* src)
+{
+    if (lil->error == ERROR_DEFAULT && src->piece && lil->err_code == src->piece->d) {
+        lil->err_head += src->start;
+        lil->err_code = NULL;
+    }
+}
+
+/* reads the next complete commands of the script into src->piece, returns
+ * NULL at its end; only the command being read is kept in memory */
+static lil_value_t next_source(lil_t lil, lil_source_t* src)
+{
+    size_t end = 0;
+    lil_free_value(src->piece);
+    src->piece = NULL;
+    while (1) {
+        /* images can't be split, so they are read whole */
+        if (src->len && src->len == src->offset && src->buf[0] == IMAGE_MAGIC[0]) src->whole = 1;
+        if (!src->whole) {
+            int stuck = 0;
+            end = scan_commands(src->buf, src->len, &stuck);
+            if (stuck) src->whole = 1;
+            if (end) break;
+        }
+        if (src->eof) {
+            end = src->len;
+            break;
+        } else {
+            /* read more as a command grows, to keep rescanning it linear */
+            size_t want = src->len > SOURCE_CHUNK ? src->len : SOURCE_CHUNK;
+            size_t got;
+            if (src->len + want > src->cap) {
+                char* nbuf = realloc(src->buf, src->len + want);
+                if (!nbuf) {
+                    lil_set_error(lil, "out of memory");
+                    return NULL;
+                }
+                src->buf = nbuf;
+                src->cap = src->len + want;
+            }
+            if (src->f) {
+                got = fread(src->buf + src->len, 1, want, src->f);
+            } else {
+                lil_sourceread_callback_proc_t proc = (lil_sourceread_callback_proc_t)lil->callback[LIL_CALLBACK_SOURCEREAD];
+                got = proc(lil, src->name, src->offset, src->buf + src->len, want);
+                if (lil->error) return NULL;
+            }
+            if (!got) src->eof = 1;
+            src->len += got;
+            src->offset += got;
+        }
+    }
+    if (!end) return NULL;
+    src->piece = alloc_value_len(src->buf, end);
+    src->start = src->offset - src->len;
+    src->len -= end;
+    memmove(src->buf, src->buf + end, src->len);
+    return src->piece;
+}
+
+/* the length of a script returned by read_source, which may be an image */
+static size_t script_len(const char* buffer)
+{
+    size_t len = image_size(buffer, 0);
+    return len ? len : strlen(buffer);
+}
+
+static lil_value_t run_script(lil_t lil, const char* code, size_t len)
+{
+    if (!len) return alloc_value(NULL);
+    if (image_size(code, len)) return lil_parse_image(lil, code, len, 0);
+    return lil_parse(lil, code, len, 0);
+}
+
+static LILCALLBACK lil_value_t fnc_source(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    char* buffer;
+    lil_value_t r = NULL, code;
+    lil_source_t* src;
+    if (argc < 1) return NULL;
+    code = map_source(lil, lil_to_string(argv[0]));
+    if (code) {
+        r = run_script(lil, code->d, code->l);
+        lil_free_value(code);
+        return r;
+    }
+    src = open_source(lil, lil_to_string(argv[0]));
+    if (src) {
+        while ((code = next_source(lil, src))) {
+            lil_free_value(r);
+            r = run_script(lil, code->d, code->l);
+            source_error(lil, src);
+            if (lil->error || lil->env->breakrun) break;
+        }
+        close_source(src);
+        return r;
+    }
+    buffer = read_source(lil, lil_to_string(argv[0]));
+    if (!buffer) return NULL;
+    r = run_script(lil, buffer, script_len(buffer));
+    free(buffer);
+    return r;
+}
+
+static LILCALLBACK lil_value_t fnc_lmap(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    lil_list_t list;
+    size_t i;
     if (argc < 2) return NULL;
-    str = lil_to_string(argv[0]);
-    index = (size_t)lil_to_integer(argv[1]);
-    if (index >= strlen(str)) return NULL;
-    chstr[0] = str[index];
-    chstr[1] = 0;
-    return lil_alloc_string(chstr);
+    list = lil_subst_to_list(lil, argv[0]);
+    for (i=1; i<argc; i++)
+        lil_set_var(lil, lil_to_string(argv[i]), lil_list_get(list, i - 1), LIL_SETVAR_LOCAL);
+    lil_free_list(list);
+    return NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_codeat(lil_t lil, size_t argc, lil_value_t* argv)
+static LILCALLBACK lil_value_t fnc_rand(lil_t lil, size_t argc, lil_value_t* argv)
 {
-    size_t index;
-    const char* str;
+    /* xorshift32 with per-interpreter state, rand() isn't thread safe */
+    unsigned long x = lil->rndstate;
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    lil->rndstate = x;
+    return lil_alloc_double(x/4294967296.0);
+}
+
+static LILCALLBACK lil_value_t fnc_catcher(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    if (argc == 0) {
+        return lil_alloc_string(lil->catcher);
+    } else {
+        const char* catcher = lil_to_string(argv[0]);
+        free(lil->catcher);
+        lil->catcher = catcher[0] ? strclone(catcher) : NULL;
+    }
+    return NULL;
+}
+
+static LILCALLBACK lil_value_t fnc_watch(lil_t lil, size_t argc, lil_value_t* argv)
+{
+    size_t i;
+    const char* wcode;
     if (argc < 2) return NULL;
-    str = lil_to_string(argv[0]);
-    index = (size_t)lil_to_integer(argv[1]);
-    if (index >= strlen(str)) return NULL;
-    return lil_alloc_integer(str[index]);
+    wcode = lil_to_string(argv[argc - 1]);
+    for (i=0; i + 1 < argc; i++) {
+        const char* vname = lil_to_string(argv[i]);
+        lil_var_t v;
+        if (!vname[0]) continue;
+        v = lil_find_var(lil, lil->env, lil_to_string(argv[i]));
+        if (!v) v = lil_set_var(lil, vname, NULL, LIL_SETVAR_LOCAL_NEW);
+        free(v->w);
+        v->w = wcode[0] ? strclone(wcode) : NULL;
+    }
+    return NULL;
+}
+
+/* Resumable execution
+ *
+ * lil_start/lil_resume run code on an explicit stack of frames instead of
+ * recursing through lil_parse, so that a native command can call lil_suspend
+ * and have the whole script paused until the next lil_resume.  The frames
+ * mirror lil_parse/substitute/next_word and the control commands that run
+ * code (if, while, for, foreach, try, eval and friends, source, function
+ * calls and the catcher).  Any other native that evaluates code does so with
+ * a nested lil_parse, inside which lil_suspend is refused. */
+
+#define FRAME_CODE 0
+#define FRAME_SUBST 1
+#define FRAME_WORD 2
+#define FRAME_IF 3
+#define FRAME_WHILE 4
+#define FRAME_FOR 5
+#define FRAME_FOREACH 6
+#define FRAME_TRY 7
+#define FRAME_SOURCE 8
+
+/* code frame states */
+#define FS_LINE 0
+#define FS_WORDS 1
+#define FS_PART 2
+#define FS_QUOTE 3
+#define FS_WAIT 4
+#define FS_RUN 5
+#define FS_NATIVE 6
+#define FS_CALL 7
+
+/* what a code frame in FS_WAIT does with the result of its child */
+#define FW_PART 0
+#define FW_QUOTE 1
+#define FW_NAME 2
+#define FW_QNAME 3
+
+static int is_code_frame(struct _lil_frame_t* fr)
+{
+    return fr->kind == FRAME_CODE || fr->kind == FRAME_SUBST || fr->kind == FRAME_WORD;
+}
+
+static void free_frame(struct _lil_frame_t* fr)
+{
+    lil_free_value(fr->owncode);
+    lil_free_list(fr->words);
+    lil_free_value(fr->w);
+    lil_free_value(fr->q);
+    lil_free_value(fr->pstate);
+    lil_free_list(fr->list);
+    lil_free_list(fr->rlist);
+    lil_free_value(fr->val);
+    lil_free_value(fr->ret);
+    lil_free_list(fr->retlist);
+    close_source(fr->source);
+    free(fr);
+}
+
+/* drops all frames without running anything */
+static void clear_exec(lil_t lil, lil_exec_t* exec)
+{
+    while (exec->top) {
+        struct _lil_frame_t* fr = exec->top;
+        exec->top = fr->up;
+        if (fr->ownenv) lil_free_env(fr->env);
+        if (fr->catcher) lil->in_catcher--;
+        free_frame(fr);
+    }
+    exec->frames = 0;
+}
+
+static void free_exec(lil_t lil, lil_exec_t* exec)
+{
+    if (!exec) return;
+    clear_exec(lil, exec);
+    free(exec->err_msg);
+    lil_free_value(exec->result);
+    free(exec);
+}
+
+static struct _lil_frame_t* push_frame(lil_t lil, int kind)
+{
+    lil_exec_t* exec = lil->exec;
+    struct _lil_frame_t* fr;
+#ifdef LIL_ENABLE_RECLIMIT
+    if (exec->frames >= LIL_ENABLE_RECLIMIT) {
+        lil_set_error(lil, "Too many recursive calls");
+        return NULL;
+    }
+#endif
+    fr = calloc(1, sizeof(struct _lil_frame_t));
+    if (!fr) {
+        lil_set_error(lil, "out of memory");
+        return NULL;
+    }
+    fr->kind = kind;
+    fr->env = lil->env;
+    fr->downenv = lil->downenv;
+    fr->up = exec->top;
+    exec->top = fr;
+    exec->frames++;
+    return fr;
+}
+
+/* pushes a frame scanning code, owncode (if any) is freed with the frame */
+static struct _lil_frame_t* push_code(lil_t lil, int kind, lil_value_t owncode, const char* code, size_t clen)
+{
+    struct _lil_frame_t* fr = push_frame(lil, kind);
+    if (!fr) {
+        lil_free_value(owncode);
+        return NULL;
+    }
+    fr->owncode = owncode;
+    fr->code = code;
+    fr->clen = clen;
+    switch (kind) {
+    case FRAME_CODE:
+        fr->state = FS_LINE;
+        if (lil->callback[LIL_CALLBACK_CHECKINTERRUPT]) {
+            lil_checkinterrupt_callback_proc_t proc = (lil_checkinterrupt_callback_proc_t)lil->callback[LIL_CALLBACK_CHECKINTERRUPT];
+            proc(lil);
+        }
+        break;
+    case FRAME_SUBST:
+        fr->ignoreeol = 1;
+        fr->words = lil_alloc_list();
+        fr->state = FS_WORDS;
+        break;
+    case FRAME_WORD:
+        fr->state = FS_PART;
+        break;
+    }
+    return fr;
+}
+
+static struct _lil_frame_t* push_value(lil_t lil, int kind, lil_value_t code)
+{
+    return push_code(lil, kind, NULL, lil_to_string(code), code ? code->l : 0);
+}
+
+static struct _lil_frame_t* push_owned(lil_t lil, int kind, lil_value_t code)
+{
+    return push_code(lil, kind, code, lil_to_string(code), code->l);
+}
+
+/* pushes a frame running a script given to source, which may be an image */
+static struct _lil_frame_t* push_script(lil_t lil, lil_value_t owncode, const char* code, size_t clen)
+{
+    struct _lil_frame_t* fr;
+    if (!image_size(code, clen)) return push_code(lil, FRAME_CODE, owncode, code, clen);
+    fr = push_code(lil, FRAME_CODE, owncode, code, 0);
+    if (fr) {
+        fr->image = 1;
+        fr->ipos = IMAGE_HEADER;
+        fr->icmds = image_u32((const unsigned char*)code + 16);
+    }
+    return fr;
+}
+
+static void part_done(lil_t lil, struct _lil_frame_t* fr, lil_value_t part)
+{
+    if (!part) part = alloc_value(NULL);
+    if (fr->kind == FRAME_WORD) {
+        fr->val = part;
+        fr->done = 1;
+        return;
+    }
+    if (lil->head == fr->phead) { /* something wrong, the parser can't proceed */
+        lil_free_value(part);
+        lil_free_value(fr->w);
+        fr->w = NULL;
+        lil_free_list(fr->words);
+        fr->words = fr->kind == FRAME_SUBST ? lil_alloc_list() : NULL;
+        fr->done = 1;
+        return;
+    }
+    lil_append_val(fr->w, part);
+    lil_free_value(part);
+    if (lil->head < lil->clen && !eolchar(lil->code[lil->head]) && !isspace(lil->code[lil->head]) && !lil->error) {
+        fr->state = FS_PART;
+    } else {
+        skip_spaces(lil);
+        lil_list_append(fr->words, fr->w);
+        fr->w = NULL;
+        fr->state = FS_WORDS;
+    }
+}
+
+static int wait_child(struct _lil_frame_t* fr, struct _lil_frame_t* child, int wait, int ignoreeol)
+{
+    if (!child) return 1;
+    child->ignoreeol = ignoreeol;
+    fr->wait = wait;
+    fr->state = FS_WAIT;
+    return 0;
+}
+
+/* the resumable version of next_word, returns 0 if it had to push a frame */
+static int exec_part(lil_t lil, struct _lil_frame_t* fr)
+{
+    lil_value_t cmd;
+    size_t start;
+    skip_spaces(lil);
+    switch (lil->code[lil->head]) {
+    case '$':
+        lil->head++;
+        return wait_child(fr, push_code(lil, FRAME_WORD, NULL, lil->code + lil->head, lil->clen - lil->head), FW_NAME, lil->ignoreeol);
+    case '{':
+        part_done(lil, fr, scan_bracepart(lil));
+        return 1;
+    case '[':
+        cmd = scan_bracketpart(lil);
+        if (!cmd->l) {
+            part_done(lil, fr, cmd);
+            return 1;
+        }
+        return wait_child(fr, push_owned(lil, FRAME_CODE, cmd), FW_PART, 0);
+    case '"':
+    case '\'':
+        fr->sc = lil->code[lil->head++];
+        fr->q = alloc_value(NULL);
+        fr->state = FS_QUOTE;
+        return 1;
+    default:
+        start = lil->head;
+        lil->head = scan_class(lil->code + start, lil->code + lil->clen, CC_WORDEND) - lil->code;
+        part_done(lil, fr, alloc_value_len(lil->code + start, lil->head - start));
+        return 1;
+    }
+}
+
+static int exec_quote(lil_t lil, struct _lil_frame_t* fr)
+{
+    lil_value_t part;
+    while (lil->head < lil->clen) {
+        if (lil->code[lil->head] == '[') {
+            lil_value_t cmd = scan_bracketpart(lil);
+            if (!cmd->l) {
+                lil_free_value(cmd);
+                continue;
+            }
+            return wait_child(fr, push_owned(lil, FRAME_CODE, cmd), FW_QUOTE, 0);
+        } else if (lil->code[lil->head] == '$') {
+            lil->head++;
+            return wait_child(fr, push_code(lil, FRAME_WORD, NULL, lil->code + lil->head, lil->clen - lil->head), FW_QNAME, lil->ignoreeol);
+        } else if (lil->code[lil->head] == '\\') {
+            lil->head++;
+            lil_append_char(fr->q, unescape_char(lil->code[lil->head]));
+        } else if (lil->code[lil->head] == fr->sc) {
+            lil->head++;
+            break;
+        } else {
+            lil_append_char(fr->q, lil->code[lil->head]);
+        }
+        lil->head++;
+    }
+    part = fr->q;
+    fr->q = NULL;
+    part_done(lil, fr, part);
+    return 1;
+}
+
+static int exec_wait(lil_t lil, struct _lil_frame_t* fr)
+{
+    lil_value_t val = fr->ret, code;
+    fr->ret = NULL;
+    switch (fr->wait) {
+    case FW_PART:
+        part_done(lil, fr, val);
+        return 1;
+    case FW_QUOTE:
+        lil_append_val(fr->q, val);
+        lil_free_value(val);
+        fr->state = FS_QUOTE;
+        return 1;
+    }
+    code = alloc_value(lil->dollarprefix);
+    lil_append_val(code, val);
+    lil_free_value(val);
+    if (!code->l) {
+        lil_free_value(code);
+        if (fr->wait == FW_QNAME) fr->state = FS_QUOTE;
+        else part_done(lil, fr, NULL);
+        return 1;
+    }
+    return wait_child(fr, push_owned(lil, FRAME_CODE, code), fr->wait == FW_QNAME ? FW_QUOTE : FW_PART, lil->ignoreeol);
+}
+
+static void command_done(lil_t lil, struct _lil_frame_t* fr, lil_value_t val)
+{
+    fr->val = val;
+    lil_free_value(fr->pstate);
+    fr->pstate = NULL;
+    if (lil->env->breakrun) {
+        fr->done = 1;
+        return;
+    }
+    if (!fr->image) {
+        skip_spaces(lil);
+        while (ateol(lil)) lil->head++;
+        skip_spaces(lil);
+    }
+    fr->state = FS_LINE;
+}
+
+static int exec_native(lil_t lil, struct _lil_frame_t* fr, lil_func_proc_t proc)
+{
+    lil_exec_t* exec = lil->exec;
+    size_t shead = lil->head;
+    lil_value_t val;
+    exec->invoking = 1;
+    val = proc(lil, fr->words->c - 1, fr->words->v + 1);
+    exec->invoking = 0;
+    if (lil->error == ERROR_FIXHEAD) {
+        lil->error = ERROR_DEFAULT;
+        lil->err_head = shead;
+        lil->err_code = lil->code;
+    }
+    if (exec->suspend && lil->error) exec->suspend = 0;
+    if (exec->suspend) {
+        lil_free_value(val);
+        fr->nproc = proc;
+        fr->state = FS_NATIVE;
+        return 0;
+    }
+    command_done(lil, fr, val);
+    return 1;
+}
+
+static struct _lil_frame_t* push_eval(lil_t lil, size_t argc, lil_value_t* argv, lil_env_t env, lil_env_t downenv)
+{
+    struct _lil_frame_t* fr;
+    lil_env_t save_env = lil->env;
+    lil_env_t save_downenv = lil->downenv;
+    lil->env = env;
+    lil->downenv = downenv;
+    if (argc == 1) {
+        fr = push_value(lil, FRAME_CODE, argv[0]);
+    } else {
+        lil_value_t val = alloc_value(NULL);
+        size_t i;
+        for (i=0; i<argc; i++) {
+            if (i) lil_append_char(val, ' ');
+            lil_append_val(val, argv[i]);
+        }
+        fr = push_owned(lil, FRAME_CODE, val);
+    }
+    lil->env = save_env;
+    lil->downenv = save_downenv;
+    return fr;
+}
+
+/* starts the resumable version of the control commands, returns 0 if the
+ * command should just be called */
+static int exec_builtin(lil_t lil, struct _lil_frame_t* fr, lil_func_proc_t proc)
+{
+    size_t argc = fr->words->c - 1;
+    lil_value_t* argv = fr->words->v + 1;
+    struct _lil_frame_t* ctl = NULL;
+    if (proc == fnc_if || proc == fnc_while) {
+        size_t base = 0;
+        if (argc < 1) return 0;
+        if (!strcmp(lil_to_string(argv[0]), "not")) base = 1;
+        if (argc < base + 2) return 0;
+        ctl = push_frame(lil, proc == fnc_if ? FRAME_IF : FRAME_WHILE);
+        if (ctl) ctl->base = ctl->not = base;
+    } else if (proc == fnc_for) {
+        if (argc < 4) return 0;
+        ctl = push_frame(lil, FRAME_FOR);
+    } else if (proc == fnc_foreach) {
+        if (argc < 2) return 0;
+        ctl = push_frame(lil, FRAME_FOREACH);
+        if (ctl) ctl->base = argc >= 3 ? 1 : 0;
+    } else if (proc == fnc_try) {
+        if (argc < 1) return 0;
+        ctl = push_frame(lil, FRAME_TRY);
+    } else if (proc == fnc_eval) {
+        if (argc < 1) return 0;
+        push_eval(lil, argc, argv, lil->env, lil->downenv);
+    } else if (proc == fnc_topeval) {
+        if (argc < 1) return 0;
+        push_eval(lil, argc, argv, lil->rootenv, lil->env);
+    } else if (proc == fnc_upeval) {
+        if (argc < 1) return 0;
+        if (lil->env == lil->rootenv) push_eval(lil, argc, argv, lil->env, lil->downenv);
+        else push_eval(lil, argc, argv, lil->env->parent, lil->env);
+    } else if (proc == fnc_downeval) {
+        if (argc < 1) return 0;
+        if (!lil->downenv) push_eval(lil, argc, argv, lil->env, lil->downenv);
+        else push_eval(lil, argc, argv, lil->downenv, NULL);
+    } else if (proc == fnc_source) {
+        char* buffer;
+        lil_source_t* src;
+        lil_value_t code;
+        if (argc < 1) return 0;
+        code = map_source(lil, lil_to_string(argv[0]));
+        if (code) {
+            push_script(lil, code, code->d, code->l);
+            fr->state = FS_CALL;
+            return 1;
+        }
+        src = open_source(lil, lil_to_string(argv[0]));
+        if (src) {
+            ctl = push_frame(lil, FRAME_SOURCE);
+            if (ctl) ctl->source = src;
+            else close_source(src);
+            fr->state = FS_CALL;
+            return 1;
+        }
+        buffer = read_source(lil, lil_to_string(argv[0]));
+        if (buffer) {
+            code = alloc_value_len(buffer, script_len(buffer));
+            if (code) push_script(lil, code, code->d, code->l);
+        }
+        free(buffer);
+    } else return 0;
+    if (ctl) {
+        ctl->argc = argc;
+        ctl->argv = argv;
+    }
+    fr->state = FS_CALL;
+    return 1;
+}
+
+static int exec_command(lil_t lil, struct _lil_frame_t* fr)
+{
+    lil_list_t words = fr->words;
+    struct _lil_frame_t* child;
+    lil_func_t cmd;
+    lil_env_t env;
+    if (!words->c) {
+        command_done(lil, fr, NULL);
+        return 1;
+    }
+    cmd = find_cmd(lil, lil_to_string(words->v[0]));
+    if (!cmd) {
+        if (!words->v[0]->l) {
+            command_done(lil, fr, NULL);
+            return 1;
+        }
+        if (lil->catcher) {
+            if (lil->in_catcher < MAX_CATCHER_DEPTH) {
+                lil_value_t args;
+                env = lil_push_env(lil);
+                env->catcher_for = words->v[0];
+                args = lil_list_to_value(words, 1);
+                lil_set_var(lil, "args", args, LIL_SETVAR_LOCAL_NEW);
+                lil_free_value(args);
+                child = push_owned(lil, FRAME_CODE, alloc_value(lil->catcher));
+                if (!child) {
+                    lil_pop_env(lil);
+                    return 1;
+                }
+                lil->env = fr->env;
+                lil->in_catcher++;
+                child->ownenv = child->funclevel = child->catcher = 1;
+                fr->state = FS_CALL;
+                return 0;
+            } else {
+                char* msg = malloc(words->v[0]->l + 64);
+                sprintf(msg, "catcher limit reached while trying to call unknown function %s", lil_to_string(words->v[0]));
+                lil_set_error_at(lil, lil->head, msg);
+                free(msg);
+            }
+        } else {
+            char* msg = malloc(words->v[0]->l + 32);
+            sprintf(msg, "unknown function %s", lil_to_string(words->v[0]));
+            lil_set_error_at(lil, lil->head, msg);
+            free(msg);
+        }
+        return 1;
+    }
+    if (cmd->proc) {
+        if (exec_builtin(lil, fr, cmd->proc)) return 0;
+        return exec_native(lil, fr, cmd->proc);
+    }
+    env = lil_push_env(lil);
+    env->func = cmd;
+    if (cmd->argnames->c == 1 && !strcmp(lil_to_string(cmd->argnames->v[0]), "args")) {
+        lil_value_t args = lil_list_to_value(words, 1);
+        lil_set_var(lil, "args", args, LIL_SETVAR_LOCAL_NEW);
+        lil_free_value(args);
+    } else {
+        size_t i;
+        for (i=0; i<cmd->argnames->c; i++) {
+            lil_set_var(lil, lil_to_string(cmd->argnames->v[i]), i < words->c - 1 ? words->v[i + 1] : lil->empty, LIL_SETVAR_LOCAL_NEW);
+        }
+    }
+    /* the function may be redefined while it is suspended */
+    child = cmd->code ? push_owned(lil, FRAME_CODE, lil_clone_value(cmd->code)) : push_value(lil, FRAME_CODE, NULL);
+    if (!child) {
+        lil_pop_env(lil);
+        return 1;
+    }
+    lil->env = fr->env;
+    child->ownenv = child->funclevel = 1;
+    fr->state = FS_CALL;
+    return 0;
+}
+
+static void step_code(lil_t lil, struct _lil_frame_t* fr)
+{
+    while (!fr->done && !lil->error) {
+        switch (fr->state) {
+        case FS_LINE:
+            if (fr->image ? !fr->icmds : lil->head >= lil->clen) {
+                fr->done = 1;
+                return;
+            }
+            lil_free_list(fr->words);
+            lil_free_value(fr->val);
+            fr->val = NULL;
+            if (fr->image) {
+                fr->icmds--;
+                fr->words = image_words(lil, (const unsigned char*)fr->code, &fr->ipos);
+                fr->state = FS_RUN;
+            } else {
+                fr->words = lil_alloc_list();
+                fr->state = FS_WORDS;
+            }
+            break;
+        case FS_WORDS:
+            skip_spaces(lil);
+            if (lil->head < lil->clen && !ateol(lil)) {
+                fr->w = alloc_value(NULL);
+                fr->state = FS_PART;
+            } else if (fr->kind == FRAME_SUBST) {
+                fr->done = 1;
+            } else {
+                fr->state = FS_RUN;
+            }
+            break;
+        case FS_PART:
+            fr->phead = lil->head;
+            if (!exec_part(lil, fr)) return;
+            break;
+        case FS_QUOTE:
+            if (!exec_quote(lil, fr)) return;
+            break;
+        case FS_WAIT:
+            if (!exec_wait(lil, fr)) return;
+            break;
+        case FS_RUN:
+            exec_command(lil, fr);
+            return;
+        case FS_NATIVE:
+            exec_native(lil, fr, fr->nproc);
+            return;
+        case FS_CALL:
+            command_done(lil, fr, fr->ret);
+            fr->ret = NULL;
+            return;
+        }
+    }
 }
 
-static LILCALLBACK lil_value_t fnc_substr(lil_t lil, size_t argc, lil_value_t* argv)
+static lil_value_t exec_expr(lil_t lil, struct _lil_frame_t* fr)
 {
-    const char* str;
-    lil_value_t r;
-    size_t start, end, i, slen;
-    if (argc < 2) return NULL;
-    str = lil_to_string(argv[0]);
-    if (!str[0]) return NULL;
-    slen = strlen(str);
-    start = (size_t)atoll(lil_to_string(argv[1]));
-    end = argc > 2 ? (size_t)atoll(lil_to_string(argv[2])) : slen;
-    if (end > slen) end = slen;
-    if (start >= end) return NULL;
-    r = lil_alloc_string("");
-    for (i=start; i<end; i++)
-        lil_append_char(r, str[i]);
+    lil_value_t code = lil_list_to_value(fr->retlist, 0);
+    lil_value_t r = eval_substituted_expr(lil, code);
+    lil_free_value(code);
+    lil_free_list(fr->retlist);
+    fr->retlist = NULL;
     return r;
 }
 
-static LILCALLBACK lil_value_t fnc_strpos(lil_t lil, size_t argc, lil_value_t* argv)
+static int exec_condition(lil_t lil, struct _lil_frame_t* fr)
 {
-    const char* hay;
-    const char* str;
-    size_t min = 0;
-    if (argc < 2) return lil_alloc_integer(-1);
-    hay = lil_to_string(argv[0]);
-    if (argc > 2) {
-        min = (size_t)atoll(lil_to_string(argv[2]));
-        if (min >= strlen(hay)) return lil_alloc_integer(-1);
-    }
-    str = strstr(hay + min, lil_to_string(argv[1]));
-    if (!str) return lil_alloc_integer(-1);
-    return lil_alloc_integer(str - hay);
+    lil_value_t val = exec_expr(lil, fr);
+    int v;
+    if (!val) return -1;
+    v = lil_to_boolean(val);
+    lil_free_value(val);
+    return fr->not ? !v : v;
 }
 
-static LILCALLBACK lil_value_t fnc_length(lil_t lil, size_t argc, lil_value_t* argv)
+static void step_control(lil_t lil, struct _lil_frame_t* fr)
 {
-    size_t i, total = 0;
-    for (i=0; i<argc; i++) {
-        if (i) total++;
-        total += strlen(lil_to_string(argv[i]));
+    lil_value_t* argv = fr->argv;
+    size_t base = fr->base;
+    int v;
+    switch (fr->kind) {
+    case FRAME_IF:
+        switch (fr->state) {
+        case 0:
+            fr->state = 1;
+            push_value(lil, FRAME_SUBST, argv[base]);
+            break;
+        case 1:
+            v = exec_condition(lil, fr);
+            fr->state = 2;
+            if (v < 0) fr->done = 1;
+            else if (v) push_value(lil, FRAME_CODE, argv[base + 1]);
+            else if (fr->argc > base + 2) push_value(lil, FRAME_CODE, argv[base + 2]);
+            else fr->done = 1;
+            break;
+        case 2:
+            fr->val = fr->ret;
+            fr->ret = NULL;
+            fr->done = 1;
+            break;
+        }
+        break;
+    case FRAME_WHILE:
+        switch (fr->state) {
+        case 0:
+            if (lil->env->breakrun) {
+                fr->done = 1;
+                break;
+            }
+            fr->state = 1;
+            push_value(lil, FRAME_SUBST, argv[base]);
+            break;
+        case 1:
+            v = exec_condition(lil, fr);
+            if (v < 0) {
+                lil_free_value(fr->val);
+                fr->val = NULL;
+            }
+            if (v <= 0) {
+                fr->done = 1;
+                break;
+            }
+            fr->state = 2;
+            push_value(lil, FRAME_CODE, argv[base + 1]);
+            break;
+        case 2:
+            lil_free_value(fr->val);
+            fr->val = fr->ret;
+            fr->ret = NULL;
+            fr->state = 0;
+            break;
+        }
+        break;
+    case FRAME_FOR:
+        switch (fr->state) {
+        case 0:
+            fr->state = 1;
+            push_value(lil, FRAME_CODE, argv[0]);
+            break;
+        case 1:
+        case 5:
+            lil_free_value(fr->ret);
+            fr->ret = NULL;
+            if (lil->env->breakrun) {
+                fr->done = 1;
+                break;
+            }
+            fr->state = 2;
+            push_value(lil, FRAME_SUBST, argv[1]);
+            break;
+        case 2:
+            v = exec_condition(lil, fr);
+            if (v < 0) {
+                lil_free_value(fr->val);
+                fr->val = NULL;
+            }
+            if (v <= 0) {
+                fr->done = 1;
+                break;
+            }
+            fr->state = 3;
+            push_value(lil, FRAME_CODE, argv[3]);
+            break;
+        case 3:
+            lil_free_value(fr->val);
+            fr->val = fr->ret;
+            fr->ret = NULL;
+            fr->state = 5;
+            push_value(lil, FRAME_CODE, argv[2]);
+            break;
+        }
+        break;
+    case FRAME_FOREACH:
+        switch (fr->state) {
+        case 0:
+            fr->rlist = lil_alloc_list();
+            fr->state = 1;
+            push_value(lil, FRAME_SUBST, argv[base]);
+            break;
+        case 1:
+            fr->list = fr->retlist;
+            fr->retlist = NULL;
+            fr->state = 2;
+            break;
+        case 2:
+            if (fr->index >= fr->list->c) {
+                fr->val = lil_list_to_value(fr->rlist, 1);
+                fr->done = 1;
+                break;
+            }
+            lil_set_var(lil, base ? lil_to_string(argv[0]) : "i", fr->list->v[fr->index], LIL_SETVAR_LOCAL_ONLY);
+            fr->state = 3;
+            push_value(lil, FRAME_CODE, argv[base + 1]);
+            break;
+        case 3:
+            if (fr->ret->l) lil_list_append(fr->rlist, fr->ret);
+            else lil_free_value(fr->ret);
+            fr->ret = NULL;
+            fr->index++;
+            fr->state = 2;
+            if (lil->env->breakrun) fr->index = fr->list->c;
+            break;
+        }
+        break;
+    case FRAME_TRY:
+        switch (fr->state) {
+        case 0:
+            fr->state = 1;
+            push_value(lil, FRAME_CODE, argv[0]);
+            break;
+        default:
+            fr->val = fr->ret;
+            fr->ret = NULL;
+            fr->done = 1;
+            break;
+        }
+        break;
+    case FRAME_SOURCE: {
+        lil_value_t code;
+        if (fr->state) {
+            lil_free_value(fr->val);
+            fr->val = fr->ret;
+            fr->ret = NULL;
+            if (lil->env->breakrun) {
+                fr->done = 1;
+                break;
+            }
+        }
+        code = next_source(lil, fr->source);
+        if (!code) {
+            fr->done = 1;
+            break;
+        }
+        fr->state = 1;
+        push_script(lil, NULL, code->d, code->l);
+        break;
+    }
     }
-    return lil_alloc_integer((lilint_t)total);
 }
 
-static lil_value_t real_trim(const char* str, const char* chars, int left, int right)
+/* removes the top frame and hands its result to the frame below */
+static void pop_frame(lil_t lil)
 {
-    int base = 0;
-    lil_value_t r = NULL;
-    if (left) {
-        while (str[base] && strchr(chars, str[base])) base++;
-        if (!right) r = lil_alloc_string(str[base] ? str + base : NULL);
-    }
-    if (right) {
-        size_t len;
-        char* s;
-        s = strclone(str + base);
-        len = strlen(s);
-        while (len && strchr(chars, s[len - 1])) len--;
-        s[len] = 0;
-        r = lil_alloc_string(s);
-        free(s);
+    lil_exec_t* exec = lil->exec;
+    struct _lil_frame_t* fr = exec->top;
+    struct _lil_frame_t* up = fr->up;
+    lil_value_t val = fr->val;
+    fr->val = NULL;
+    if (fr->funclevel && lil->env->retval_set) {
+        lil_free_value(val);
+        val = lil->env->retval;
+        lil->env->retval = NULL;
+        lil->env->retval_set = 0;
+        lil->env->breakrun = 0;
     }
-    return r;
+    if (fr->ownenv) {
+        lil->env = fr->env;
+        lil_pop_env(lil);
+    }
+    if (fr->catcher) lil->in_catcher--;
+    exec->top = up;
+    exec->frames--;
+    if (!up) {
+        exec->result = val ? val : alloc_value(NULL);
+    } else if (fr->kind == FRAME_SUBST) {
+        lil_free_value(val);
+        up->retlist = fr->words;
+        fr->words = NULL;
+    } else {
+        up->ret = val ? val : alloc_value(NULL);
+        if (fr->kind == FRAME_WORD) up->head += fr->head;
+    }
+    free_frame(fr);
 }
 
-static LILCALLBACK lil_value_t fnc_trim(lil_t lil, size_t argc, lil_value_t* argv)
+/* pops frames until a try catches the error */
+static void exec_unwind(lil_t lil)
 {
-    if (!argc) return NULL;
-    return real_trim(lil_to_string(argv[0]), argc < 2 ? " \f\n\r\t\v" : lil_to_string(argv[1]), 1, 1);
+    lil_exec_t* exec = lil->exec;
+    while (exec->top) {
+        struct _lil_frame_t* fr = exec->top;
+        lil->env = fr->env;
+        lil->downenv = fr->downenv;
+        if (fr->kind == FRAME_CODE && fr->state == FS_CALL && lil->error == ERROR_FIXHEAD) {
+            lil->error = ERROR_DEFAULT;
+            lil->err_head = fr->head;
+            lil->err_code = fr->code;
+        }
+        if (fr->kind == FRAME_SOURCE) source_error(lil, fr->source);
+        if (fr->kind == FRAME_TRY && fr->state == 1) {
+            lil->error = ERROR_NOERROR;
+            lil_free_value(fr->ret);
+            fr->ret = NULL;
+            fr->state = 2;
+            if (fr->argc > 1) push_value(lil, FRAME_CODE, fr->argv[1]);
+            else fr->done = 1;
+            return;
+        }
+        pop_frame(lil);
+    }
 }
 
-static LILCALLBACK lil_value_t fnc_ltrim(lil_t lil, size_t argc, lil_value_t* argv)
+static lil_exec_t* start_exec(lil_t lil, lil_exec_t* exec, lil_env_t env, const char* code, size_t codelen, int funclevel)
 {
-    if (!argc) return NULL;
-    return real_trim(lil_to_string(argv[0]), argc < 2 ? " \f\n\r\t\v" : lil_to_string(argv[1]), 1, 0);
+    lil_exec_t* save_exec = lil->exec;
+    lil_env_t save_env = lil->env;
+    struct _lil_frame_t* fr;
+    lil->exec = exec;
+    lil->env = env;
+    fr = push_owned(lil, FRAME_CODE, alloc_value_len(code, codelen ? codelen : strlen(code)));
+    lil->exec = save_exec;
+    lil->env = save_env;
+    if (!fr) return NULL;
+    fr->funclevel = funclevel;
+    if (funclevel) env->breakrun = 0;
+    return exec;
+}
+
+int lil_start(lil_t lil, const char* code, size_t codelen, int funclevel)
+{
+    lil_exec_t* exec = lil->mainexec;
+    if (exec && exec->top) return 0;
+    if (!exec) {
+        exec = lil->mainexec = calloc(1, sizeof(lil_exec_t));
+        if (!exec) return 0;
+    }
+    lil_free_value(exec->result);
+    exec->result = NULL;
+    exec->killed = exec->error = 0;
+    free(exec->err_msg);
+    exec->err_msg = NULL;
+    lil->error = ERROR_NOERROR;
+    if (!start_exec(lil, exec, lil->env, code, codelen, funclevel)) return 0;
+    if (!lil->code) lil->rootcode = exec->top->code;
+    return 1;
 }
 
-static LILCALLBACK lil_value_t fnc_rtrim(lil_t lil, size_t argc, lil_value_t* argv)
+lilint_t lil_spawn(lil_t lil, const char* code, size_t codelen)
 {
-    if (!argc) return NULL;
-    return real_trim(lil_to_string(argv[0]), argc < 2 ? " \f\n\r\t\v" : lil_to_string(argv[1]), 0, 1);
+    lil_exec_t* exec = calloc(1, sizeof(lil_exec_t));
+    lil_exec_t** tail = &lil->execs;
+    lil_env_t env;
+    if (!exec) return 0;
+    /* every coroutine gets its own locals on top of the globals */
+    env = lil_alloc_env(lil->rootenv);
+    if (!start_exec(lil, exec, env, code, codelen, 1)) {
+        lil_free_env(env);
+        free(exec);
+        return 0;
+    }
+    exec->top->ownenv = 1;
+    exec->id = ++lil->lastexec;
+    while (*tail) tail = &(*tail)->next;
+    *tail = exec;
+    return exec->id;
 }
 
-static LILCALLBACK lil_value_t fnc_strcmp(lil_t lil, size_t argc, lil_value_t* argv)
+static lil_exec_t* find_exec(lil_t lil, lilint_t id)
 {
-    if (argc < 2) return NULL;
-    return lil_alloc_integer(strcmp(lil_to_string(argv[0]), lil_to_string(argv[1])));
+    lil_exec_t* exec;
+    if (!id) return lil->mainexec;
+    for (exec = lil->execs; exec; exec = exec->next)
+        if (exec->id == id) return exec;
+    return NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_streq(lil_t lil, size_t argc, lil_value_t* argv)
+static int exec_alive(lil_exec_t* exec)
 {
-    if (argc < 2) return NULL;
-    return lil_alloc_integer(strcmp(lil_to_string(argv[0]), lil_to_string(argv[1]))?0:1);
+    return exec && exec->top && !exec->killed;
 }
 
-static LILCALLBACK lil_value_t fnc_repstr(lil_t lil, size_t argc, lil_value_t* argv)
+/* runs a coroutine until it suspends, ends or uses up its slice */
+static void run_exec(lil_t lil, lil_exec_t* exec, size_t depth)
 {
-    const char* from;
-    const char* to;
-    char* src;
-    const char* sub;
-    size_t idx;
-    size_t fromlen;
-    size_t tolen;
-    size_t srclen;
-    lil_value_t r;
-    if (argc < 1) return NULL;
-    if (argc < 3) return lil_clone_value(argv[0]);
-    from = lil_to_string(argv[1]);
-    to = lil_to_string(argv[2]);
-    if (!from[0]) return NULL;
-    src = strclone(lil_to_string(argv[0]));
-    srclen = strlen(src);
-    fromlen = strlen(from);
-    tolen = strlen(to);
-    while ((sub = strstr(src, from))) {
-        char* newsrc = malloc(srclen - fromlen + tolen + 1);
-        idx = sub - src;
-        if (idx) memcpy(newsrc, src, idx);
-        memcpy(newsrc + idx, to, tolen);
-        memcpy(newsrc + idx + tolen, src + idx + fromlen, srclen - idx - fromlen);
-        srclen = srclen - fromlen + tolen;
-        free(src);
-        src = newsrc;
-        src[srclen] = 0;
-    }
-    r = lil_alloc_string(src);
-    free(src);
-    return r;
+    size_t steps = 0;
+    lil->exec = exec;
+    exec->depth = depth;
+    exec->suspend = 0;
+    while (exec->top && !exec->suspend && !exec->killed && steps++ < EXEC_SLICE) {
+        struct _lil_frame_t* fr = exec->top;
+        lil->env = fr->env;
+        lil->downenv = fr->downenv;
+        if (fr->done) {
+            pop_frame(lil);
+            continue;
+        }
+        if (is_code_frame(fr)) {
+            lil->code = fr->code;
+            lil->clen = fr->clen;
+            lil->head = fr->head;
+            lil->ignoreeol = fr->ignoreeol;
+            step_code(lil, fr);
+            fr->head = lil->head;
+        } else {
+            step_control(lil, fr);
+        }
+        if (lil->error) exec_unwind(lil);
+    }
+    if (!exec->top && lil->error) {
+        /* unhandled errors end only the coroutine that raised them */
+        if (lil->callback[LIL_CALLBACK_ERROR] && depth == 1) {
+            lil_error_callback_proc_t proc = (lil_error_callback_proc_t)lil->callback[LIL_CALLBACK_ERROR];
+            lil_flush(lil);
+            proc(lil, lil->err_head, lil->err_msg);
+        }
+        exec->error = lil->error;
+        exec->err_head = lil->err_head;
+        exec->err_msg = lil->err_msg;
+        lil->error = ERROR_NOERROR;
+        lil->err_msg = NULL;
+    }
+    lil->exec = NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_split(lil_t lil, size_t argc, lil_value_t* argv)
+int lil_resume(lil_t lil)
 {
-    lil_list_t list;
-    const char* sep = " ";
-    size_t i;
-    lil_value_t val;
-    const char* str;
-    if (argc == 0) return NULL;
-    if (argc > 1) {
-        sep = lil_to_string(argv[1]);
-        if (!sep || !sep[0]) return lil_clone_value(argv[0]);
-    }
-    val = lil_alloc_string("");
-    str = lil_to_string(argv[0]);
-    list = lil_alloc_list();
-    for (i=0; str[i]; i++) {
-        if (strchr(sep, str[i])) {
-            lil_list_append(list, val);
-            val = lil_alloc_string("");
+    const char* save_code = lil->code;
+    size_t save_clen = lil->clen;
+    size_t save_head = lil->head;
+    int save_igeol = lil->ignoreeol;
+    lil_env_t save_env = lil->env;
+    lil_env_t save_downenv = lil->downenv;
+    lil_exec_t* exec;
+    lil_exec_t** link;
+    size_t depth;
+    int running = 0;
+    if (lil->exec) return LIL_RUN_SUSPENDED; /* called from a native */
+    depth = ++lil->parse_depth;
+    if (exec_alive(lil->mainexec)) run_exec(lil, lil->mainexec, depth);
+    for (exec = lil->execs; exec; exec = exec->next)
+        if (exec_alive(exec)) run_exec(lil, exec, depth);
+    /* drop the coroutines that ended */
+    link = &lil->execs;
+    while (*link) {
+        exec = *link;
+        if (exec_alive(exec)) {
+            running = 1;
+            link = &exec->next;
         } else {
-            lil_append_char(val, str[i]);
+            *link = exec->next;
+            free_exec(lil, exec);
         }
     }
-    lil_list_append(list, val);
-    val = lil_list_to_value(list, 1);
-    lil_free_list(list);
-    return val;
+    if (lil->mainexec && lil->mainexec->killed) clear_exec(lil, lil->mainexec);
+    if (exec_alive(lil->mainexec)) {
+        running = 1;
+    } else if (!running && lil->mainexec && lil->mainexec->error) {
+        /* report the main script's error once everything has finished */
+        free(lil->err_msg);
+        lil->error = lil->mainexec->error;
+        lil->err_head = lil->mainexec->err_head;
+        lil->err_msg = lil->mainexec->err_msg;
+        lil->mainexec->error = 0;
+        lil->mainexec->err_msg = NULL;
+    }
+    if (depth == 1) lil_flush(lil);
+    lil->parse_depth--;
+    lil->code = save_code;
+    lil->clen = save_clen;
+    lil->head = save_head;
+    lil->ignoreeol = save_igeol;
+    lil->env = save_env;
+    lil->downenv = save_downenv;
+    return running ? LIL_RUN_SUSPENDED : LIL_RUN_DONE;
 }
 
-static LILCALLBACK lil_value_t fnc_try(lil_t lil, size_t argc, lil_value_t* argv)
+lil_value_t lil_run_result(lil_t lil)
 {
     lil_value_t r;
-    if (argc < 1) return NULL;
-    if (lil->error) return NULL;
-    r = lil_parse_value(lil, argv[0], 0);
-    if (lil->error) {
-        lil->error = ERROR_NOERROR;
-        lil_free_value(r);
-        if (argc > 1) r = lil_parse_value(lil, argv[1], 0);
-        else r = 0;
-    }
+    if (!lil->mainexec || lil->mainexec->top) return NULL;
+    r = lil->mainexec->result;
+    lil->mainexec->result = NULL;
     return r;
 }
 
-static LILCALLBACK lil_value_t fnc_error(lil_t lil, size_t argc, lil_value_t* argv)
+int lil_suspend(lil_t lil, lil_value_t state)
 {
-    lil_set_error(lil, argc > 0 ? lil_to_string(argv[0]) : NULL);
-    return NULL;
+    lil_exec_t* exec = lil->exec;
+    lil_value_t pstate;
+    if (!exec || !exec->invoking || lil->parse_depth != exec->depth) return 0;
+    pstate = lil_clone_value(state);
+    lil_free_value(exec->top->pstate);
+    exec->top->pstate = pstate;
+    exec->suspend = 1;
+    return 1;
 }
 
-static LILCALLBACK lil_value_t fnc_exit(lil_t lil, size_t argc, lil_value_t* argv)
+lil_value_t lil_suspend_state(lil_t lil)
 {
-    if (lil->callback[LIL_CALLBACK_EXIT]) {
-        lil_exit_callback_proc_t proc = (lil_exit_callback_proc_t)lil->callback[LIL_CALLBACK_EXIT];
-        proc(lil, argc > 0 ? argv[0] : NULL);
-    }
-    return NULL;
+    lil_exec_t* exec = lil->exec;
+    if (!exec || !exec->invoking || lil->parse_depth != exec->depth) return NULL;
+    return exec->top->pstate;
 }
 
-static LILCALLBACK lil_value_t fnc_source(lil_t lil, size_t argc, lil_value_t* argv)
+static LILCALLBACK lil_value_t fnc_spawn(lil_t lil, size_t argc, lil_value_t* argv)
 {
-    FILE* f;
-    size_t size;
-    char* buffer;
-    lil_value_t r;
+    lilint_t id;
     if (argc < 1) return NULL;
-    if (lil->callback[LIL_CALLBACK_SOURCE]) {
-        lil_source_callback_proc_t proc = (lil_source_callback_proc_t)lil->callback[LIL_CALLBACK_SOURCE];
-        buffer = proc(lil, lil_to_string(argv[0]));
-    } else if (lil->callback[LIL_CALLBACK_READ]) {
-        lil_read_callback_proc_t proc = (lil_read_callback_proc_t)lil->callback[LIL_CALLBACK_READ];
-        buffer = proc(lil, lil_to_string(argv[0]));
-    } else {
-        f = fopen(lil_to_string(argv[0]), "rb");
-        if (!f) return NULL;
-        fseek(f, 0, SEEK_END);
-        size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        buffer = malloc(size + 1);
-        fread(buffer, 1, size, f);
-        buffer[size] = 0;
-        fclose(f);
-    }
-    r = lil_parse(lil, buffer, 0, 0);
-    free(buffer);
-    return r;
+    id = lil_spawn(lil, lil_to_string(argv[0]), argv[0]->l);
+    return id ? lil_alloc_integer(id) : NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_lmap(lil_t lil, size_t argc, lil_value_t* argv)
+static LILCALLBACK lil_value_t fnc_yield(lil_t lil, size_t argc, lil_value_t* argv)
 {
-    lil_list_t list;
-    size_t i;
-    if (argc < 2) return NULL;
-    list = lil_subst_to_list(lil, argv[0]);
-    for (i=1; i<argc; i++)
-        lil_set_var(lil, lil_to_string(argv[i]), lil_list_get(list, i - 1), LIL_SETVAR_LOCAL);
-    lil_free_list(list);
+    if (!lil_suspend_state(lil)) lil_suspend(lil, lil->empty);
     return NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_rand(lil_t lil, size_t argc, lil_value_t* argv)
+static LILCALLBACK lil_value_t fnc_coroutine(lil_t lil, size_t argc, lil_value_t* argv)
 {
-    return lil_alloc_double(rand()/(double)RAND_MAX);
+    const char* type;
+    lil_exec_t* exec;
+    if (!argc) return NULL;
+    type = lil_to_string(argv[0]);
+    if (!strcmp(type, "current")) {
+        return lil->exec ? lil_alloc_integer(lil->exec->id) : NULL;
+    }
+    if (!strcmp(type, "list")) {
+        lil_list_t ids = lil_alloc_list();
+        lil_value_t r;
+        if (exec_alive(lil->mainexec)) lil_list_append(ids, lil_alloc_integer(0));
+        for (exec = lil->execs; exec; exec = exec->next)
+            if (exec_alive(exec)) lil_list_append(ids, lil_alloc_integer(exec->id));
+        r = lil_list_to_value(ids, 1);
+        lil_free_list(ids);
+        return r;
+    }
+    if (argc < 2) return NULL;
+    exec = find_exec(lil, lil_to_integer(argv[1]));
+    if (!strcmp(type, "alive")) {
+        return lil_alloc_integer(exec_alive(exec));
+    }
+    if (!strcmp(type, "kill")) {
+        if (exec_alive(exec)) {
+            exec->killed = 1;
+            if (exec == lil->exec) exec->suspend = 1;
+        }
+        return NULL;
+    }
+    if (!strcmp(type, "wait")) {
+        if (exec == lil->exec) {
+            lil_set_error(lil, "a coroutine cannot wait for itself");
+        } else if (exec_alive(exec) && !lil_suspend(lil, NULL)) {
+            lil_set_error(lil, "coroutine wait needs a script run with lil_resume");
+        }
+        return NULL;
+    }
+    return NULL;
 }
 
-static LILCALLBACK lil_value_t fnc_catcher(lil_t lil, size_t argc, lil_value_t* argv)
+/* The built-in commands, shared by all interpreters. find_cmd() looks them up
+ * with a perfect hash before the command map; after changing the entries run
+ * extras/gen_stdcmds.py to update the hash below. */
+static const struct _lil_func_t stdcmds[] = {
+    {"reflect", NULL, NULL, fnc_reflect},
+    {"func", NULL, NULL, fnc_func},
+    {"rename", NULL, NULL, fnc_rename},
+    {"unusedname", NULL, NULL, fnc_unusedname},
+    {"quote", NULL, NULL, fnc_quote},
+    {"set", NULL, NULL, fnc_set},
+    {"local", NULL, NULL, fnc_local},
+    {"write", NULL, NULL, fnc_write},
+    {"print", NULL, NULL, fnc_print},
+    {"flush", NULL, NULL, fnc_flush},
+    {"eval", NULL, NULL, fnc_eval},
+    {"topeval", NULL, NULL, fnc_topeval},
+    {"upeval", NULL, NULL, fnc_upeval},
+    {"downeval", NULL, NULL, fnc_downeval},
+    {"enveval", NULL, NULL, fnc_enveval},
+    {"jaileval", NULL, NULL, fnc_jaileval},
+    {"count", NULL, NULL, fnc_count},
+    {"index", NULL, NULL, fnc_index},
+    {"indexof", NULL, NULL, fnc_indexof},
+    {"filter", NULL, NULL, fnc_filter},
+    {"lsort", NULL, NULL, fnc_lsort},
+    {"range", NULL, NULL, fnc_range},
+    {"lrepeat", NULL, NULL, fnc_lrepeat},
+    {"lreverse", NULL, NULL, fnc_lreverse},
+    {"lsearch", NULL, NULL, fnc_lsearch},
+    {"lassign", NULL, NULL, fnc_lassign},
+    {"lset", NULL, NULL, fnc_lset},
+    {"linsert", NULL, NULL, fnc_linsert},
+    {"lremove", NULL, NULL, fnc_lremove},
+    {"list", NULL, NULL, fnc_list},
+    {"append", NULL, NULL, fnc_append},
+    {"slice", NULL, NULL, fnc_slice},
+    {"subst", NULL, NULL, fnc_subst},
+    {"concat", NULL, NULL, fnc_concat},
+    {"foreach", NULL, NULL, fnc_foreach},
+    {"dict", NULL, NULL, fnc_dict},
+    {"bytes", NULL, NULL, fnc_bytes},
+    {"array", NULL, NULL, fnc_array},
+    {"ring", NULL, NULL, fnc_ring},
+    {"format", NULL, NULL, fnc_format},
+    {"scan", NULL, NULL, fnc_scan},
+    {"json", NULL, NULL, fnc_json},
+    {"strbuf", NULL, NULL, fnc_strbuf},
+    {"return", NULL, NULL, fnc_return},
+    {"result", NULL, NULL, fnc_result},
+    {"expr", NULL, NULL, fnc_expr},
+    {"inc", NULL, NULL, fnc_inc},
+    {"dec", NULL, NULL, fnc_dec},
+    {"read", NULL, NULL, fnc_read},
+    {"store", NULL, NULL, fnc_store},
+    {"if", NULL, NULL, fnc_if},
+    {"while", NULL, NULL, fnc_while},
+    {"for", NULL, NULL, fnc_for},
+    {"char", NULL, NULL, fnc_char},
+    {"charat", NULL, NULL, fnc_charat},
+    {"codeat", NULL, NULL, fnc_codeat},
+    {"substr", NULL, NULL, fnc_substr},
+    {"strpos", NULL, NULL, fnc_strpos},
+    {"length", NULL, NULL, fnc_length},
+    {"trim", NULL, NULL, fnc_trim},
+    {"ltrim", NULL, NULL, fnc_ltrim},
+    {"rtrim", NULL, NULL, fnc_rtrim},
+    {"strcmp", NULL, NULL, fnc_strcmp},
+    {"streq", NULL, NULL, fnc_streq},
+    {"repstr", NULL, NULL, fnc_repstr},
+    {"split", NULL, NULL, fnc_split},
+    {"try", NULL, NULL, fnc_try},
+    {"error", NULL, NULL, fnc_error},
+    {"exit", NULL, NULL, fnc_exit},
+    {"source", NULL, NULL, fnc_source},
+    {"lmap", NULL, NULL, fnc_lmap},
+    {"rand", NULL, NULL, fnc_rand},
+    {"catcher", NULL, NULL, fnc_catcher},
+    {"watch", NULL, NULL, fnc_watch},
+    {"spawn", NULL, NULL, fnc_spawn},
+    {"yield", NULL, NULL, fnc_yield},
+    {"coroutine", NULL, NULL, fnc_coroutine},
+};
+
+/* generated by extras/gen_stdcmds.py, do not edit */
+#define STDCMD_SEED 798472UL
+#define STDCMD_SLOTMASK 0xFF
+static const unsigned char stdcmd_slot[256] = {
+    0, 0, 40, 0, 0, 0, 0, 46, 0, 17, 0, 0, 50, 21, 42, 57,
+    0, 0, 52, 0, 0, 73, 14, 0, 0, 0, 0, 0, 0, 0, 67, 0,
+    0, 0, 0, 0, 0, 31, 0, 0, 72, 0, 0, 0, 0, 60, 0, 0,
+    0, 0, 0, 0, 0, 62, 0, 2, 0, 0, 0, 0, 19, 39, 0, 0,
+    64, 0, 43, 0, 32, 0, 36, 0, 0, 68, 0, 0, 0, 0, 0, 33,
+    0, 0, 0, 0, 0, 0, 0, 48, 0, 0, 0, 56, 51, 0, 11, 0,
+    0, 1, 0, 58, 0, 0, 0, 0, 7, 0, 0, 0, 53, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 71, 0, 0, 47, 18, 70, 27, 0,
+    13, 0, 0, 41, 26, 28, 0, 0, 0, 38, 0, 0, 0, 0, 16, 0,
+    0, 0, 3, 8, 0, 63, 61, 0, 37, 0, 0, 49, 10, 22, 0, 0,
+    34, 0, 75, 0, 29, 0, 30, 25, 0, 54, 65, 0, 0, 0, 0, 0,
+    23, 0, 0, 0, 59, 0, 0, 0, 0, 77, 0, 0, 0, 0, 0, 0,
+    66, 0, 0, 0, 0, 24, 0, 0, 0, 0, 0, 12, 0, 0, 0, 20,
+    0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 9, 0, 69, 0, 0, 0,
+    0, 0, 44, 0, 0, 0, 0, 15, 0, 35, 5, 0, 0, 0, 0, 0,
+    0, 76, 74, 0, 0, 0, 0, 6, 0, 0, 55, 0, 45, 0, 0, 0,
+};
+/* end of generated part */
+
+static int find_stdcmd(const char* name)
 {
-    if (argc == 0) {
-        return lil_alloc_string(lil->catcher);
-    } else {
-        const char* catcher = lil_to_string(argv[0]);
-        free(lil->catcher);
-        lil->catcher = catcher[0] ? strclone(catcher) : NULL;
-    }
-    return NULL;
+    unsigned long h = STDCMD_SEED;
+    const char* p;
+    int i;
+    for (p=name; *p; p++) h = (h*31 + (unsigned char)*p) & 0xFFFFFFFFUL;
+    i = stdcmd_slot[(h ^ (h >> 15)) & STDCMD_SLOTMASK] - 1;
+    return i >= 0 && !strcmp(stdcmds[i].name, name) ? i : -1;
 }
 
-static LILCALLBACK lil_value_t fnc_watch(lil_t lil, size_t argc, lil_value_t* argv)
+static lil_func_t stdcmd(int index)
 {
-    size_t i;
-    const char* wcode;
-    if (argc < 2) return NULL;
-    wcode = lil_to_string(argv[argc - 1]);
-    for (i=0; i + 1 < argc; i++) {
-        const char* vname = lil_to_string(argv[i]);
-        lil_var_t v;
-        if (!vname[0]) continue;
-        v = lil_find_var(lil, lil->env, lil_to_string(argv[i]));
-        if (!v) v = lil_set_var(lil, vname, NULL, LIL_SETVAR_LOCAL_NEW);
-        free(v->w);
-        v->w = wcode[0] ? strclone(wcode) : NULL;
-    }
-    return NULL;
+    if (index < 0 || index >= (int)(sizeof(stdcmds)/sizeof(stdcmds[0]))) return NULL;
+    return (lil_func_t)(stdcmds + index);
 }
 
-static void register_stdcmds(lil_t lil)
-{
-    lil_register(lil, "reflect", fnc_reflect);
-    lil_register(lil, "func", fnc_func);
-    lil_register(lil, "rename", fnc_rename);
-    lil_register(lil, "unusedname", fnc_unusedname);
-    lil_register(lil, "quote", fnc_quote);
-    lil_register(lil, "set", fnc_set);
-    lil_register(lil, "local", fnc_local);
-    lil_register(lil, "write", fnc_write);
-    lil_register(lil, "print", fnc_print);
-    lil_register(lil, "eval", fnc_eval);
-    lil_register(lil, "topeval", fnc_topeval);
-    lil_register(lil, "upeval", fnc_upeval);
-    lil_register(lil, "downeval", fnc_downeval);
-    lil_register(lil, "enveval", fnc_enveval);
-    lil_register(lil, "jaileval", fnc_jaileval);
-    lil_register(lil, "count", fnc_count);
-    lil_register(lil, "index", fnc_index);
-    lil_register(lil, "indexof", fnc_indexof);
-    lil_register(lil, "filter", fnc_filter);
-    lil_register(lil, "list", fnc_list);
-    lil_register(lil, "append", fnc_append);
-    lil_register(lil, "slice", fnc_slice);
-    lil_register(lil, "subst", fnc_subst);
-    lil_register(lil, "concat", fnc_concat);
-    lil_register(lil, "foreach", fnc_foreach);
-    lil_register(lil, "return", fnc_return);
-    lil_register(lil, "result", fnc_result);
-    lil_register(lil, "expr", fnc_expr);
-    lil_register(lil, "inc", fnc_inc);
-    lil_register(lil, "dec", fnc_dec);
-    lil_register(lil, "read", fnc_read);
-    lil_register(lil, "store", fnc_store);
-    lil_register(lil, "if", fnc_if);
-    lil_register(lil, "while", fnc_while);
-    lil_register(lil, "for", fnc_for);
-    lil_register(lil, "char", fnc_char);
-    lil_register(lil, "charat", fnc_charat);
-    lil_register(lil, "codeat", fnc_codeat);
-    lil_register(lil, "substr", fnc_substr);
-    lil_register(lil, "strpos", fnc_strpos);
-    lil_register(lil, "length", fnc_length);
-    lil_register(lil, "trim", fnc_trim);
-    lil_register(lil, "ltrim", fnc_ltrim);
-    lil_register(lil, "rtrim", fnc_rtrim);
-    lil_register(lil, "strcmp", fnc_strcmp);
-    lil_register(lil, "streq", fnc_streq);
-    lil_register(lil, "repstr", fnc_repstr);
-    lil_register(lil, "split", fnc_split);
-    lil_register(lil, "try", fnc_try);
-    lil_register(lil, "error", fnc_error);
-    lil_register(lil, "exit", fnc_exit);
-    lil_register(lil, "source", fnc_source);
-    lil_register(lil, "lmap", fnc_lmap);
-    lil_register(lil, "rand", fnc_rand);
-    lil_register(lil, "catcher", fnc_catcher);
-    lil_register(lil, "watch", fnc_watch);
-    lil->syscmds = lil->cmds;
+static int stdcmd_index(lil_func_t cmd)
+{
+    const struct _lil_func_t* c = cmd;
+    if (c < stdcmds || c >= stdcmds + sizeof(stdcmds)/sizeof(stdcmds[0])) return -1;
+    return (int)(c - stdcmds);
 }
@@ -41,13 +41,23 @@
 #define LIL_CALLBACK_GETVAR 7
 #define LIL_CALLBACK_EMBEDDEDFILTER 8
 #define LIL_CALLBACK_CHECKINTERRUPT 9
+#define LIL_CALLBACK_SOURCEREAD 10
 
 #define LIL_TYPE_STRING 0
 #define LIL_TYPE_INTEGER 1
 #define LIL_TYPE_DOUBLE 2
+#define LIL_TYPE_DICT 3
+#define LIL_TYPE_LIST 4
 
 #define LIL_EMBED_NOFLAGS 0x0000
 
+#define LIL_RUN_DONE 0
+#define LIL_RUN_SUSPENDED 1
+
+#define LIL_OUTPUT_DIRECT 0
+#define LIL_OUTPUT_LINE 1
+#define LIL_OUTPUT_FULL 2
+
 #if defined(LILDLL) && (defined(WIN32) || defined(_WIN32))
 #ifdef __LIL_C_FILE__
 #define LILAPI __declspec(dllexport __stdcall)
@@ -83,6 +93,8 @@ typedef struct _lil_var_t* lil_var_t;
 typedef struct _lil_env_t* lil_env_t;
 typedef struct _lil_list_t* lil_list_t;
 typedef struct _lil_t* lil_t;
+typedef struct _lil_pool_t* lil_pool_t;
+typedef struct _lil_ring_t* lil_ring_t;
 typedef LILCALLBACK lil_value_t (*lil_func_proc_t)(lil_t lil, size_t argc, lil_value_t* argv);
 typedef LILCALLBACK void (*lil_exit_callback_proc_t)(lil_t lil, lil_value_t arg);
 typedef LILCALLBACK void (*lil_write_callback_proc_t)(lil_t lil, const char* msg);
@@ -94,18 +106,36 @@ typedef LILCALLBACK int (*lil_setvar_callback_proc_t)(lil_t lil, const char* nam
 typedef LILCALLBACK int (*lil_getvar_callback_proc_t)(lil_t lil, const char* name, lil_value_t* value);
 typedef LILCALLBACK const char* (*lil_embeddedfilter_callback_proc_t)(lil_t lil, const char* msg);
 typedef LILCALLBACK const char* (*lil_checkinterrupt_callback_proc_t)(lil_t lil);
+typedef LILCALLBACK size_t (*lil_sourceread_callback_proc_t)(lil_t lil, const char* name, size_t offset, char* buf, size_t size);
+typedef LILCALLBACK int (*lil_embedded_sink_proc_t)(lil_t lil, const char* data, size_t len, void* userdata);
 typedef LILCALLBACK void (*lil_callback_proc_t)(void);
+typedef LILCALLBACK void (*lil_pool_setup_proc_t)(lil_t lil);
 
 LILAPI lil_t lil_new(void);
 LILAPI void lil_free(lil_t lil);
+LILAPI lil_t lil_clone_interp(lil_t src);
 
 LILAPI int lil_register(lil_t lil, const char* name, lil_func_proc_t proc);
 
 LILAPI lil_value_t lil_parse(lil_t lil, const char* code, size_t codelen, int funclevel);
 LILAPI lil_value_t lil_parse_value(lil_t lil, lil_value_t val, int funclevel);
+LILAPI lil_value_t lil_parse_image(lil_t lil, const void* image, size_t size, int funclevel);
+LILAPI void* lil_compile(lil_t lil, const char* code, size_t codelen, size_t* size);
 LILAPI lil_value_t lil_call(lil_t lil, const char* funcname, size_t argc, lil_value_t* argv);
 LILAPI int lil_break_run(lil_t lil, int dobreak);
 
+LILAPI int lil_start(lil_t lil, const char* code, size_t codelen, int funclevel);
+LILAPI int lil_resume(lil_t lil);
+LILAPI lil_value_t lil_run_result(lil_t lil);
+LILAPI int lil_suspend(lil_t lil, lil_value_t state);
+LILAPI lil_value_t lil_suspend_state(lil_t lil);
+LILAPI lilint_t lil_spawn(lil_t lil, const char* code, size_t codelen);
+
+LILAPI lil_pool_t lil_pool_new(size_t count, lil_pool_setup_proc_t setup);
+LILAPI void lil_pool_free(lil_pool_t pool);
+LILAPI lil_t lil_pool_get(lil_pool_t pool);
+LILAPI void lil_pool_put(lil_pool_t pool, lil_t lil);
+
 LILAPI void lil_callback(lil_t lil, int cb, lil_callback_proc_t proc);
 
 LILAPI void lil_set_error(lil_t lil, const char* msg);
@@ -155,8 +185,16 @@ LILAPI void lil_set_data(lil_t lil, void* data);
 LILAPI void* lil_get_data(lil_t lil);
 
 LILAPI char* lil_embedded(lil_t lil, const char* code, unsigned int flags);
+LILAPI int lil_embedded_stream(lil_t lil, const char* code, unsigned int flags, lil_embedded_sink_proc_t sink, void* userdata);
 LILAPI void lil_freemem(void* ptr);
 
 LILAPI void lil_write(lil_t lil, const char* msg);
+LILAPI void lil_flush(lil_t lil);
+LILAPI int lil_set_output(lil_t lil, int policy, size_t size);
+
+LILAPI lil_ring_t lil_alloc_ring(lil_t lil, const char* name, size_t size);
+LILAPI lil_ring_t lil_find_ring(lil_t lil, const char* name);
+LILAPI void lil_free_ring(lil_t lil, const char* name);
+LILAPI int lil_ring_put(lil_ring_t ring, double value);
 
 #endif
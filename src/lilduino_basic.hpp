@@ -8,6 +8,9 @@ Some basic arduino functions that don't fit in their own library.
                        m/ms/milliseconds,
                        u/us/microseconds
       Default is 10 milliseconds
+      When the script is run with lil_start()/lil_resume() the
+      millisecond and second delays suspend the script instead
+      of blocking the whole sketch.
 
 More to come!!
 
@@ -23,41 +26,42 @@ More to come!!
 
 lil_value_t fnc_delay(lil_t lil, int argc, lil_value_t* argv) {
     LIL_CHECKARGS(lil, "delay", argc, 0, 2);
-    switch (argc) {
-        case 0:
-            delay(10); // Debouncing call
-            break;
-        case 1:
-        case 2: {
-            int num = (int)lil_to_integer(argv[0]);
-            char unit = 'm';
-            if (argc == 2) {
-                const char* u = lil_to_string(argv[1]);
-                if (streq(u, "m") || streq(u, "ms") || streq(u, "milliseconds") || streq(u, "millisecond")) {
-                    unit = 'm';
-                }
-                else if (streq(u, "u") || streq(u, "us") || streq(u, "microseconds") || streq(u, "microsecond")) {
-                    unit = 'u';
-                }
-                else if (streq(u, "s") || streq(u, "sec") || streq(u, "seconds") || streq(u, "second")) {
-                    unit = 's';
-                }
-                else {
-                    LIL_FAILED(lil, "Unknown unit for wait: %s", u);
-                    return NULL;
-                }
+    lil_value_t until = lil_suspend_state(lil);
+    if (until != NULL) {
+        // Resumed: keep waiting until the deadline passes
+        if ((long)(millis() - (unsigned long)lil_to_integer(until)) < 0) lil_suspend(lil, until);
+        return NULL;
+    }
+    unsigned long ms = 10; // Debouncing call
+    if (argc > 0) {
+        int num = (int)lil_to_integer(argv[0]);
+        char unit = 'm';
+        if (argc == 2) {
+            const char* u = lil_to_string(argv[1]);
+            if (streq(u, "m") || streq(u, "ms") || streq(u, "milliseconds") || streq(u, "millisecond")) {
+                unit = 'm';
+            }
+            else if (streq(u, "u") || streq(u, "us") || streq(u, "microseconds") || streq(u, "microsecond")) {
+                unit = 'u';
             }
-            switch (unit) {
-                case 'm': delay(num); break;
-                case 'u': delayMicroseconds(num);
-                case 's': delay(1000 * num); break;
-                default: break; // unreachable
+            else if (streq(u, "s") || streq(u, "sec") || streq(u, "seconds") || streq(u, "second")) {
+                unit = 's';
             }
-            break;
+            else {
+                LIL_FAILED(lil, "Unknown unit for wait: %s", u);
+                return NULL;
+            }
+        }
+        switch (unit) {
+            case 'm': ms = num; break;
+            case 'u': delayMicroseconds(num); return NULL;
+            case 's': ms = 1000 * num; break;
+            default: break; // unreachable
         }
-        default:
-            break; // unreachable
     }
+    until = lil_alloc_integer(millis() + ms);
+    if (!lil_suspend(lil, until)) delay(ms);
+    lil_free_value(until);
     return NULL;
 }
 
@@ -1,7 +1,9 @@
 /*
 
 This module sets up store, read, and source to use the
-Arduino SD card file system, and write to use the serial port,
+Arduino SD card file system (source reads scripts a piece at a
+time so they don't have to fit in memory), and write to use the serial port
+a line at a time,
 as well as directing unhandled errors to the serial port, and sets
 up receiving a ~ when nothing is expected causes a "keyboard interrupt".
 
@@ -20,6 +22,8 @@ up receiving a ~ when nothing is expected causes a "keyboard interrupt".
     input [prompt]
       Print the prompt and return the next
       line of input from the serial port.
+      When the script is run with lil_start()/lil_resume()
+      the script is suspended while waiting for the line.
 
 */
 
@@ -32,7 +36,7 @@ up receiving a ~ when nothing is expected causes a "keyboard interrupt".
 #include "lilduino.h"
 
 void output_cb(lil_t lil, const char* string) {
-    Serial.printf("%s", string);
+    Serial.print(string);
 }
 
 void error_cb(lil_t lil, size_t pos, const char* msg) {
@@ -45,7 +49,31 @@ char* readfile_cb(lil_t lil, const char* filename) {
         LIL_FAILED(lil, "File %s not found", filename);
         return strdup("");
     }
-    return strdup(f.readStringUntil(0).c_str());
+    // Read straight into the buffer instead of going through a String
+    size_t size = f.size();
+    char* buf = (char*)malloc(size + 1);
+    if (buf == NULL) {
+        f.close();
+        LIL_FAILED(lil, "Out of memory reading %s", filename);
+        return strdup("");
+    }
+    size = f.read((uint8_t*)buf, size);
+    buf[size] = 0;
+    f.close();
+    return buf;
+}
+
+size_t readchunk_cb(lil_t lil, const char* filename, size_t offset, char* buf, size_t size) {
+    // Used by source to run scripts a piece at a time
+    File f = SD.open(filename, FILE_READ);
+    if (!f) {
+        LIL_FAILED(lil, "File %s not found", filename);
+        return 0;
+    }
+    size_t got = 0;
+    if (f.seek(offset)) got = f.read((uint8_t*)buf, size);
+    f.close();
+    return got;
 }
 
 void writefile_cb(lil_t lil, const char* filename, const char* contents) {
@@ -79,45 +107,45 @@ _sdfun(mkdir, mkdir)
 _sdfun(rm, remove)
 _sdfun(rmdir, rmdir)
 
-#define input_CHUNK 32
 lil_value_t fnc_input(lil_t lil, int argc, lil_value_t* argv) {
-    for (int i = 0; i < argc; i++) {
-        lil_write(lil, lil_to_string(argv[i]));
-        if (i + 1 != argc) lil_write(lil, " ");
-    }
-    size_t sz = input_CHUNK;
-    char* buf = (char*) malloc(sz);
-    if (buf == NULL) {
-        LIL_FAILED(lil, "Out of memory");
-        return NULL;
+    // The partial line is kept as the suspend state between resumes
+    lil_value_t line = lil_suspend_state(lil);
+    if (line == NULL) {
+        for (int i = 0; i < argc; i++) {
+            lil_write(lil, lil_to_string(argv[i]));
+            if (i + 1 != argc) lil_write(lil, " ");
+        }
+        // The prompt has no newline, so it would stay in the buffer
+        lil_flush(lil);
+        line = lil_alloc_string("");
     }
-    size_t ptr = 0;
+    else line = lil_clone_value(line);
     while (true) {
-        yield();
         if (Serial.available() > 0) {
             char c = Serial.read();
             if (c == '\n') break;
-            ptr++;
-            if (ptr == sz) {
-                sz += input_CHUNK;
-                buf = (char*) realloc((void*)buf, sz);
-                if (buf == NULL) {
-                    LIL_FAILED(lil, "Out of memory");
-                    return NULL;
-                }
+            if (!lil_append_char(line, c)) {
+                lil_free_value(line);
+                LIL_FAILED(lil, "Out of memory");
+                return NULL;
             }
-            buf[ptr] = c;
         }
+        else if (lil_suspend(lil, line)) {
+            lil_free_value(line);
+            return NULL;
+        }
+        else yield();
     }
-    lil_value_t val = lil_alloc_string(buf);
-    free(buf);
-    return val;
+    return line;
 }
 
 void lilduino_io_init(lil_t lil) {
     lil_callback(lil, LIL_CALLBACK_WRITE, (lil_callback_proc_t)output_cb);
+    // Whole lines go to the serial port at once
+    lil_set_output(lil, LIL_OUTPUT_LINE, 128);
     lil_callback(lil, LIL_CALLBACK_ERROR, (lil_callback_proc_t)error_cb);
     lil_callback(lil, LIL_CALLBACK_READ, (lil_callback_proc_t)readfile_cb);
+    lil_callback(lil, LIL_CALLBACK_SOURCEREAD, (lil_callback_proc_t)readchunk_cb);
     lil_callback(lil, LIL_CALLBACK_STORE, (lil_callback_proc_t)writefile_cb);
     lil_callback(lil, LIL_CALLBACK_CHECKINTERRUPT, (lil_callback_proc_t)interrupt_cb);
     lil_register(lil, "mkdir", (lil_func_proc_t)fnc_mkdir);